@@ -0,0 +1,693 @@
+/*
+ * Batch conversion of the bitmaps of a directory.
+ *
+ * Each file goes through a pipeline of stages (read, decode, process,
+ * encode, write), linked by bounded queues. Reading and writing run on a
+ * thread each, while decoding, processing and encoding share a pool of
+ * workers, so disk transfers overlap with decoding and encoding, and
+ * several images are processed at once. Files are decoded and encoded in
+ * memory, so the processing stages never touch the disk.
+ *
+ * Usage: batch_convert [-j threads] [-q depth] [-p op] [-r] input output
+ *
+ *   -j threads  workers shared by the processing stages (default: online
+ *               CPUs)
+ *   -q depth    capacity of each queue (default: 2 * threads)
+ *   -p op       processing: none (default), flip, equalize, luma
+ *   -r          run length encode 4 and 8 bit images
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "bitmap.h"
+
+/* Processing operations. */
+enum { OP_NONE, OP_FLIP, OP_EQUALIZE, OP_LUMA };
+
+/* Stages of the pipeline, also indexing the queues feeding them. */
+enum { READ, DECODE, PROCESS, ENCODE, WRITE, STAGES };
+
+/* A file on its way through the pipeline. */
+typedef struct Job
+{
+    char *name;    /* file name, inside the input and output directories */
+    uint8_t *data; /* file content (input, then output) */
+    size_t size;   /* size (byte) of the file content */
+    size_t read;   /* size (byte) of the input file */
+    Image image;   /* decoded image */
+    int failed;    /* nonzero once a stage has failed */
+} Job;
+
+/* Bounded queue of jobs, closed when all its producers are done. */
+typedef struct Queue
+{
+    pthread_mutex_t *lock;      /* lock, possibly shared with other queues */
+    pthread_cond_t *changed;    /* broadcast on each push, pop and closing */
+    pthread_mutex_t own_lock;   /* lock of a queue not shared */
+    pthread_cond_t own_changed; /* condition of a queue not shared */
+    Job **items;     /* circular buffer */
+    size_t cap;      /* capacity */
+    size_t head;     /* index of the oldest job */
+    size_t count;    /* number of queued jobs */
+    size_t reserved; /* free slots reserved for jobs under processing */
+    int producers;   /* producers still running */
+} Queue;
+
+/* Settings shared by all the stages. */
+typedef struct Options
+{
+    const char *input;  /* input directory */
+    const char *output; /* output directory */
+    int op;             /* processing operation */
+    int save_flags;     /* saving flags */
+} Options;
+
+/* Totals of a run. */
+typedef struct Totals
+{
+    pthread_mutex_t lock;
+    size_t images;      /* images written */
+    size_t failed;      /* images failed */
+    double bytes_in;    /* bytes read */
+    double bytes_out;   /* bytes written */
+} Totals;
+
+/* A stage of the pipeline. */
+typedef struct Stage
+{
+    const char *name;
+    void (*fn)(Job *job, const Options *opt);
+    Queue *in;
+    Queue *out;       /* NULL for the last stage */
+    int threads;      /* own threads, or zero for the stages of the pool */
+    const Options *opt;
+    Totals *totals;
+    pthread_mutex_t lock;
+    double busy;      /* time (s) spent in the stage, over all threads */
+} Stage;
+
+/* Current time (s). */
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* Initialize a queue, with its own lock, or with a lock and a condition
+ * shared with other queues. */
+static int queue_init(Queue *q, size_t cap, int producers,
+                      pthread_mutex_t *lock, pthread_cond_t *changed)
+{
+    memset(q, 0, sizeof (Queue));
+    q->items = (Job**) malloc(cap * sizeof (Job*));
+    if (!q->items)
+        return 1;
+
+    q->cap = cap;
+    q->producers = producers;
+    pthread_mutex_init(&q->own_lock, NULL);
+    pthread_cond_init(&q->own_changed, NULL);
+    q->lock = lock ? lock : &q->own_lock;
+    q->changed = changed ? changed : &q->own_changed;
+    return 0;
+}
+
+/* Release a queue. */
+static void queue_destroy(Queue *q)
+{
+    pthread_mutex_destroy(&q->own_lock);
+    pthread_cond_destroy(&q->own_changed);
+    free(q->items);
+}
+
+/* Append a job to a queue with a free slot (lock held). */
+static void queue_put(Queue *q, Job *job)
+{
+    q->items[(q->head + q->count++) % q->cap] = job;
+    pthread_cond_broadcast(q->changed);
+}
+
+/* Remove the oldest job from a queue with a job (lock held). */
+static Job* queue_take(Queue *q)
+{
+    Job *job = q->items[q->head];
+
+    q->head = (q->head + 1) % q->cap;
+    --q->count;
+    pthread_cond_broadcast(q->changed);
+    return job;
+}
+
+/* Add a job to a queue, waiting while the queue is full. */
+static void queue_push(Queue *q, Job *job)
+{
+    pthread_mutex_lock(q->lock);
+    while (q->count + q->reserved == q->cap)
+        pthread_cond_wait(q->changed, q->lock);
+    queue_put(q, job);
+    pthread_mutex_unlock(q->lock);
+}
+
+/* Take the oldest job from a queue, waiting while the queue is empty.
+ * Return NULL once the queue is empty and closed. */
+static Job* queue_pop(Queue *q)
+{
+    Job *job = NULL;
+
+    pthread_mutex_lock(q->lock);
+    while (!q->count && q->producers)
+        pthread_cond_wait(q->changed, q->lock);
+    if (q->count)
+        job = queue_take(q);
+    pthread_mutex_unlock(q->lock);
+
+    return job;
+}
+
+/* Signal that a producer of a queue is done. */
+static void queue_close(Queue *q)
+{
+    pthread_mutex_lock(q->lock);
+    if (!--q->producers)
+        pthread_cond_broadcast(q->changed);
+    pthread_mutex_unlock(q->lock);
+}
+
+/* Join a directory and a file name. */
+static char* join_path(const char *dir, const char *name)
+{
+    char *path = (char*) malloc(strlen(dir) + strlen(name) + 2);
+
+    if (path)
+        sprintf(path, "%s/%s", dir, name);
+    return path;
+}
+
+/* Read a whole input file. */
+static void stage_read(Job *job, const Options *opt)
+{
+    char *path = join_path(opt->input, job->name);
+    FILE *f = path ? fopen(path, "rb") : NULL;
+    long size;
+
+    if (!f
+            || fseek(f, 0, SEEK_END)
+            || (size = ftell(f)) < 0
+            || fseek(f, 0, SEEK_SET)
+            || !(job->data = (uint8_t*) malloc(size ? size : 1))
+            || fread(job->data, 1, size, f) != (size_t) size)
+    {
+        fprintf(stderr, "%s: read error.\n", job->name);
+        job->failed = 1;
+    }
+    else
+    {
+        job->size = job->read = size;
+    }
+
+    if (f)
+        fclose(f);
+    free(path);
+}
+
+/* Decode a file held in memory. */
+static void stage_decode(Job *job, const Options *opt)
+{
+    int flags = opt->op == OP_LUMA ? BMP_OPEN_LUMA : 0;
+
+    job->image = decode_bitmap_buffer_ex(job->data, job->size, flags, NULL);
+    free(job->data);
+    job->data = NULL;
+
+    if (!job->image.pixel_data && !job->image.indices)
+    {
+        fprintf(stderr, "%s: decoding error.\n", job->name);
+        job->failed = 1;
+    }
+}
+
+/* Equalize each channel of the palette of an image, the colors being 
+ * weighted by the number of pixels using them. */
+static void equalize_palette(Image *im)
+{
+    const Bmp_header *h = &im->bmp_header;
+    unsigned long *count = histogram(*im, A);
+    uint64_t cdf[256], area, cdf_min;
+    uint8_t *v;
+    size_t k;
+    int c, i;
+
+    if (!count)
+        return;
+
+    for (c = B; c <= R; ++c)
+    {
+        memset(cdf, 0, sizeof cdf);
+        for (k = 0; k < h->color_no && k < 256; ++k)
+            cdf[((uint8_t*) &im->palette[k])[c]] += count[k];
+        for (i = 1; i < 256; ++i)
+            cdf[i] += cdf[i - 1];
+        area = cdf[255];
+
+        /* a channel with a single level is left untouched */
+        for (i = 0; i < 256 && !cdf[i]; ++i)
+            ;
+        if (i == 256 || cdf[i] == area)
+            continue;
+        cdf_min = cdf[i];
+
+        for (k = 0; k < h->color_no; ++k)
+        {
+            v = (uint8_t*) &im->palette[k] + c;
+            *v = cdf[*v] < cdf_min ? 0 :
+                 ((cdf[*v] - cdf_min) * 255 + (area - cdf_min) / 2) 
+                 / (area - cdf_min);
+        }
+    }
+
+    free(count);
+}
+
+/* Apply the processing operation to an image. */
+static void stage_process(Job *job, const Options *opt)
+{
+    Image *im = &job->image;
+    int c;
+
+    switch (opt->op)
+    {
+        case OP_FLIP:
+            image_flip(im);
+            break;
+
+        /* the pixels of palette images only hold their indices, so the 
+         * palette colors are equalized instead */
+        case OP_EQUALIZE:
+            if (im->bmp_header.bit_per_pixel <= 8)
+            {
+                if (im->palette)
+                    equalize_palette(im);
+            }
+            else
+            {
+                for (c = B; c <= R; ++c)
+                    equalize(*im, c);
+            }
+            break;
+    }
+}
+
+/* Encode an image in memory. */
+static void stage_encode(Job *job, const Options *opt)
+{
+    job->size = encode_bitmap_size_ex(job->image, opt->save_flags);
+    job->data = job->size ? (uint8_t*) malloc(job->size) : NULL;
+
+    if (!job->data
+            || encode_bitmap_buffer_ex(job->image,
+                                       job->data,
+                                       job->size,
+                                       opt->save_flags,
+                                       NULL))
+    {
+        fprintf(stderr, "%s: encoding error.\n", job->name);
+        job->failed = 1;
+    }
+
+    destroy_image(&job->image);
+}
+
+/* Write an output file. */
+static void stage_write(Job *job, const Options *opt)
+{
+    char *path = join_path(opt->output, job->name);
+    FILE *f = path ? fopen(path, "wb") : NULL;
+
+    if (!f
+            || fwrite(job->data, 1, job->size, f) != job->size
+            || fclose(f))
+    {
+        fprintf(stderr, "%s: write error.\n", job->name);
+        job->failed = 1;
+    }
+
+    free(path);
+}
+
+/* Release a job. */
+static void job_free(Job *job)
+{
+    destroy_image(&job->image);
+    free(job->data);
+    free(job->name);
+    free(job);
+}
+
+/* Thread of a stage: run the stage on each job, and pass the job on. Failed
+ * jobs skip the remaining stages, and the last stage releases them. */
+static void* stage_thread(void *arg)
+{
+    Stage *s = (Stage*) arg;
+    double busy = 0.0, t;
+    Job *job;
+
+    while ((job = queue_pop(s->in)))
+    {
+        if (!job->failed)
+        {
+            t = now();
+            s->fn(job, s->opt);
+            busy += now() - t;
+        }
+
+        if (s->out)
+        {
+            queue_push(s->out, job);
+            continue;
+        }
+
+        pthread_mutex_lock(&s->totals->lock);
+        if (job->failed)
+        {
+            ++s->totals->failed;
+        }
+        else
+        {
+            ++s->totals->images;
+            s->totals->bytes_in += job->read;
+            s->totals->bytes_out += job->size;
+        }
+        pthread_mutex_unlock(&s->totals->lock);
+        job_free(job);
+    }
+
+    if (s->out)
+        queue_close(s->out);
+
+    pthread_mutex_lock(&s->lock);
+    s->busy += busy;
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+/* Pool of workers shared by the processing stages, whose queues share the
+ * lock and the condition of the pool. */
+typedef struct Pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    Stage *stages;  /* all the stages */
+    Queue *queues;  /* all the queues (queue k feeds stage k) */
+    int in_flight;  /* jobs under processing */
+} Pool;
+
+/* Worker of the pool: run the latest processing stage with a queued job, so
+ * that jobs leave the pool before new ones enter. A job is only taken when
+ * a slot of the next queue is reserved for it, so workers never wait for
+ * each other; the pool is drained once reading is over and no job is left
+ * under processing. */
+static void* pool_thread(void *arg)
+{
+    Pool *p = (Pool*) arg;
+    double busy[STAGES] = {0.0}, t;
+    Job *job;
+    int k;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;)
+    {
+        for (k = ENCODE; k >= DECODE; --k)
+        {
+            Queue *next = &p->queues[k + 1];
+            if (p->queues[k].count
+                    && (k == ENCODE || next->count + next->reserved < next->cap))
+                break;
+        }
+
+        if (k < DECODE)
+        {
+            if (!p->queues[DECODE].producers && !p->in_flight)
+                break;
+            pthread_cond_wait(&p->changed, &p->lock);
+            continue;
+        }
+
+        job = queue_take(&p->queues[k]);
+        if (k != ENCODE)
+            ++p->queues[k + 1].reserved;
+        ++p->in_flight;
+        pthread_mutex_unlock(&p->lock);
+
+        if (!job->failed)
+        {
+            t = now();
+            p->stages[k].fn(job, p->stages[k].opt);
+            busy[k] += now() - t;
+        }
+
+        /* the writing queue has its own lock, and is drained by the writer */
+        if (k == ENCODE)
+            queue_push(&p->queues[WRITE], job);
+
+        pthread_mutex_lock(&p->lock);
+        if (k != ENCODE)
+        {
+            --p->queues[k + 1].reserved;
+            queue_put(&p->queues[k + 1], job);
+        }
+        --p->in_flight;
+        pthread_cond_broadcast(&p->changed);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    queue_close(&p->queues[WRITE]);
+
+    for (k = DECODE; k <= ENCODE; ++k)
+    {
+        pthread_mutex_lock(&p->stages[k].lock);
+        p->stages[k].busy += busy[k];
+        pthread_mutex_unlock(&p->stages[k].lock);
+    }
+    return NULL;
+}
+
+/* Nonzero for names with a bitmap extension. */
+static int is_bitmap(const char *name)
+{
+    size_t n = strlen(name);
+
+    return n > 4
+        && (!strcmp(name + n - 4, ".bmp") || !strcmp(name + n - 4, ".BMP"));
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage: batch_convert [-j threads] [-q depth] "
+            "[-p none|flip|equalize|luma] [-r] input output\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *names[STAGES] = {"read", "decode", "process", "encode", "write"};
+    void (*fns[STAGES])(Job*, const Options*) =
+        {stage_read, stage_decode, stage_process, stage_encode, stage_write};
+    Stage stages[STAGES];
+    Queue queues[STAGES];
+    Pool pool;
+    pthread_t *tids;
+    Options opt;
+    Totals totals;
+    struct dirent *entry;
+    DIR *dir;
+    double start, elapsed;
+    int threads = 0, depth = 0, total_threads = 0, started = 0;
+    int c, k, i;
+
+    memset(&opt, 0, sizeof (Options));
+    while ((c = getopt(argc, argv, "j:q:p:r")) != -1)
+    {
+        switch (c)
+        {
+            case 'j':
+                threads = atoi(optarg);
+                break;
+            case 'q':
+                depth = atoi(optarg);
+                break;
+            case 'p':
+                if (!strcmp(optarg, "none"))
+                    opt.op = OP_NONE;
+                else if (!strcmp(optarg, "flip"))
+                    opt.op = OP_FLIP;
+                else if (!strcmp(optarg, "equalize"))
+                    opt.op = OP_EQUALIZE;
+                else if (!strcmp(optarg, "luma"))
+                    opt.op = OP_LUMA;
+                else
+                {
+                    usage();
+                    return 1;
+                }
+                break;
+            case 'r':
+                opt.save_flags |= BMP_SAVE_RLE;
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+    if (argc - optind != 2)
+    {
+        usage();
+        return 1;
+    }
+    opt.input = argv[optind];
+    opt.output = argv[optind + 1];
+
+    if (threads <= 0)
+        threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0)
+        threads = 1;
+    if (depth <= 0)
+        depth = 2 * threads;
+
+    dir = opendir(opt.input);
+    if (!dir)
+    {
+        fprintf(stderr, "batch_convert: cannot open %s.\n", opt.input);
+        return 1;
+    }
+    if (mkdir(opt.output, 0777) && errno != EEXIST)
+    {
+        fprintf(stderr, "batch_convert: cannot create %s.\n", opt.output);
+        closedir(dir);
+        return 1;
+    }
+
+    /* reading and writing get one thread each, while decoding, processing
+     * and encoding share a pool of `threads` workers, serving the later
+     * stages first; queue k feeds stage k, and is filled by the directory
+     * listing (k = 0), the reader (k = 1) or the pool */
+    memset(&totals, 0, sizeof (Totals));
+    pthread_mutex_init(&totals.lock, NULL);
+    memset(&pool, 0, sizeof (Pool));
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.changed, NULL);
+    pool.stages = stages;
+    pool.queues = queues;
+    total_threads = threads;
+    for (k = 0; k < STAGES; ++k)
+    {
+        int pooled = k != READ && k != WRITE;
+
+        stages[k].name = names[k];
+        stages[k].fn = fns[k];
+        stages[k].threads = pooled ? 0 : 1;
+        stages[k].in = &queues[k];
+        stages[k].out = k + 1 < STAGES ? &queues[k + 1] : NULL;
+        stages[k].opt = &opt;
+        stages[k].totals = &totals;
+        stages[k].busy = 0.0;
+        pthread_mutex_init(&stages[k].lock, NULL);
+        total_threads += stages[k].threads;
+
+        if (queue_init(&queues[k], depth, k == WRITE ? threads : 1,
+                       pooled ? &pool.lock : NULL,
+                       pooled ? &pool.changed : NULL))
+        {
+            fprintf(stderr, "batch_convert: memory error.\n");
+            return 1;
+        }
+    }
+
+    tids = (pthread_t*) malloc(total_threads * sizeof (pthread_t));
+    if (!tids)
+    {
+        fprintf(stderr, "batch_convert: memory error.\n");
+        return 1;
+    }
+
+    start = now();
+    for (k = 0; k < STAGES; ++k)
+        for (i = 0; i < stages[k].threads; ++i)
+            if (!pthread_create(&tids[started], NULL, stage_thread, &stages[k]))
+                ++started;
+    for (i = 0; i < threads; ++i)
+        if (!pthread_create(&tids[started], NULL, pool_thread, &pool))
+            ++started;
+    if (started != total_threads)
+    {
+        /* the pipeline would stall with a missing stage */
+        fprintf(stderr, "batch_convert: cannot start the threads.\n");
+        return 1;
+    }
+
+    /* the listing feeds the pipeline, and blocks while the first queue is
+     * full */
+    while ((entry = readdir(dir)))
+    {
+        Job *job;
+
+        if (!is_bitmap(entry->d_name))
+            continue;
+
+        job = (Job*) calloc(1, sizeof (Job));
+        if (!job || !(job->name = strdup(entry->d_name)))
+        {
+            fprintf(stderr, "batch_convert: memory error.\n");
+            free(job);
+            break;
+        }
+        queue_push(&queues[READ], job);
+    }
+    closedir(dir);
+    queue_close(&queues[READ]);
+
+    for (i = 0; i < started; ++i)
+        pthread_join(tids[i], NULL);
+    elapsed = now() - start;
+
+    printf("%zu images (%zu failed) in %.3f s, "
+           "%d thread%s shared by decode, process and encode\n",
+           totals.images, totals.failed, elapsed, threads,
+           threads > 1 ? "s" : "");
+    printf("%.1f images/s, %.1f MB/s read, %.1f MB/s written\n",
+           totals.images / elapsed,
+           totals.bytes_in / elapsed / 1e6,
+           totals.bytes_out / elapsed / 1e6);
+    for (k = 0; k < STAGES; ++k)
+        if (stages[k].threads)
+            printf("%-8s %8.3f s busy over %d thread%s\n",
+                   stages[k].name,
+                   stages[k].busy,
+                   stages[k].threads,
+                   stages[k].threads > 1 ? "s" : "");
+        else
+            printf("%-8s %8.3f s busy over the shared pool\n",
+                   stages[k].name,
+                   stages[k].busy);
+
+    for (k = 0; k < STAGES; ++k)
+    {
+        queue_destroy(&queues[k]);
+        pthread_mutex_destroy(&stages[k].lock);
+    }
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.changed);
+    pthread_mutex_destroy(&totals.lock);
+    free(tids);
+
+    return totals.failed ? 1 : 0;
+}
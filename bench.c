@@ -0,0 +1,510 @@
+/*
+ * Benchmark suite of the library: file I/O, histograms, equalization, color
+ * space conversions (the fixed point kernels at each SIMD level, against
+ * the original floating point loops), steganography, copy and ASCII art, on
+ * synthetic images of each bit depth and of sizes from 64x64 upwards.
+ *
+ * For each case, the best time over the runs is reported as ns per pixel
+ * and as MB/s of pixel data in file format (bpp / 8 byte per pixel, row
+ * padding included), along with the number and size of the allocations made
+ * by a run. Allocations are counted by wrapping the allocator at link time:
+ *
+ *   gcc -O2 -pthread bench.c bitmap.c -o bench \
+ *       -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,--wrap=posix_memalign
+ *
+ * Usage: bench [-f text|csv|json] [-m max_side] [-r runs] [-j threads]
+ *              [-t tmp_dir]
+ *
+ *   -f format    output format (default: text)
+ *   -m max_side  largest image side, up to 16384 (default: 4096); a 16384
+ *                side needs about 3 GB of memory at 32 bit
+ *   -r runs      minimum number of runs of each case (default: 3), repeated
+ *                for at least 0.1 s
+ *   -j threads   run the functions taking an execution context with that
+ *                many threads (default: serial)
+ *   -t tmp_dir   directory for the file I/O cases (default: $TMPDIR or /tmp)
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "bitmap.h"
+
+/* Allocator entry points, wrapped to count the allocations. */
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t n, size_t size);
+void* __real_realloc(void *ptr, size_t size);
+int __real_posix_memalign(void **ptr, size_t alignment, size_t size);
+
+static unsigned long alloc_count; /* allocations since the last reset */
+static unsigned long alloc_bytes; /* bytes requested since the last reset */
+
+/* Account for an allocation (allocations can come from worker threads). */
+static void count_alloc(size_t size)
+{
+    __atomic_fetch_add(&alloc_count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&alloc_bytes, size, __ATOMIC_RELAXED);
+}
+
+void* __wrap_malloc(size_t size)
+{
+    count_alloc(size);
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t n, size_t size)
+{
+    count_alloc(n * size);
+    return __real_calloc(n, size);
+}
+
+void* __wrap_realloc(void *ptr, size_t size)
+{
+    count_alloc(size);
+    return __real_realloc(ptr, size);
+}
+
+int __wrap_posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+    count_alloc(size);
+    return __real_posix_memalign(ptr, alignment, size);
+}
+
+/* Original floating point RGB to Y'CbCr loop (with Cb and Cr coefficients
+ * in the right place). */
+static void float_rgb2ycbcr(Image image)
+{
+    size_t i, j;
+
+    for (i = 0; i < image.bmp_header.height; ++i)
+    {
+        for (j = 0; j < image.bmp_header.width; ++j)
+        {
+            Pixel p = image.pixel_data[i][j];
+            uint8_t y;
+
+            image.pixel_data[i][j].b = y =
+                  0.299 * p.r
+                + 0.587 * p.g
+                + 0.114 * p.b;
+            image.pixel_data[i][j].g = 128 + 0.564 * (p.b - y);
+            image.pixel_data[i][j].r = 128 + 0.713 * (p.r - y);
+        }
+    }
+}
+
+/* Original floating point Y'CbCr to RGB loop. */
+static void float_ycbcr2rgb(Image image)
+{
+    size_t i, j;
+
+    for (i = 0; i < image.bmp_header.height; ++i)
+    {
+        for (j = 0; j < image.bmp_header.width; ++j)
+        {
+            Pixel p = image.pixel_data[i][j];
+
+            image.pixel_data[i][j].r = p.b + 1.402 * (p.r - 128);
+            image.pixel_data[i][j].g =
+                p.b - 0.34414 * (p.g - 128) - 0.71414 * (p.r - 128);
+            image.pixel_data[i][j].b = p.b + 1.772 * (p.g - 128);
+        }
+    }
+}
+
+/* Current time (s). */
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* Fill an image with pseudo random pixels (valid indices for palette
+ * images, with a gray ramp as palette). */
+static void fill(Image image)
+{
+    const Bmp_header *h = &image.bmp_header;
+    uint32_t s = 2463534242u;
+    size_t i, j;
+
+    for (i = 0; i < h->color_no; ++i)
+    {
+        image.palette[i].r = image.palette[i].g = image.palette[i].b =
+            i * 255 / (h->color_no - 1);
+    }
+
+    for (i = 0; i < h->height; ++i)
+    {
+        for (j = 0; j < h->width; ++j)
+        {
+            s ^= s << 13;
+            s ^= s >> 17;
+            s ^= s << 5;
+            if (h->color_no)
+                image_set_index(image, i, j, s % h->color_no);
+            else
+                memcpy(&image.pixel_data[i][j], &s, sizeof (Pixel));
+        }
+    }
+}
+
+/* State shared by the cases of an image. */
+typedef struct Bench
+{
+    Image image;         /* image under test */
+    Image copy;          /* destination of copies, same size */
+    Bmp_exec *exec;      /* execution context, or NULL */
+    const char *path;    /* file for the I/O cases */
+    char *message;       /* steganography message, filling the capacity */
+    int channel;         /* channel for histograms and equalization */
+} Bench;
+
+static int run_open(Bench *b)
+{
+    Image im = open_bitmap_ex(b->path, 0, b->exec);
+    int res = !im.pixel_data;
+
+    destroy_image(&im);
+    return res;
+}
+
+static int run_save(Bench *b)
+{
+    return save_bitmap_ex(b->image, b->path, 0, b->exec);
+}
+
+static int run_histogram(Bench *b)
+{
+    unsigned long *hist = histogram(b->image, b->channel);
+
+    free(hist);
+    return !hist;
+}
+
+static int run_equalize(Bench *b)
+{
+    return equalize_ex(b->image, b->channel, b->exec);
+}
+
+static int run_rgb2ycbcr(Bench *b)
+{
+    return rgb2ycbcr_ex(b->image, b->exec);
+}
+
+static int run_ycbcr2rgb(Bench *b)
+{
+    return ycbcr2rgb_ex(b->image, b->exec);
+}
+
+static int run_float_rgb2ycbcr(Bench *b)
+{
+    float_rgb2ycbcr(b->image);
+    return 0;
+}
+
+static int run_float_ycbcr2rgb(Bench *b)
+{
+    float_ycbcr2rgb(b->image);
+    return 0;
+}
+
+static int run_steg_write(Bench *b)
+{
+    return steganography_write(b->image, b->message);
+}
+
+static int run_steg_read(Bench *b)
+{
+    char *s = steganography_read(b->image);
+
+    free(s);
+    return !s;
+}
+
+static int run_copy(Bench *b)
+{
+    return copy_image(b->copy, b->image);
+}
+
+static int run_ascii(Bench *b)
+{
+    char *s = ascii_print(b->image);
+
+    free(s);
+    return !s;
+}
+
+/* A benchmark case. */
+typedef struct Case
+{
+    const char *name;      /* function under test */
+    int (*fn)(Bench *b);   /* one run, returning nonzero on failure */
+    int simd;              /* run at each SIMD level (-1 for the float
+                              reference, 0 for the default level, reported
+                              as "default") */
+    int min_bpp;           /* lowest bpp supported */
+    int two_colors;        /* only for two color images */
+} Case;
+
+static const Case cases[] = {
+    {"save_bitmap",         run_save,            0,  1, 0},
+    {"open_bitmap",         run_open,            0,  1, 0},
+    {"histogram",           run_histogram,       0,  1, 0},
+    {"equalize",            run_equalize,        0,  1, 0},
+    {"rgb2ycbcr",           run_float_rgb2ycbcr, -1, 16, 0},
+    {"ycbcr2rgb",           run_float_ycbcr2rgb, -1, 16, 0},
+    {"rgb2ycbcr",           run_rgb2ycbcr,       1,  16, 0},
+    {"ycbcr2rgb",           run_ycbcr2rgb,       1,  16, 0},
+    {"steganography_write", run_steg_write,      0,  16, 0},
+    {"steganography_read",  run_steg_read,       0,  16, 0},
+    {"copy_image",          run_copy,            0,  1, 0},
+    {"ascii_print",         run_ascii,           0,  1, 1},
+};
+
+/* A benchmark result. */
+typedef struct Result
+{
+    const char *name;
+    const char *variant;
+    int bpp;
+    int width;
+    int height;
+    int threads;
+    int runs;
+    double best;           /* best time (s) */
+    unsigned long allocs;  /* allocations in a run */
+    unsigned long bytes;   /* bytes allocated in a run */
+} Result;
+
+enum { TEXT, CSV, JSON };
+
+/* Print a result in the chosen format. */
+static void print_result(int format, const Result *r, int first)
+{
+    double pixels = (double) r->width * r->height;
+    size_t stride = (size_t) (r->width * r->bpp + 31) / 32 * 4;
+    double data = (double) stride * r->height;
+    double ns_px = r->best * 1e9 / pixels;
+    double mb_s = data / r->best / 1e6;
+
+    switch (format)
+    {
+        case TEXT:
+            printf("%-20s %-7s %3d %5dx%-5d %3d %4d %10.3f %10.1f %8lu %12lu\n",
+                   r->name, r->variant, r->bpp, r->width, r->height,
+                   r->threads, r->runs, ns_px, mb_s, r->allocs, r->bytes);
+            break;
+
+        case CSV:
+            printf("%s,%s,%d,%d,%d,%d,%d,%.4f,%.2f,%lu,%lu\n",
+                   r->name, r->variant, r->bpp, r->width, r->height,
+                   r->threads, r->runs, ns_px, mb_s, r->allocs, r->bytes);
+            break;
+
+        case JSON:
+            printf("%s\n    {\"function\": \"%s\", \"variant\": \"%s\", "
+                   "\"bpp\": %d, \"width\": %d, \"height\": %d, "
+                   "\"threads\": %d, \"runs\": %d, \"ns_per_pixel\": %.4f, "
+                   "\"mb_per_s\": %.2f, \"allocations\": %lu, "
+                   "\"allocated_bytes\": %lu}",
+                   first ? "" : ",",
+                   r->name, r->variant, r->bpp, r->width, r->height,
+                   r->threads, r->runs, ns_px, mb_s, r->allocs, r->bytes);
+            break;
+    }
+}
+
+/* Time a case: at least `min_runs` runs, and at least 0.1 s overall.
+ * Return nonzero on failure. */
+static int time_case(const Case *c, Bench *b, int min_runs, Result *r)
+{
+    double total = 0.0, t;
+
+    r->best = 1e30;
+    for (r->runs = 0; r->runs < min_runs || total < 0.1; ++r->runs)
+    {
+        alloc_count = alloc_bytes = 0;
+        t = now();
+        if (c->fn(b))
+            return 1;
+        t = now() - t;
+        r->allocs = alloc_count;
+        r->bytes = alloc_bytes;
+        total += t;
+        r->best = t < r->best ? t : r->best;
+    }
+
+    return 0;
+}
+
+/* Run all the cases on an image. Return the number of printed results. */
+static int run_image(Bench *b, int min_runs, int format, int printed)
+{
+    const char *levels[] = {"scalar", "ssse3", "avx2"};
+    const Bmp_header *h = &b->image.bmp_header;
+    int max_level = bmp_simd_level();
+    size_t k;
+    int level;
+    Result r;
+
+    r.bpp = h->bit_per_pixel;
+    r.width = h->width;
+    r.height = h->height;
+    r.threads = b->exec ? bmp_exec_threads(b->exec) : 1;
+
+    for (k = 0; k < sizeof cases / sizeof *cases; ++k)
+    {
+        const Case *c = &cases[k];
+
+        if (h->bit_per_pixel < c->min_bpp 
+                || (c->two_colors && h->color_no != 2))
+            continue;
+
+        r.name = c->name;
+        for (level = c->simd > 0 ? BMP_SIMD_NONE : max_level;
+                level <= max_level;
+                ++level)
+        {
+            r.variant = c->simd < 0 ? "float" 
+                      : c->simd > 0 ? levels[level] 
+                      : "default";
+            bmp_set_simd_level(level);
+            if (time_case(c, b, min_runs, &r))
+                fprintf(stderr, "bench: %s failed (%d bpp, %dx%d).\n",
+                        c->name, r.bpp, r.width, r.height);
+            else
+                print_result(format, &r, !printed++);
+        }
+        bmp_set_simd_level(max_level);
+    }
+
+    return printed;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage: bench [-f text|csv|json] [-m max_side] [-r runs] "
+            "[-j threads] [-t tmp_dir]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const int sides[] = {64, 256, 1024, 4096, 16384};
+    const int bpps[] = {1, 4, 8, 16, 24, 32};
+    const char *tmp_dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    int format = TEXT, max_side = 4096, min_runs = 3, threads = 0;
+    int printed = 0;
+    char path[4096];
+    size_t s, k, cap;
+    Bench b;
+    int c;
+
+    while ((c = getopt(argc, argv, "f:m:r:j:t:")) != -1)
+    {
+        switch (c)
+        {
+            case 'f':
+                if (!strcmp(optarg, "text"))
+                    format = TEXT;
+                else if (!strcmp(optarg, "csv"))
+                    format = CSV;
+                else if (!strcmp(optarg, "json"))
+                    format = JSON;
+                else
+                {
+                    usage();
+                    return 1;
+                }
+                break;
+            case 'm':
+                max_side = atoi(optarg);
+                break;
+            case 'r':
+                min_runs = atoi(optarg);
+                break;
+            case 'j':
+                threads = atoi(optarg);
+                break;
+            case 't':
+                tmp_dir = optarg;
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    memset(&b, 0, sizeof (Bench));
+    snprintf(path, sizeof path, "%s/bench_%ld.bmp", tmp_dir, (long) getpid());
+    b.path = path;
+    if (threads > 0 && !(b.exec = bmp_exec_create(threads)))
+    {
+        fprintf(stderr, "bench: cannot create the execution context.\n");
+        return 1;
+    }
+
+    switch (format)
+    {
+        case TEXT:
+            printf("%-20s %-7s %3s %11s %3s %4s %10s %10s %8s %12s\n",
+                   "function", "variant", "bpp", "size", "thr", "runs",
+                   "ns/px", "MB/s", "allocs", "bytes");
+            break;
+        case CSV:
+            printf("function,variant,bpp,width,height,threads,runs,"
+                   "ns_per_pixel,mb_per_s,allocations,allocated_bytes\n");
+            break;
+        case JSON:
+            printf("[");
+            break;
+    }
+
+    for (s = 0; s < sizeof sides / sizeof *sides && sides[s] <= max_side; ++s)
+    {
+        for (k = 0; k < sizeof bpps / sizeof *bpps; ++k)
+        {
+            int colors = bpps[k] <= 8 ? 1 << bpps[k] : 0;
+
+            b.image = new_image(sides[s], sides[s], bpps[k], colors);
+            b.copy = new_image(sides[s], sides[s], bpps[k], colors);
+            cap = steganography_capacity(b.image, 1);
+            b.message = (char*) malloc(cap);
+            if (!b.image.pixel_data || !b.copy.pixel_data || !b.message)
+            {
+                fprintf(stderr, "bench: cannot allocate a %dx%d image.\n",
+                        sides[s], sides[s]);
+                destroy_image(&b.image);
+                destroy_image(&b.copy);
+                free(b.message);
+                continue;
+            }
+
+            /* the message fills the capacity, terminator included */
+            memset(b.message, 'x', cap - 1);
+            b.message[cap - 1] = '\0';
+            b.channel = colors ? A : G;
+            fill(b.image);
+
+            printed = run_image(&b, min_runs, format, printed);
+
+            destroy_image(&b.image);
+            destroy_image(&b.copy);
+            free(b.message);
+            fflush(stdout);
+        }
+    }
+
+    if (format == JSON)
+        printf("\n]\n");
+
+    remove(path);
+    if (b.exec)
+        bmp_exec_destroy(b.exec);
+    return 0;
+}
@@ -22,6 +22,8 @@
  * @date 2015-07-18
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <assert.h>
 #include <limits.h>
 #include <stdint.h>
@@ -30,11 +32,30 @@
 #include <string.h>
 #include <time.h>
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "bitmap.h"
 
+/* SIMD kernels are available on x86 with GCC compatible compilers, and are
+ * selected at runtime depending on the CPU features. */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define X86_SIMD
+#include <immintrin.h>
+#endif
+
 /* Minimum macro. */
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
 
+/* Compression types. */
+#define BI_RGB       0
+#define BI_RLE8      1
+#define BI_RLE4      2
+#define BI_BITFIELDS 3
+
 /* Indices for nibble mask. */
 #define HI_NIBBLE 0
 #define LO_NIBBLE 1
@@ -46,29 +67,29 @@
  * functions. */ 
 #define STEG_LEN 32
 
-/* Update indices while reading channels of various pixels sequentially;
- * i is the pixel row, j the pixel column, ch the channel no. and w the width;
- * pixels are read by row, and for each pixel the first three channels are
- * read sequentially. */
-#define NEXT(i, j, ch, w)   \
-    if ((ch) + 1 == 3)      \
-    {                       \
-        (ch) = 0;           \
-        if ((j) + 1 == (w)) \
-        {                   \
-            (j) = 0;        \
-            ++(i);          \
-        }                   \
-        else                \
-            ++(j);          \
-    }                       \
-    else                    \
-        ++(ch);
+/* Callback type for an operation on a run of contiguous pixels. */
+typedef void (*Span_fn)(Pixel *p, size_t n, void *ctx);
+
+/*
+ * \brief Color space conversions of a run of pixels, also used on single
+ *        rows while decoding and encoding.
+ */
+static void rgb2ycbcr_span(Pixel *px, size_t n, void *ctx);
+static void ycbcr2rgb_span(Pixel *px, size_t n, void *ctx);
+static void rgb2luma_span(Pixel *px, size_t n, void *ctx);
 
 /* binary mask for the bits and nibbles in a byte */
 const uint8_t mask1[] = {128, 64, 32, 16, 8, 4, 2, 1};
 const uint8_t mask4[] = {240, 15};
 
+/* the 8 pixels represented by each byte of 1 bit image data */
+static Pixel expand1[256][8];
+
+/*
+ * \brief Fill the lookup tables, when the library is loaded.
+ */
+static void init_tables(void) __attribute__((constructor));
+
 /*
  * \brief Count trailing zeros in the binary representation of a number.
  * @param val Input value.
@@ -96,993 +117,5868 @@ static unsigned int tr_zeros(uint32_t val)
     return res;
 }
 
+/* Highest SIMD instruction set supported by the CPU (-1 if unknown). */
+static int simd_supported = -1;
+
+/* Highest SIMD instruction set allowed by the user. */
+static int simd_allowed = BMP_SIMD_AVX2;
+
 /*!
- * Allocate resources for a new image object.
+ * Get the SIMD instruction set in use.
  */
-Image new_image(int width, int height, short bpp, int colors)
+int bmp_simd_level(void)
 {
-    Image res;
-    Bmp_header *h = &res.bmp_header;
-    long max_colors = 1;
-    size_t pad;
-    int i;
-    memset(&res, 0, sizeof (Image));
-
-    if (width < 1 || height < 1 || colors < 0)
-    {
-        fprintf(stderr, "new_image: invalid arguments.\n");
-        return res;
-    }
-
-    if (bpp != 1 && bpp != 4 && bpp != 8 && bpp != 16 && bpp != 24 && bpp != 32)
+    if (simd_supported < 0)
     {
-        fprintf(stderr, "new_image: invalid bpp value.\n");
-        return res;
+        simd_supported = BMP_SIMD_NONE;
+#ifdef X86_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("ssse3"))
+            simd_supported = BMP_SIMD_SSSE3;
+        if (__builtin_cpu_supports("avx2"))
+            simd_supported = BMP_SIMD_AVX2;
+#endif
     }
 
-    /* compute the max color number allowed with the input bpp */
-    for (i = 0; i < bpp; ++i)
-        max_colors *= 2;
+    return MIN(simd_supported, simd_allowed);
+}
 
-    if (colors > max_colors)
-    {
-        fprintf(stderr, "new_image: incompatible bpp and colors number.\n");
-        return res;
-    }
+/*!
+ * Limit the SIMD instruction set in use.
+ */
+int bmp_set_simd_level(int level)
+{
+    simd_allowed = level < BMP_SIMD_NONE ? BMP_SIMD_NONE : level;
+    return bmp_simd_level();
+}
 
-    /* rows have a 4 byte alignment */
-    pad = (4 - (bpp * width + 7) / 8 % 4) % 4;
+/*
+ * Fill the lookup tables.
+ */
+static void init_tables(void)
+{
+    int byte, bit;
 
-    /* fill bitmap header */
-    h->header_size = 40;
-    h->bit_per_pixel = bpp;
-    h->width = width;
-    h->height = height;
-    h->color_planes = 1;
-    h->compression_type = 0;
-    h->h_resolution = 2835;
-    h->v_resolution = 2835;
-    h->image_size = ((bpp * width + 7) / 8 + pad) * height;
-    h->color_no = colors;
-    h->important_color_no = colors;
+    /* detect the CPU features before any thread is started */
+    bmp_simd_level();
 
-    /* alloc pixel data (jagged array) */
-    res.pixel_data = (Pixel**) malloc(height * sizeof (Pixel*));
-    if (!res.pixel_data)
+    for (byte = 0; byte < 256; ++byte)
     {
-        return res;
-    }
-    for (i = 0; i < height; ++i)
-    {
-        res.pixel_data[i] = (Pixel*) calloc(width, sizeof (Pixel));
-        if (!res.pixel_data[i])
+        for (bit = 0; bit < 8; ++bit)
         {
-            while (i > 0)
-                free(res.pixel_data[--i]);
-            free(res.pixel_data);
-            return res;
+            Pixel p = {0, 0, 0, (byte & mask1[bit]) ? 1 : 0};
+            expand1[byte][bit] = p;
         }
     }
-
-    /* alloc color palette */
-    res.palette = (Color*) calloc(colors, sizeof (Color));
-
-    return res;
 }
 
-/*!
- * Destroy an image object.
+/*
+ * \brief Expand a run of 1 bit data into pixels, a byte at a time.
+ * @param src Input bits, with the most significant one mapped into the 
+ *        leftmost pixel.
+ * @param dst Output pixels.
+ * @param n Number of pixels.
  */
-void destroy_image(Image *im)
+static void bits_to_pixel(const uint8_t *src, Pixel *dst, size_t n)
 {
-    unsigned long i;
+    size_t j;
 
-    /* soft check against double free */
-    for (i = 0; i < im->bmp_header.height; ++i)
-        if (im->pixel_data[i])
-            free(im->pixel_data[i]);
-    if (im->pixel_data)
-        free(im->pixel_data);
-    if (im->palette)
-        free(im->palette);
+    for (j = 0; j + 8 <= n; j += 8)
+        memcpy(dst + j, expand1[*src++], sizeof (expand1[0]));
 
-    memset(im, 0, sizeof (Image));
+    if (j < n)
+        memcpy(dst + j, expand1[*src], (n - j) * sizeof (Pixel));
 }
 
-/*!
- * Copy the content of an Image object into another, of possibly different
- * size.
+/*
+ * \brief Pack a run of pixels into 1 bit data (scalar version).
+ * @param src Input pixels (nonzero indices are mapped into 1).
+ * @param dst Output bits, with the most significant one mapped into the 
+ *        leftmost pixel.
+ * @param n Number of pixels.
  */
-int copy_image(Image to, Image from)
+static void pixel_to_bits_scalar(const Pixel *src, uint8_t *dst, size_t n)
 {
-    size_t i;
-    size_t min_w = MIN(to.bmp_header.width, from.bmp_header.width);
-    size_t min_h = MIN(to.bmp_header.height, from.bmp_header.height);
+    size_t j;
+    int bit;
 
-    for (i = 0; i < min_h; ++i)
-        memcpy(to.pixel_data[i], from.pixel_data[i], min_w * sizeof (Pixel));
+    for (j = 0; j + 8 <= n; j += 8)
+    {
+        uint8_t tmp = 0;
+        for (bit = 0; bit < 8; ++bit)
+            tmp |= (src[j + bit].i != 0) << (7 - bit);
+        *dst++ = tmp;
+    }
 
-    return 0;
+    if (j < n)
+    {
+        uint8_t tmp = 0;
+        for (bit = 0; j + bit < n; ++bit)
+            tmp |= (src[j + bit].i != 0) << (7 - bit);
+        *dst = tmp;
+    }
 }
 
-/*!
- * Open a bitmap file.
+/*
+ * \brief Expand a run of B, G, R triplets into pixels (scalar version).
+ * @param src Input triplets.
+ * @param dst Output pixels, with zero in the `i` channel.
+ * @param n Number of pixels.
  */
-Image open_bitmap(const char *filename)
+static void bgr_to_pixel_scalar(const uint8_t *src, Pixel *dst, size_t n)
 {
-    FILE *f; 
-    File_header file_header; 
-    Bmp_header *h;
-    Image image;
-    short allocated_palette = 0;
-    size_t i, j;
-    uint8_t *buf;
-    uint8_t *bitmap_buffer;
-    uint32_t h_size;
-    size_t pad;
-    short bit;
-
-    memset(&image, 0, sizeof (Image));
+    size_t j;
 
-    /* open input file */
-    f = fopen(filename, "rb");
-    if (f == NULL)
-        return image;
-
-    /* read the file header */
-    fread(&file_header, sizeof (File_header), 1, f);
-    if (ferror(f))
+    for (j = 0; j < n; ++j)
     {
-        fclose(f);
-        return image;
+        dst[j].b = *(src++);
+        dst[j].g = *(src++);
+        dst[j].r = *(src++);
+        dst[j].i = 0;
     }
+}
 
-    /* check the magic number to ensure this is a valid bmp file */
-    if (file_header.file_type != 0x4D42)
+/*
+ * \brief Pack a run of pixels into B, G, R triplets (scalar version).
+ * @param src Input pixels.
+ * @param dst Output triplets.
+ * @param n Number of pixels.
+ */
+static void pixel_to_bgr_scalar(const Pixel *src, uint8_t *dst, size_t n)
+{
+    size_t j;
+
+    for (j = 0; j < n; ++j)
     {
-        fprintf(stderr, "Invalid magic number.\n");
-        fclose(f);
-        return image;
+        *dst++ = src[j].b;
+        *dst++ = src[j].g;
+        *dst++ = src[j].r;
     }
+}
 
-    /* check the header size (4 byte value) */
-    fread(&h_size, 4, 1, f);
-    if (ferror(f))
+#ifdef X86_SIMD
+/*
+ * Pack pixels into 1 bit data, 16 pixels at a time. The index channels of
+ * the pixels are gathered into a vector of 16 bytes, each nonzero byte is 
+ * replaced by the weight of its bit in the output byte, and the weights of
+ * each group of 8 are summed (the same as an OR, since the bits are 
+ * disjoint) with a sum of absolute differences against zero.
+ */
+__attribute__((target("sse2")))
+static void pixel_to_bits_sse2(const Pixel *src, uint8_t *dst, size_t n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i weights = _mm_set_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+                                         1, 2, 4, 8, 16, 32, 64, -128);
+    size_t j;
+
+    for (j = 0; j + 16 <= n; j += 16)
     {
-        fclose(f);
-        return image;
+        __m128i a = _mm_srli_epi32(_mm_loadu_si128((const __m128i*) (src + j)), 24);
+        __m128i b = _mm_srli_epi32(_mm_loadu_si128((const __m128i*) (src + j + 4)), 24);
+        __m128i c = _mm_srli_epi32(_mm_loadu_si128((const __m128i*) (src + j + 8)), 24);
+        __m128i d = _mm_srli_epi32(_mm_loadu_si128((const __m128i*) (src + j + 12)), 24);
+        __m128i v = _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+        __m128i sad = _mm_sad_epu8(
+                _mm_andnot_si128(_mm_cmpeq_epi8(v, zero), weights), 
+                zero);
+
+        *dst++ = _mm_cvtsi128_si32(sad);
+        *dst++ = _mm_extract_epi16(sad, 4);
     }
-    fseek(f, -4, SEEK_CUR); /* restore pointer to the header start */
 
-    /* read the bmp header */
-    fread(&image.bmp_header, h_size, 1, f);
-    if (ferror(f))
+    pixel_to_bits_scalar(src + j, dst, n - j);
+}
+
+/*
+ * Expand triplets into pixels, 4 pixels at a time (a negative index in the
+ * shuffle mask produces a zero byte). Each load reads 16 bytes, so 6 pixels
+ * must be available to expand 4.
+ */
+__attribute__((target("ssse3")))
+static void bgr_to_pixel_ssse3(const uint8_t *src, Pixel *dst, size_t n)
+{
+    const __m128i shuf = _mm_set_epi8(-1, 11, 10, 9, -1, 8, 7, 6, 
+                                      -1, 5, 4, 3, -1, 2, 1, 0);
+    size_t j;
+
+    for (j = 0; j + 6 <= n; j += 4)
     {
-        fclose(f);
-        return image;
+        __m128i v = _mm_loadu_si128((const __m128i*) (src + 3 * j));
+        _mm_storeu_si128((__m128i*) (dst + j), _mm_shuffle_epi8(v, shuf));
     }
 
-    /* alias the header, to have an handy shorthand */
-    h = &image.bmp_header;
+    bgr_to_pixel_scalar(src + 3 * j, dst + j, n - j);
+}
 
-    /* check wether the bit_per_pixel value is valid */
-    if (h->bit_per_pixel != 1
-            && h->bit_per_pixel != 4
-            && h->bit_per_pixel != 8
-            && h->bit_per_pixel != 16
-            && h->bit_per_pixel != 24
-            && h->bit_per_pixel != 32)
+/*
+ * Pack pixels into triplets, 4 pixels at a time.
+ * Each store writes 16 bytes, so room for 6 pixels is needed to pack 4.
+ */
+__attribute__((target("ssse3")))
+static void pixel_to_bgr_ssse3(const Pixel *src, uint8_t *dst, size_t n)
+{
+    const __m128i shuf = _mm_set_epi8(-1, -1, -1, -1, 14, 13, 12, 10, 
+                                      9, 8, 6, 5, 4, 2, 1, 0);
+    size_t j;
+
+    for (j = 0; j + 6 <= n; j += 4)
     {
-        fclose(f);
-        return image;
+        __m128i v = _mm_loadu_si128((const __m128i*) (src + j));
+        _mm_storeu_si128((__m128i*) (dst + 3 * j), _mm_shuffle_epi8(v, shuf));
     }
 
-    /* allocate memory for the palette and read it when present */
-    if (h->color_no)
+    pixel_to_bgr_scalar(src + j, dst + 3 * j, n - j);
+}
+
+/*
+ * Expand triplets into pixels, 8 pixels at a time. Each 128 bit lane 
+ * expands 4 pixels, and the upper lane is loaded 12 bytes after the lower
+ * one, so 10 pixels must be available to expand 8.
+ */
+__attribute__((target("avx2")))
+static void bgr_to_pixel_avx2(const uint8_t *src, Pixel *dst, size_t n)
+{
+    const __m256i shuf = _mm256_set_epi8(-1, 11, 10, 9, -1, 8, 7, 6, 
+                                         -1, 5, 4, 3, -1, 2, 1, 0,
+                                         -1, 11, 10, 9, -1, 8, 7, 6, 
+                                         -1, 5, 4, 3, -1, 2, 1, 0);
+    size_t j;
+
+    for (j = 0; j + 10 <= n; j += 8)
     {
-        /* each color is stored as a 4 byte sequence */
-        image.palette = (Color*) malloc(h->color_no * 4);
-        fread(image.palette, h->color_no * 4, 1, f);
-        if (ferror(f))
-        {
-            free(image.palette);
-            fclose(f);
-            image.palette = NULL;
-            return image;
-        }
-        else
-        {
-            allocated_palette = 1;
-        }
+        const uint8_t *p = src + 3 * j;
+        __m256i v = _mm256_inserti128_si256(
+                _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*) p)),
+                _mm_loadu_si128((const __m128i*) (p + 12)),
+                1);
+        _mm256_storeu_si256((__m256i*) (dst + j), _mm256_shuffle_epi8(v, shuf));
     }
 
-    /* assert the bitmap data start has been reached */
-    assert(ftell(f) == file_header.bmp_offset);
+    bgr_to_pixel_ssse3(src + 3 * j, dst + j, n - j);
+}
+
+/*
+ * Pack pixels into triplets, 8 pixels at a time. Each 128 bit lane packs
+ * 4 pixels in its low 12 bytes, then the two halves are joined by a cross
+ * lane permutation. Each store writes 32 bytes, so room for 11 pixels is 
+ * needed to pack 8.
+ */
+__attribute__((target("avx2")))
+static void pixel_to_bgr_avx2(const Pixel *src, uint8_t *dst, size_t n)
+{
+    const __m256i shuf = _mm256_set_epi8(-1, -1, -1, -1, 14, 13, 12, 10, 
+                                         9, 8, 6, 5, 4, 2, 1, 0,
+                                         -1, -1, -1, -1, 14, 13, 12, 10, 
+                                         9, 8, 6, 5, 4, 2, 1, 0);
+    const __m256i perm = _mm256_set_epi32(7, 3, 6, 5, 4, 2, 1, 0);
+    size_t j;
 
-    /* allocate memory for the bitmap data (as a jagged array) */
-    image.pixel_data = (Pixel**) malloc(h->height * sizeof (Pixel*));
-    if (!image.pixel_data)
+    for (j = 0; j + 11 <= n; j += 8)
     {
-        if (allocated_palette)
-            free(image.palette);
-        image.pixel_data = NULL;
-        image.palette = NULL;
-        fclose(f);
-        return image;
+        __m256i v = _mm256_loadu_si256((const __m256i*) (src + j));
+        v = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, shuf), perm);
+        _mm256_storeu_si256((__m256i*) (dst + 3 * j), v);
     }
-    for (i = 0; i < h->height; ++i)
+
+    pixel_to_bgr_ssse3(src + j, dst + 3 * j, n - j);
+}
+#endif
+
+/*
+ * \brief Pack a run of pixels into 1 bit data.
+ * @param src Input pixels (nonzero indices are mapped into 1).
+ * @param dst Output bits, with the most significant one mapped into the 
+ *        leftmost pixel.
+ * @param n Number of pixels.
+ */
+static void pixel_to_bits(const Pixel *src, uint8_t *dst, size_t n)
+{
+#ifdef X86_SIMD
+    if (bmp_simd_level() != BMP_SIMD_NONE)
     {
-        image.pixel_data[i] = (Pixel*) malloc(h->width * sizeof (Pixel));
-        if (!image.pixel_data[i])
-        {
-            if (allocated_palette)
-                free(image.palette);
-            while (i > 0)
-                free(image.pixel_data[--i]);
-            image.pixel_data = NULL;
-            image.palette = NULL;
-            fclose(f);
-            return image;
-        }
+        pixel_to_bits_sse2(src, dst, n);
+        return;
     }
+#endif
+    pixel_to_bits_scalar(src, dst, n);
+}
 
-    /* allocate buffer for the file content */
-    bitmap_buffer = (uint8_t*) calloc(1, h->image_size);
-    if (!bitmap_buffer)
+/*
+ * \brief Expand a run of B, G, R triplets into pixels.
+ * @param src Input triplets.
+ * @param dst Output pixels, with zero in the `i` channel.
+ * @param n Number of pixels.
+ */
+static void bgr_to_pixel(const uint8_t *src, Pixel *dst, size_t n)
+{
+#ifdef X86_SIMD
+    switch (bmp_simd_level())
     {
-        for (i = 0; i < h->height; ++i)
-            free(image.pixel_data[i]);
-        free(image.pixel_data);
-        if (allocated_palette)
-            free(image.palette);
-        image.pixel_data = NULL;
-        image.palette = NULL;
-        fclose(f);
-        return image;
+        case BMP_SIMD_AVX2:
+            bgr_to_pixel_avx2(src, dst, n);
+            return;
+        case BMP_SIMD_SSSE3:
+            bgr_to_pixel_ssse3(src, dst, n);
+            return;
     }
+#endif
+    bgr_to_pixel_scalar(src, dst, n);
+}
 
-    /* read bitmap data from the file and put it into the buffer */
-    fread(bitmap_buffer, h->image_size, 1, f);
-    if (ferror(f))
+/*
+ * \brief Pack a run of pixels into B, G, R triplets.
+ * @param src Input pixels.
+ * @param dst Output triplets.
+ * @param n Number of pixels.
+ */
+static void pixel_to_bgr(const Pixel *src, uint8_t *dst, size_t n)
+{
+#ifdef X86_SIMD
+    switch (bmp_simd_level())
     {
-        for (i = 0; i < h->height; ++i)
-            free(image.pixel_data[i]);
-        free(image.pixel_data);
-        if (allocated_palette)
-            free(image.palette);
-        image.pixel_data = NULL;
-        image.palette = NULL;
-        fclose(f);
-        return image;
+        case BMP_SIMD_AVX2:
+            pixel_to_bgr_avx2(src, dst, n);
+            return;
+        case BMP_SIMD_SSSE3:
+            pixel_to_bgr_ssse3(src, dst, n);
+            return;
     }
+#endif
+    pixel_to_bgr_scalar(src, dst, n);
+}
 
-    /* convert bitmap data into high level pixel representation */
-    /* +7 is to round up to the ceil value in the division */
-    pad = (4 - ((h->width * h->bit_per_pixel + 7) / 8) % 4) % 4;
-    buf = bitmap_buffer;
-    switch (h->bit_per_pixel)
+/* State of an execution context (a pool of worker threads). */
+struct Bmp_exec
+{
+    pthread_t *workers;       /* worker threads */
+    int worker_no;            /* number of worker threads */
+    pthread_mutex_t job_lock; /* serializes the jobs posted to the pool */
+    pthread_mutex_t lock;     /* protects the fields below */
+    pthread_cond_t work;      /* signalled when a job is posted */
+    pthread_cond_t done;      /* signalled when the workers are done */
+    unsigned long generation; /* number of jobs posted so far */
+    int busy;                 /* workers still running the current job */
+    int quit;                 /* nonzero when the pool is shutting down */
+    Bmp_rows_fn fn;           /* current job, applied to row ranges */
+    void *ctx;                /* context of the current job */
+    size_t rows;              /* rows of the current job */
+    size_t grain;             /* rows in each range */
+    size_t next;              /* first row not yet taken (atomic) */
+};
+
+/* Nonzero in threads currently running a job, so that nested parallel 
+ * loops fall back to serial execution instead of deadlocking. */
+static __thread int in_job;
+
+/*
+ * \brief Take row ranges of the current job until none is left.
+ * @param exec Execution context.
+ */
+static void run_ranges(Bmp_exec *exec)
+{
+    size_t begin;
+
+    in_job = 1;
+    while ((begin = __atomic_fetch_add(&exec->next, exec->grain, __ATOMIC_RELAXED))
+            < exec->rows)
+        exec->fn(exec->ctx, begin, MIN(begin + exec->grain, exec->rows));
+    in_job = 0;
+}
+
+/*
+ * \brief Main loop of a worker thread.
+ * @param arg Execution context.
+ */
+static void* worker_main(void *arg)
+{
+    Bmp_exec *exec = (Bmp_exec*) arg;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&exec->lock);
+    for (;;)
     {
-        /* each byte of data represents 8 pixels, with the most significant 
-         * bit mapped into the leftmost pixel */
-        case 1:
-            for (i = 0; i < h->height; ++i)
-            {
-                bit = 0;
-                for (j = 0; j < h->width; ++j)
-                {
-                    /* get the right bit from the current byte, 
-                     * starting from the most significative one */
-                    image.pixel_data[i][j].i = READ_MASK(*buf, mask1[bit]);
-                    ++bit;
-                    
-                    /* when the current byte has been fully read,
-                     * advance to the next one */
-                    if (bit == 8)
-                    {
-                        bit = 0;
-                        ++buf;
-                    }
-                }
-                /* each row has a padding to a 4 byte alignment */
-                buf += pad;
-            }
+        while (!exec->quit && exec->generation == seen)
+            pthread_cond_wait(&exec->work, &exec->lock);
+        if (exec->quit)
             break;
+        seen = exec->generation;
+        pthread_mutex_unlock(&exec->lock);
 
-        /* each byte represents 2 pixel, with the most significant nibble
-         * mapped into the leftmost pixel */
-        case 4:
-            for (i = 0; i < h->height; ++i)
-            {
-                for (j = 0; j < h->width; j += 2)
-                {
-                    /* read the two pixels in the current byte */
-                    image.pixel_data[i][j].i = 
-                        READ_MASK(*buf, mask4[HI_NIBBLE]);
+        run_ranges(exec);
 
-                    if (j + 1 < h->width)
-                        image.pixel_data[i][j + 1].i = 
-                            READ_MASK(*buf, mask4[LO_NIBBLE]);
+        pthread_mutex_lock(&exec->lock);
+        if (--exec->busy == 0)
+            pthread_cond_signal(&exec->done);
+    }
+    pthread_mutex_unlock(&exec->lock);
 
-                    /* advance to the next byte */
-                    ++buf;
-                }
-                /* each row has a padding to a 4 byte alignment */
-                buf += pad;
-            }
-            break;
+    return NULL;
+}
 
-        /* each byte represents 1 pixel */
-        case 8:
-            for (i = 0; i < h->height; ++i)
-            {
-                for (j = 0; j < h->width; ++j)
-                    image.pixel_data[i][j].i = *(buf++);
+/*!
+ * Create an execution context.
+ */
+Bmp_exec* bmp_exec_create(int threads)
+{
+    Bmp_exec *exec;
+    int i;
 
-                /* each row has a padding to a 4 byte alignment */
-                buf += pad;
-            }
-            break;
+    if (threads <= 0)
+        threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0)
+        threads = 1;
 
-        /* each pixel is represented with 2 bytes */
-        case 16:
-            for (i = 0; i < h->height; ++i)
-            {
-                for (j = 0; j < h->width; ++j)
-                {
-                    uint16_t *px = (uint16_t*) buf;
-                    image.pixel_data[i][j].b = READ_MASK(*px, h->blue_mask);
-                    image.pixel_data[i][j].g = READ_MASK(*px, h->green_mask);
-                    image.pixel_data[i][j].r = READ_MASK(*px, h->red_mask);
+    exec = (Bmp_exec*) calloc(1, sizeof (Bmp_exec));
+    if (!exec)
+        return NULL;
 
-                    /* advance to the next pixel (half-word) */
-                    buf += 2;
-                }
-                /* each row has a padding to a 4 byte alignment */
-                buf += pad;
-            }
+    /* the calling thread takes part in each job, as one of the threads */
+    exec->workers = (pthread_t*) calloc(threads, sizeof (pthread_t));
+    if (!exec->workers)
+    {
+        free(exec);
+        return NULL;
+    }
+
+    pthread_mutex_init(&exec->job_lock, NULL);
+    pthread_mutex_init(&exec->lock, NULL);
+    pthread_cond_init(&exec->work, NULL);
+    pthread_cond_init(&exec->done, NULL);
+
+    for (i = 0; i < threads - 1; ++i)
+    {
+        if (pthread_create(&exec->workers[i], NULL, worker_main, exec))
+            break;
+        ++exec->worker_no;
+    }
+
+    return exec;
+}
+
+/*!
+ * Destroy an execution context.
+ */
+void bmp_exec_destroy(Bmp_exec *exec)
+{
+    int i;
+
+    if (!exec)
+        return;
+
+    pthread_mutex_lock(&exec->lock);
+    exec->quit = 1;
+    pthread_cond_broadcast(&exec->work);
+    pthread_mutex_unlock(&exec->lock);
+
+    for (i = 0; i < exec->worker_no; ++i)
+        pthread_join(exec->workers[i], NULL);
+
+    pthread_cond_destroy(&exec->done);
+    pthread_cond_destroy(&exec->work);
+    pthread_mutex_destroy(&exec->lock);
+    pthread_mutex_destroy(&exec->job_lock);
+    free(exec->workers);
+    free(exec);
+}
+
+/*!
+ * Get the number of threads of an execution context.
+ */
+int bmp_exec_threads(const Bmp_exec *exec)
+{
+    return exec ? exec->worker_no + 1 : 1;
+}
+
+/*!
+ * Run a function over ranges of rows, in parallel.
+ */
+void bmp_parallel_for_rows(Bmp_exec *exec, 
+                           size_t rows, 
+                           size_t grain, 
+                           Bmp_rows_fn fn, 
+                           void *ctx)
+{
+    if (!rows)
+        return;
+
+    /* serial execution */
+    if (!exec || !exec->worker_no || in_job)
+    {
+        fn(ctx, 0, rows);
+        return;
+    }
+
+    /* by default, about four ranges for each thread */
+    if (!grain)
+        grain = (rows + 4 * exec->worker_no + 3) / (4 * exec->worker_no + 4);
+
+    pthread_mutex_lock(&exec->job_lock);
+
+    pthread_mutex_lock(&exec->lock);
+    exec->fn = fn;
+    exec->ctx = ctx;
+    exec->rows = rows;
+    exec->grain = grain;
+    exec->next = 0;
+    exec->busy = exec->worker_no;
+    ++exec->generation;
+    pthread_cond_broadcast(&exec->work);
+    pthread_mutex_unlock(&exec->lock);
+
+    run_ranges(exec);
+
+    pthread_mutex_lock(&exec->lock);
+    while (exec->busy)
+        pthread_cond_wait(&exec->done, &exec->lock);
+    pthread_mutex_unlock(&exec->lock);
+
+    pthread_mutex_unlock(&exec->job_lock);
+}
+
+/*
+ * \brief Allocate the pixel block and the row table for an image.
+ * @param im Image object, with width, height and row order set.
+ * @return Zero on success, nonzero otherwise.
+ */
+static int alloc_pixels(Image *im)
+{
+    Bmp_header *h = &im->bmp_header;
+    size_t size = (size_t) h->width * h->height * sizeof (Pixel);
+    void *block;
+    size_t i;
+
+    /* one single zeroed block, holding all the rows one after the other */
+    if (posix_memalign(&block, PIXEL_ALIGNMENT, size ? size : PIXEL_ALIGNMENT))
+        return 1;
+    memset(block, 0, size);
+
+    /* row table, pointing inside the block */
+    im->pixel_data = (Pixel**) malloc(h->height * sizeof (Pixel*));
+    if (!im->pixel_data)
+    {
+        free(block);
+        return 1;
+    }
+
+    im->pixels = (Pixel*) block;
+    im->stride = h->width;
+    for (i = 0; i < h->height; ++i)
+        im->pixel_data[i] = im->pixels + image_storage_row(*im, i) * im->stride;
+
+    return 0;
+}
+
+/*
+ * \brief Release the pixel block and the row table of an image.
+ * @param im Image object.
+ */
+static void free_pixels(Image *im)
+{
+    free(im->pixels);
+    free(im->pixel_data);
+    im->pixels = NULL;
+    im->pixel_data = NULL;
+    im->stride = 0;
+}
+
+/*
+ * \brief Size of a row of palette indices in compact storage.
+ * @param h Bitmap header.
+ * @return Row size (byte).
+ */
+static size_t index_row_bytes(const Bmp_header *h)
+{
+    return h->bit_per_pixel == 1 ? (h->width + 7) / 8 : h->width;
+}
+
+/*
+ * \brief Allocate the zeroed index block for an image in compact storage.
+ * @param im Image object, with width, height and bpp set in its header.
+ * @return Zero on success, nonzero otherwise.
+ */
+static int alloc_indices(Image *im)
+{
+    Bmp_header *h = &im->bmp_header;
+    size_t stride = index_row_bytes(h);
+    size_t size = stride * h->height;
+    void *block;
+
+    if (posix_memalign(&block, PIXEL_ALIGNMENT, size ? size : PIXEL_ALIGNMENT))
+        return 1;
+    memset(block, 0, size);
+
+    im->indices = (uint8_t*) block;
+    im->index_stride = stride;
+
+    return 0;
+}
+
+/* Context for the parallel application of a span operation. */
+typedef struct Span_job
+{
+    Image image; /* target image */
+    Span_fn fn;  /* operation */
+    void *ctx;   /* context of the operation */
+} Span_job;
+
+/*
+ * \brief Apply a span operation to a range of rows.
+ */
+static void span_rows(void *ctx, size_t begin, size_t end)
+{
+    Span_job *job = (Span_job*) ctx;
+    Image *im = &job->image;
+    size_t w = im->bmp_header.width;
+    size_t i;
+
+    /* contiguous rows are handled with a single call */
+    if (im->pixels && im->stride == w)
+    {
+        size_t first = im->top_down ? im->bmp_header.height - end : begin;
+        job->fn(im->pixels + first * w, (end - begin) * w, job->ctx);
+        return;
+    }
+
+    for (i = begin; i < end; ++i)
+        job->fn(im->pixel_data[i], w, job->ctx);
+}
+
+/*
+ * \brief Apply an operation to all the pixels of an image.
+ *
+ * The rows are split in ranges run in parallel by the execution context
+ * (if any). Each range is handled with a single call when its rows are 
+ * contiguous, and with a call for each row otherwise.
+ * @param image Image.
+ * @param fn Operation to be applied.
+ * @param ctx Context passed to the operation.
+ * @param exec Execution context, or NULL for serial execution.
+ */
+static void for_each_span(Image image, Span_fn fn, void *ctx, Bmp_exec *exec)
+{
+    Span_job job;
+
+    job.image = image;
+    job.fn = fn;
+    job.ctx = ctx;
+    bmp_parallel_for_rows(exec, image.bmp_header.height, 0, span_rows, &job);
+}
+
+/*
+ * \brief Size of a row of pixel data in the file, padding included.
+ * @param h Bitmap header.
+ * @return Row size (byte).
+ */
+static size_t row_bytes(const Bmp_header *h)
+{
+    /* rows have a 4 byte alignment */
+    return ((size_t) h->width * h->bit_per_pixel + 31) / 32 * 4;
+}
+
+/*
+ * \brief Size (byte) of the color masks stored right after the header, which
+ *        a BITMAPINFOHEADER (40 byte) only carries for BI_BITFIELDS images.
+ * @param h Bitmap header.
+ * @return Size of the masks following the header, zero if none.
+ */
+static size_t extra_masks_size(const Bmp_header *h)
+{
+    if (h->header_size != 40 
+            || h->compression_type != BI_BITFIELDS
+            || (h->bit_per_pixel != 16 && h->bit_per_pixel != 32)
+            || !(h->red_mask | h->green_mask | h->blue_mask))
+        return 0;
+
+    return 12;
+}
+
+/*
+ * \brief Size (byte) of the file header, the bitmap header and the color
+ *        masks following it, i.e. the offset of the palette.
+ * @param h Bitmap header.
+ * @return Offset of the palette from the start of the file.
+ */
+static size_t headers_size(const Bmp_header *h)
+{
+    return sizeof (File_header) + h->header_size + extra_masks_size(h);
+}
+
+/*
+ * \brief Parse the file header and the bitmap header from memory.
+ * @param data Start of the file content.
+ * @param size Size (byte) of the available content.
+ * @param fh Pointer to store the file header.
+ * @param h Pointer to store the bitmap header.
+ * @return Zero on success, nonzero otherwise.
+ */
+static int parse_headers(const uint8_t *data, 
+                         size_t size, 
+                         File_header *fh, 
+                         Bmp_header *h)
+{
+    uint32_t h_size;
+
+    if (size < sizeof (File_header) + 4)
+        return 1;
+
+    /* read the file header */
+    memcpy(fh, data, sizeof (File_header));
+
+    /* check the magic number to ensure this is a valid bmp file */
+    if (fh->file_type != 0x4D42)
+    {
+        fprintf(stderr, "Invalid magic number.\n");
+        return 1;
+    }
+
+    /* check the header size (4 byte value) */
+    memcpy(&h_size, data + sizeof (File_header), 4);
+    if (h_size < 40 
+            || h_size > sizeof (Bmp_header) 
+            || size < sizeof (File_header) + h_size)
+    {
+        fprintf(stderr, "Unsupported bitmap header.\n");
+        return 1;
+    }
+
+    /* read the bmp header */
+    memset(h, 0, sizeof (Bmp_header));
+    memcpy(h, data + sizeof (File_header), h_size);
+
+    /* check wether the bit_per_pixel value is valid */
+    if (h->bit_per_pixel != 1
+            && h->bit_per_pixel != 4
+            && h->bit_per_pixel != 8
+            && h->bit_per_pixel != 16
+            && h->bit_per_pixel != 24
+            && h->bit_per_pixel != 32)
+        return 1;
+
+    /* run length encoding is only defined for 8 and 4 bit images */
+    if (h->compression_type != BI_RGB
+            && h->compression_type != BI_BITFIELDS
+            && !(h->compression_type == BI_RLE8 && h->bit_per_pixel == 8)
+            && !(h->compression_type == BI_RLE4 && h->bit_per_pixel == 4))
+    {
+        fprintf(stderr, "Unsupported compression type.\n");
+        return 1;
+    }
+
+    /* a BITMAPINFOHEADER is followed by the color masks of BI_BITFIELDS
+     * images, before the palette and the pixel data */
+    if (h_size == 40 && h->compression_type == BI_BITFIELDS)
+    {
+        if (size < sizeof (File_header) + h_size + 12 
+                || fh->bmp_offset < sizeof (File_header) + h_size + 12)
+        {
+            fprintf(stderr, "Missing color masks.\n");
+            return 1;
+        }
+        memcpy(&h->red_mask, data + sizeof (File_header) + h_size, 12);
+    }
+
+    /* color masks are only defined for 16 and 32 bit images, and the 
+     * default layout only applies to BI_RGB images */
+    if (h->compression_type == BI_BITFIELDS
+            && ((h->bit_per_pixel != 16 && h->bit_per_pixel != 32)
+                || !(h->red_mask | h->green_mask | h->blue_mask)))
+    {
+        fprintf(stderr, "Invalid color masks.\n");
+        return 1;
+    }
+
+    /* top-down bitmaps cannot be compressed */
+    if ((int32_t) h->height < 0 && h->compression_type != BI_RGB 
+            && h->compression_type != BI_BITFIELDS)
+    {
+        fprintf(stderr, "Compressed top-down bitmaps are not supported.\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * \brief Turn the height of a bitmap header, stored as a negative value 
+ *        for top-down bitmaps, into a row count.
+ * @param h Bitmap header.
+ * @return Nonzero if the bitmap is top-down, zero otherwise.
+ */
+static int take_row_order(Bmp_header *h)
+{
+    if ((int32_t) h->height >= 0)
+        return 0;
+
+    h->height = -(int64_t) (int32_t) h->height;
+    return 1;
+}
+
+/*!
+ * Allocate resources for a new image object.
+ */
+Image new_image(int width, int height, short bpp, int colors)
+{
+    Image res;
+    Bmp_header *h = &res.bmp_header;
+    long max_colors = 1;
+    size_t pad;
+    int i;
+    memset(&res, 0, sizeof (Image));
+
+    if (width < 1 || height == 0 || height == INT_MIN || colors < 0)
+    {
+        fprintf(stderr, "new_image: invalid arguments.\n");
+        return res;
+    }
+
+    if (bpp != 1 && bpp != 4 && bpp != 8 && bpp != 16 && bpp != 24 && bpp != 32)
+    {
+        fprintf(stderr, "new_image: invalid bpp value.\n");
+        return res;
+    }
+
+    /* compute the max color number allowed with the input bpp */
+    for (i = 0; i < bpp; ++i)
+        max_colors *= 2;
+
+    if (colors > max_colors)
+    {
+        fprintf(stderr, "new_image: incompatible bpp and colors number.\n");
+        return res;
+    }
+
+    /* rows have a 4 byte alignment */
+    pad = (4 - (bpp * width + 7) / 8 % 4) % 4;
+
+    /* a negative height makes a top-down image */
+    res.top_down = height < 0;
+    if (res.top_down)
+        height = -height;
+
+    /* fill bitmap header */
+    h->header_size = 40;
+    h->bit_per_pixel = bpp;
+    h->width = width;
+    h->height = height;
+    h->color_planes = 1;
+    h->compression_type = 0;
+    h->h_resolution = 2835;
+    h->v_resolution = 2835;
+    h->image_size = ((bpp * width + 7) / 8 + pad) * height;
+    h->color_no = colors;
+    h->important_color_no = colors;
+
+    /* alloc pixel data (contiguous block) */
+    if (alloc_pixels(&res))
+        return res;
+
+    /* alloc color palette */
+    res.palette = (Color*) calloc(colors, sizeof (Color));
+
+    return res;
+}
+
+/*!
+ * Destroy an image object.
+ */
+void destroy_image(Image *im)
+{
+    free_pixels(im);
+    free(im->indices);
+    if (im->palette)
+        free(im->palette);
+
+    memset(im, 0, sizeof (Image));
+}
+
+/*!
+ * Copy the content of an Image object into another, of possibly different
+ * size.
+ */
+int copy_image(Image to, Image from)
+{
+    size_t i, j;
+    size_t min_w = MIN(to.bmp_header.width, from.bmp_header.width);
+    size_t min_h = MIN(to.bmp_header.height, from.bmp_header.height);
+
+    /* compact images are copied through their indices */
+    if (to.indices || from.indices)
+    {
+        for (i = 0; i < min_h; ++i)
+            for (j = 0; j < min_w; ++j)
+                image_set_index(to, i, j, image_get_index(from, i, j));
+        return 0;
+    }
+
+    /* same row layout on both sides, copy all the rows at once (top-down
+     * images store the top rows first, so they need the same height) */
+    if (to.pixels && from.pixels 
+            && to.stride == from.stride 
+            && min_w == to.stride
+            && to.top_down == from.top_down
+            && (!to.top_down || to.bmp_header.height == from.bmp_header.height))
+    {
+        memcpy(to.pixels, from.pixels, min_h * to.stride * sizeof (Pixel));
+        return 0;
+    }
+
+    for (i = 0; i < min_h; ++i)
+        memcpy(to.pixel_data[i], from.pixel_data[i], min_w * sizeof (Pixel));
+
+    return 0;
+}
+
+/*!
+ * Map a row index to the position of the row in the storage of an image.
+ */
+size_t image_storage_row(Image image, size_t row)
+{
+    return image.top_down ? image.bmp_header.height - 1 - row : row;
+}
+
+/*!
+ * Flip an image upside down, without moving its pixel data.
+ */
+void image_flip(Image *image)
+{
+    size_t n = image->bmp_header.height;
+    size_t i;
+    Pixel *tmp;
+
+    image->top_down = !image->top_down;
+
+    /* compact storage is mapped through the row order alone */
+    if (!image->pixel_data)
+        return;
+
+    for (i = 0; i < n / 2; ++i)
+    {
+        tmp = image->pixel_data[i];
+        image->pixel_data[i] = image->pixel_data[n - 1 - i];
+        image->pixel_data[n - 1 - i] = tmp;
+    }
+}
+
+/*!
+ * Get the palette index of a pixel.
+ */
+uint8_t image_get_index(Image image, size_t row, size_t col)
+{
+    const uint8_t *r;
+
+    if (!image.indices)
+        return image.pixel_data[row][col].i;
+
+    r = image.indices + image_storage_row(image, row) * image.index_stride;
+    if (image.bmp_header.bit_per_pixel == 1)
+        return (r[col / 8] >> (7 - col % 8)) & 0x1;
+
+    return r[col];
+}
+
+/*!
+ * Set the palette index of a pixel.
+ */
+void image_set_index(Image image, size_t row, size_t col, uint8_t index)
+{
+    uint8_t *r;
+
+    if (!image.indices)
+    {
+        image.pixel_data[row][col].i = index;
+        return;
+    }
+
+    r = image.indices + image_storage_row(image, row) * image.index_stride;
+    if (image.bmp_header.bit_per_pixel == 1)
+    {
+        if (index)
+            r[col / 8] |= mask1[col % 8];
+        else
+            r[col / 8] &= ~mask1[col % 8];
+        return;
+    }
+
+    r[col] = index;
+}
+
+/*!
+ * Get a pixel, expanding it from its index in compact storage.
+ */
+Pixel image_get_pixel(Image image, size_t row, size_t col)
+{
+    Pixel p = {0, 0, 0, 0};
+
+    if (!image.indices)
+        return image.pixel_data[row][col];
+
+    p.i = image_get_index(image, row, col);
+    return p;
+}
+
+/*!
+ * Convert a compact palette image into Pixel storage.
+ */
+int image_expand(Image *image)
+{
+    Image tmp = *image;
+    size_t i, j;
+
+    if (!image->indices)
+        return 0;
+
+    if (alloc_pixels(&tmp))
+    {
+        fprintf(stderr, "image_expand: memory error.\n");
+        return 1;
+    }
+
+    for (i = 0; i < tmp.bmp_header.height; ++i)
+        for (j = 0; j < tmp.bmp_header.width; ++j)
+            tmp.pixel_data[i][j].i = image_get_index(*image, i, j);
+
+    free(tmp.indices);
+    tmp.indices = NULL;
+    tmp.index_stride = 0;
+    *image = tmp;
+
+    return 0;
+}
+
+/*!
+ * Convert a palette image into compact storage.
+ */
+int image_compact(Image *image)
+{
+    Image tmp = *image;
+    size_t i, j;
+
+    if (image->indices)
+        return 0;
+
+    if (image->bmp_header.bit_per_pixel > 8)
+    {
+        fprintf(stderr, "image_compact: not a palette image.\n");
+        return 1;
+    }
+
+    if (alloc_indices(&tmp))
+    {
+        fprintf(stderr, "image_compact: memory error.\n");
+        return 1;
+    }
+
+    for (i = 0; i < tmp.bmp_header.height; ++i)
+        for (j = 0; j < tmp.bmp_header.width; ++j)
+            image_set_index(tmp, i, j, image->pixel_data[i][j].i);
+
+    free_pixels(&tmp);
+    *image = tmp;
+
+    return 0;
+}
+
+/*
+ * \brief Read the headers and the palette of a bitmap file, leaving the
+ *        file positioned at the start of the pixel data.
+ * @param f Input file, positioned at its start.
+ * @param fh Pointer to store the file header.
+ * @param h Pointer to store the bitmap header.
+ * @param palette Pointer to store the palette (NULL when not present), to be
+ *        deallocated with `free(void*)`.
+ * @return Zero on success, nonzero otherwise.
+ */
+static int read_headers(FILE *f, File_header *fh, Bmp_header *h, Color **palette)
+{
+    uint8_t buf[sizeof (File_header) + sizeof (Bmp_header)];
+    uint32_t h_size, compression;
+
+    *palette = NULL;
+
+    /* read the file header and the header size (4 byte value) */
+    if (fread(buf, sizeof (File_header) + 4, 1, f) != 1)
+        return 1;
+    memcpy(&h_size, buf + sizeof (File_header), 4);
+    if (h_size < 40 || h_size > sizeof (Bmp_header))
+    {
+        fprintf(stderr, "Unsupported bitmap header.\n");
+        return 1;
+    }
+
+    /* read the rest of the bmp header */
+    if (fread(buf + sizeof (File_header) + 4, h_size - 4, 1, f) != 1)
+        return 1;
+
+    /* a BITMAPINFOHEADER of a BI_BITFIELDS image is followed by the color 
+     * masks, which fill the room of the larger headers */
+    memcpy(&compression, 
+           buf + sizeof (File_header) + offsetof(Bmp_header, compression_type), 
+           4);
+    if (h_size == 40 && compression == BI_BITFIELDS)
+    {
+        if (fread(buf + sizeof (File_header) + h_size, 12, 1, f) != 1)
+            return 1;
+        h_size += 12;
+    }
+
+    if (parse_headers(buf, sizeof (File_header) + h_size, fh, h))
+        return 1;
+
+    /* allocate memory for the palette and read it when present */
+    if (h->color_no)
+    {
+        /* each color is stored as a 4 byte sequence */
+        *palette = (Color*) malloc(h->color_no * 4);
+        if (!*palette || fread(*palette, h->color_no * 4, 1, f) != 1)
+        {
+            free(*palette);
+            *palette = NULL;
+            return 1;
+        }
+    }
+
+    /* move to the bitmap data start */
+    if (fseek(f, fh->bmp_offset, SEEK_SET))
+    {
+        free(*palette);
+        *palette = NULL;
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Minimum number of pixels for which a 16 bit image is decoded through a 
+ * lookup table (smaller images are cheaper to decode directly). */
+#define LUT16_MIN_PIXELS 16384
+
+/* Color mask, decoded into shift and scaling factors. */
+typedef struct Bitfield
+{
+    uint32_t mask;  /* mask of the field, after the shift */
+    uint8_t shift;  /* position of the lowest bit of the field */
+    uint8_t drop;   /* low bits discarded to fit the field in 8 bits */
+    uint32_t max;   /* maximum value of the field, after the drop */
+    uint32_t scale; /* factor (16.16 fixed point) from the field to 0-255 */
+} Bitfield;
+
+/* Pixel format of a bitmap, computed once per image. */
+typedef struct Pixel_format
+{
+    const Bmp_header *h;  /* bitmap header */
+    Bitfield field[4];    /* color masks, in B, G, R, A order */
+    Pixel *lut;           /* pixel for each 16 bit value (or NULL) */
+    uint32_t enc[4][256]; /* encoded field for each channel value */
+} Pixel_format;
+
+/*
+ * \brief Decode a color mask.
+ * @param f Output field descriptor.
+ * @param mask Color mask.
+ */
+static void init_bitfield(Bitfield *f, uint32_t mask)
+{
+    unsigned int width = 0;
+
+    f->shift = tr_zeros(mask);
+    f->mask = mask >> f->shift;
+    while (width < 32 && (f->mask >> width))
+        ++width;
+
+    /* fields wider than 8 bit keep only their most significant bits */
+    f->drop = width > 8 ? width - 8 : 0;
+    f->max = f->mask >> f->drop;
+
+    /* scale values so that the field maximum maps into 255 */
+    f->scale = f->max ? ((255u << 16) + f->max / 2) / f->max : 0;
+}
+
+/*
+ * \brief Extract a field from a pixel value, scaled to the range 0-255.
+ */
+static __inline__ uint8_t decode_field(uint32_t px, const Bitfield *f)
+{
+    return ((((px >> f->shift) & f->mask) >> f->drop) * f->scale + 0x8000) 
+        >> 16;
+}
+
+/*
+ * \brief Compute the pixel format of an image.
+ *
+ * Images without color masks use the default BI_RGB layout (5 bit per
+ * channel for 16 bit images, 8 bit per channel for 32 bit images). The
+ * encoding tables quantize each channel value into its field, rounding to 
+ * the nearest level or truncating when `BMP_SAVE_TRUNCATE` is set.
+ * @param fmt Output pixel format.
+ * @param h Bitmap header.
+ * @param flags Saving flags.
+ */
+static void init_format(Pixel_format *fmt, const Bmp_header *h, int flags)
+{
+    uint32_t r = h->red_mask;
+    uint32_t g = h->green_mask;
+    uint32_t b = h->blue_mask;
+    uint32_t a = h->alpha_mask;
+    uint32_t round = flags & BMP_SAVE_TRUNCATE ? 0 : 127;
+    size_t ch, v;
+
+    memset(fmt, 0, sizeof (Pixel_format));
+    fmt->h = h;
+
+    if (h->bit_per_pixel != 16 && h->bit_per_pixel != 32)
+        return;
+
+    if (h->compression_type != BI_BITFIELDS || !(r | g | b))
+    {
+        a = 0;
+        if (h->bit_per_pixel == 16)
+        {
+            r = 0x7C00;
+            g = 0x03E0;
+            b = 0x001F;
+        }
+        else
+        {
+            r = 0x00FF0000;
+            g = 0x0000FF00;
+            b = 0x000000FF;
+        }
+    }
+
+    init_bitfield(&fmt->field[B], b);
+    init_bitfield(&fmt->field[G], g);
+    init_bitfield(&fmt->field[R], r);
+    init_bitfield(&fmt->field[A], a);
+
+    /* quantization of each channel value into its field */
+    for (ch = 0; ch < 4; ++ch)
+    {
+        const Bitfield *f = &fmt->field[ch];
+        for (v = 0; v < 256; ++v)
+            fmt->enc[ch][v] = 
+                (uint32_t) ((v * f->max + round) / 255) << f->drop << f->shift;
+    }
+
+}
+
+/*
+ * \brief Build the decoding table of a pixel format, covering all the 65536
+ *        values of a 16 bit pixel. Only large images get a table, since
+ *        building it costs about as much as decoding 65536 pixels directly.
+ * @param fmt Pixel format, to be released with `free_format`.
+ * @return Zero on success, nonzero otherwise.
+ */
+static int init_lut16(Pixel_format *fmt)
+{
+    const Bmp_header *h = fmt->h;
+    size_t v;
+
+    if (h->bit_per_pixel != 16 
+            || (size_t) h->width * h->height < LUT16_MIN_PIXELS)
+        return 0;
+
+    fmt->lut = (Pixel*) malloc(65536 * sizeof (Pixel));
+    if (!fmt->lut)
+        return 1;
+
+    for (v = 0; v < 65536; ++v)
+    {
+        fmt->lut[v].b = decode_field(v, &fmt->field[B]);
+        fmt->lut[v].g = decode_field(v, &fmt->field[G]);
+        fmt->lut[v].r = decode_field(v, &fmt->field[R]);
+        fmt->lut[v].i = 0;
+    }
+
+    return 0;
+}
+
+/*
+ * \brief Release the resources of a pixel format.
+ * @param fmt Pixel format.
+ */
+static void free_format(Pixel_format *fmt)
+{
+    free(fmt->lut);
+    fmt->lut = NULL;
+}
+
+/*
+ * \brief Convert a row of bitmap data into high level pixel representation.
+ * @param fmt Pixel format.
+ * @param buf Row data, as stored in the file.
+ * @param row Output row (width pixels).
+ */
+static void decode_row(const Pixel_format *fmt, const uint8_t *buf, Pixel *row)
+{
+    const Bmp_header *h = fmt->h;
+    const Bitfield *f = fmt->field;
+    const Pixel zero = {0, 0, 0, 0};
+    size_t j;
+
+    /* color channels are not used by palette images */
+    if (h->bit_per_pixel == 4 || h->bit_per_pixel == 8)
+        for (j = 0; j < h->width; ++j)
+            row[j] = zero;
+
+    switch (h->bit_per_pixel)
+    {
+        /* each byte of data represents 8 pixels, with the most significant 
+         * bit mapped into the leftmost pixel */
+        case 1:
+            bits_to_pixel(buf, row, h->width);
+            break;
+
+        /* each byte represents 2 pixel, with the most significant nibble
+         * mapped into the leftmost pixel */
+        case 4:
+            for (j = 0; j < h->width; j += 2)
+            {
+                /* read the two pixels in the current byte */
+                row[j].i = READ_MASK(*buf, mask4[HI_NIBBLE]);
+
+                if (j + 1 < h->width)
+                    row[j + 1].i = READ_MASK(*buf, mask4[LO_NIBBLE]);
+
+                /* advance to the next byte */
+                ++buf;
+            }
+            break;
+
+        /* each byte represents 1 pixel */
+        case 8:
+            for (j = 0; j < h->width; ++j)
+                row[j].i = *(buf++);
+            break;
+
+        /* each pixel is represented with 2 bytes */
+        case 16:
+            /* one table load for each pixel, when the table is available */
+            if (fmt->lut)
+            {
+                for (j = 0; j < h->width; ++j)
+                {
+                    uint16_t px;
+                    memcpy(&px, buf, 2);
+                    row[j] = fmt->lut[px];
+                    buf += 2;
+                }
+                break;
+            }
+
+            for (j = 0; j < h->width; ++j)
+            {
+                uint16_t px;
+                memcpy(&px, buf, 2);
+                row[j].b = decode_field(px, &f[B]);
+                row[j].g = decode_field(px, &f[G]);
+                row[j].r = decode_field(px, &f[R]);
+                row[j].i = 0;
+
+                /* advance to the next pixel (half-word) */
+                buf += 2;
+            }
+            break;
+
+        /* each pixel is represented with 3 bytes, with 1 byte for each 
+         * component */
+        case 24:
+            bgr_to_pixel(buf, row, h->width);
+            break;
+
+        case 32:
+            for (j = 0; j < h->width; ++j)
+            {
+                uint32_t px;
+                memcpy(&px, buf, 4);
+                row[j].b = decode_field(px, &f[B]);
+                row[j].g = decode_field(px, &f[G]);
+                row[j].r = decode_field(px, &f[R]);
+                row[j].i = decode_field(px, &f[A]);
+
+                /* advance to the next pixel (word) */
+                buf += 4;
+            }
+            break;
+    }
+}
+
+/*
+ * \brief Convert a row of palette image data into compact storage.
+ * @param h Bitmap header.
+ * @param buf Row data, as stored in the file.
+ * @param row Output row of indices.
+ */
+static void decode_index_row(const Bmp_header *h, const uint8_t *buf, uint8_t *row)
+{
+    size_t j;
+
+    switch (h->bit_per_pixel)
+    {
+        /* the compact storage of 1 bit images matches the file layout, 
+         * padding excluded */
+        case 1:
+        case 8:
+            memcpy(row, buf, index_row_bytes(h));
+            break;
+
+        /* each byte represents 2 pixel, with the most significant nibble
+         * mapped into the leftmost pixel */
+        case 4:
+            for (j = 0; j + 1 < h->width; j += 2)
+            {
+                row[j] = *buf >> 4;
+                row[j + 1] = *buf++ & mask4[LO_NIBBLE];
+            }
+            if (j < h->width)
+                row[j] = *buf >> 4;
+            break;
+    }
+}
+
+/* Context for the decoding of the rows of an image. */
+typedef struct Decode_job
+{
+    const Pixel_format *fmt; /* pixel format */
+    const uint8_t *data;     /* pixel data, as stored in the file */
+    size_t stride;           /* size (byte) of a row in the file */
+    Image image;             /* output image */
+    Span_fn convert;         /* conversion of decoded rows, or NULL */
+} Decode_job;
+
+/*
+ * \brief Decode a range of rows into an image, in either storage.
+ */
+static void decode_rows(void *ctx, size_t begin, size_t end)
+{
+    Decode_job *job = (Decode_job*) ctx;
+    Image *im = &job->image;
+    size_t i;
+
+    for (i = begin; i < end; ++i)
+    {
+        if (im->indices)
+        {
+            decode_index_row(&im->bmp_header, 
+                             job->data + i * job->stride, 
+                             im->indices + i * im->index_stride);
+        }
+        else
+        {
+            /* rows are stored in file order, with no reversal */
+            Pixel *row = im->pixels + i * im->stride;
+            decode_row(job->fmt, job->data + i * job->stride, row);
+            /* convert while the row is still in cache */
+            if (job->convert)
+                job->convert(row, im->bmp_header.width, NULL);
+        }
+    }
+}
+
+/*
+ * \brief Get the color conversion requested by a set of opening flags.
+ * @param flags Opening flags.
+ * @return Span operation, or NULL if no conversion is requested.
+ */
+static Span_fn open_conversion(int flags)
+{
+    if (flags & BMP_OPEN_LUMA)
+        return rgb2luma_span;
+    if (flags & BMP_OPEN_YCBCR)
+        return rgb2ycbcr_span;
+    return NULL;
+}
+
+/*!
+ * Open a bitmap file.
+ */
+Image open_bitmap(const char *filename)
+{
+    return open_bitmap_ex(filename, 0, NULL);
+}
+
+/*
+ * \brief Decode run length encoded pixel data (BI_RLE8 or BI_RLE4) into an
+ *        image, in either storage.
+ *
+ * Runs and absolute blocks are written straight into the rows of the 
+ * image, with no intermediate buffer. Pixels skipped by delta and end of
+ * line escapes, or left after the end of the data, keep the index zero.
+ * @param image Image, with zeroed pixel storage.
+ * @param data Encoded data.
+ * @param size Size (byte) of the encoded data.
+ * @return Zero on success, nonzero if an escape runs past the data.
+ */
+static int decode_rle(Image *image, const uint8_t *data, size_t size)
+{
+    const Bmp_header *h = &image->bmp_header;
+    int rle4 = h->compression_type == BI_RLE4;
+    size_t step = image->indices ? 1 : sizeof (Pixel);
+    size_t row = 0, col = 0, pos = 0;
+    size_t n, v, k, m, bytes;
+
+    while (row < h->height && size - pos >= 2)
+    {
+        uint8_t *dst = NULL;
+
+        if (col < h->width)
+            dst = image->indices 
+                ? image->indices + row * image->index_stride + col
+                : &image->pixels[row * image->stride + col].i;
+
+        n = data[pos];
+        v = data[pos + 1];
+        pos += 2;
+
+        /* pixels past the end of the row are dropped */
+        m = col < h->width ? MIN(n ? n : v, h->width - col) : 0;
+
+        if (n)
+        {
+            /* encoded run, of one index or of two alternating ones */
+            uint8_t run[2];
+            run[0] = rle4 ? v >> 4 : v;
+            run[1] = rle4 ? v & mask4[LO_NIBBLE] : v;
+            for (k = 0; k < m; ++k)
+                dst[k * step] = run[k % 2];
+            col += n;
+        }
+        else if (v == 0)
+        {
+            /* end of line */
+            ++row;
+            col = 0;
+        }
+        else if (v == 1)
+        {
+            /* end of bitmap */
+            break;
+        }
+        else if (v == 2)
+        {
+            /* delta, moving right and up */
+            if (size - pos < 2)
+                return 1;
+            col += data[pos];
+            row += data[pos + 1];
+            pos += 2;
+        }
+        else
+        {
+            /* absolute block of v indices, padded to 16 bit */
+            bytes = rle4 ? (v + 1) / 2 : v;
+            if (size - pos < bytes)
+                return 1;
+            for (k = 0; k < m; ++k)
+                dst[k * step] = !rle4 ? data[pos + k]
+                              : k % 2 ? data[pos + k / 2] & mask4[LO_NIBBLE]
+                              : data[pos + k / 2] >> 4;
+            col += v;
+            pos = MIN(size, pos + bytes + bytes % 2);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * \brief Decode the pixel data of a bitmap into an image.
+ * @param image Image, with header and palette set. Its pixel storage is 
+ *        allocated here, and the whole image is released on failure.
+ * @param data Pixel data, as stored in the file.
+ * @param size Size (byte) of the pixel data.
+ * @param flags Opening flags.
+ * @param exec Execution context, or NULL.
+ * @return Zero on success, nonzero otherwise.
+ */
+static int decode_image(Image *image, 
+                        const uint8_t *data, 
+                        size_t size,
+                        int flags, 
+                        Bmp_exec *exec)
+{
+    Bmp_header *h = &image->bmp_header;
+    Pixel_format fmt;
+    Decode_job job;
+    int compact = (flags & BMP_OPEN_INDEXED) && h->bit_per_pixel <= 8;
+
+    /* allocate memory for the bitmap data (as a contiguous block) */
+    init_format(&fmt, h, 0);
+    if ((compact ? alloc_indices(image) : alloc_pixels(image))
+            || init_lut16(&fmt))
+    {
+        free_format(&fmt);
+        destroy_image(image);
+        return 1;
+    }
+
+    /* convert bitmap data into high level pixel representation,
+     * each row has a padding to a 4 byte alignment */
+    job.fmt = &fmt;
+    job.data = data;
+    job.stride = row_bytes(h);
+    job.image = *image;
+    job.convert = open_conversion(flags);
+
+    /* the colors of palette images are held by the palette, which has the
+     * same layout of a row of pixels */
+    if (job.convert && h->bit_per_pixel <= 8)
+    {
+        job.convert((Pixel*) image->palette, h->color_no, NULL);
+        job.convert = NULL;
+    }
+
+    /* run length encoded data can only be decoded sequentially */
+    if (h->compression_type == BI_RLE8 || h->compression_type == BI_RLE4)
+    {
+        if (decode_rle(image, data, size))
+        {
+            fprintf(stderr, "Truncated RLE data.\n");
+            free_format(&fmt);
+            destroy_image(image);
+            return 1;
+        }
+    }
+    else
+    {
+        bmp_parallel_for_rows(exec, h->height, 0, decode_rows, &job);
+    }
+
+    free_format(&fmt);
+    return 0;
+}
+
+/*!
+ * Open a bitmap file, with options.
+ */
+Image open_bitmap_ex(const char *filename, int flags, Bmp_exec *exec)
+{
+    FILE *f; 
+    File_header file_header; 
+    Image image;
+    uint8_t *bitmap_buffer;
+    size_t size;
+
+    memset(&image, 0, sizeof (Image));
+
+    /* open input file */
+    f = fopen(filename, "rb");
+    if (f == NULL)
+        return image;
+
+    /* read headers and palette */
+    if (read_headers(f, &file_header, &image.bmp_header, &image.palette))
+    {
+        fclose(f);
+        memset(&image, 0, sizeof (Image));
+        return image;
+    }
+    image.top_down = take_row_order(&image.bmp_header);
+
+    /* read bitmap data from the file and put it into a buffer (whose size
+     * is given by the header for compressed data) */
+    size = row_bytes(&image.bmp_header) * image.bmp_header.height;
+    if (image.bmp_header.compression_type == BI_RLE8
+            || image.bmp_header.compression_type == BI_RLE4)
+        size = image.bmp_header.image_size;
+    bitmap_buffer = (uint8_t*) malloc(size);
+    if (!bitmap_buffer || fread(bitmap_buffer, size, 1, f) != 1)
+    {
+        free(bitmap_buffer);
+        destroy_image(&image);
+        fclose(f);
+        return image;
+    }
+    fclose(f);
+
+    decode_image(&image, bitmap_buffer, size, flags, exec);
+
+    free(bitmap_buffer);
+    return image;
+}
+
+/*!
+ * Decode a bitmap held in memory.
+ */
+Image decode_bitmap_buffer(const uint8_t *data, size_t size)
+{
+    return decode_bitmap_buffer_ex(data, size, 0, NULL);
+}
+
+/*!
+ * Decode a bitmap held in memory, with options. The pixels are decoded 
+ * straight from the input, with no intermediate copy.
+ */
+Image decode_bitmap_buffer_ex(const uint8_t *data, 
+                              size_t size, 
+                              int flags, 
+                              Bmp_exec *exec)
+{
+    File_header file_header;
+    Image image;
+    Bmp_header *h = &image.bmp_header;
+    size_t palette_offset;
+    size_t stride;
+    int rle;
+
+    memset(&image, 0, sizeof (Image));
+
+    if (parse_headers(data, size, &file_header, h))
+        return image;
+    image.top_down = take_row_order(h);
+
+    /* ensure the palette and all the rows lie inside the buffer, while 
+     * compressed data is bounded by the buffer while decoding */
+    palette_offset = headers_size(h);
+    stride = row_bytes(h);
+    rle = h->compression_type == BI_RLE8 || h->compression_type == BI_RLE4;
+    if (h->width == 0
+            || (size - palette_offset) / 4 < h->color_no
+            || file_header.bmp_offset > size
+            || (!rle && (size - file_header.bmp_offset) / stride < h->height))
+    {
+        fprintf(stderr, "decode_bitmap_buffer: truncated bitmap data.\n");
+        memset(&image, 0, sizeof (Image));
+        return image;
+    }
+
+    if (h->color_no)
+    {
+        image.palette = (Color*) malloc(h->color_no * sizeof (Color));
+        if (!image.palette)
+        {
+            fprintf(stderr, "decode_bitmap_buffer: memory error.\n");
+            memset(&image, 0, sizeof (Image));
+            return image;
+        }
+        memcpy(image.palette, data + palette_offset, h->color_no * 4);
+    }
+
+    if (decode_image(&image, 
+                     data + file_header.bmp_offset, 
+                     size - file_header.bmp_offset, 
+                     flags, 
+                     exec))
+        fprintf(stderr, "decode_bitmap_buffer: memory error.\n");
+
+    return image;
+}
+
+/*!
+ * Read and validate the headers of a bitmap file, without reading its
+ * palette or its pixel data.
+ */
+int probe_bitmap(const char *filename, Bmp_header *header)
+{
+    uint8_t buf[sizeof (File_header) + sizeof (Bmp_header)];
+    File_header fh;
+    Bmp_header h;
+    struct stat st;
+    uint64_t rows, data_size;
+    ssize_t n;
+    int fd;
+
+    memset(header, 0, sizeof (Bmp_header));
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return 1;
+
+    /* a single read covers the file header and the largest bitmap header */
+    n = pread(fd, buf, sizeof buf, 0);
+    if (n < 0 || fstat(fd, &st))
+    {
+        close(fd);
+        return 1;
+    }
+    close(fd);
+
+    if (parse_headers(buf, n, &fh, &h))
+        return 1;
+
+    /* a negative height marks a top-down bitmap */
+    rows = (int32_t) h.height < 0 ? -(int64_t) (int32_t) h.height : h.height;
+    if (!h.width || !rows || h.color_planes != 1)
+    {
+        fprintf(stderr, "probe_bitmap: invalid image size.\n");
+        return 1;
+    }
+
+    if (h.bit_per_pixel <= 8 && h.color_no > (1u << h.bit_per_pixel))
+    {
+        fprintf(stderr, "probe_bitmap: too many colors for the bpp.\n");
+        return 1;
+    }
+
+    /* the palette lies between the headers and the pixel data */
+    if (fh.bmp_offset < headers_size(&h) + 4 * (uint64_t) h.color_no)
+    {
+        fprintf(stderr, "probe_bitmap: invalid pixel data offset.\n");
+        return 1;
+    }
+
+    /* uncompressed rows have a known size, while the size of compressed 
+     * data is only known from the header */
+    data_size = h.image_size;
+    if (h.compression_type == BI_RGB || h.compression_type == BI_BITFIELDS)
+    {
+        data_size = row_bytes(&h) * rows;
+        if (h.image_size && h.image_size < data_size)
+        {
+            fprintf(stderr, 
+                    "probe_bitmap: image size inconsistent with width, bpp "
+                    "and padding.\n");
+            return 1;
+        }
+    }
+
+    if ((uint64_t) st.st_size < fh.bmp_offset + data_size)
+    {
+        fprintf(stderr, "probe_bitmap: truncated pixel data.\n");
+        return 1;
+    }
+
+    *header = h;
+    return 0;
+}
+
+/* Number of rows decoded at once by a streaming reader. */
+#define READER_WINDOW 16
+
+/* State of a streaming reader. */
+struct Bmp_reader
+{
+    FILE *f;               /* input file */
+    Bmp_header bmp_header; /* header of the bitmap */
+    Pixel_format fmt;      /* pixel format */
+    Color *palette;        /* color palette */
+    uint8_t *window;       /* raw data for a window of rows */
+    size_t stride;         /* size (byte) of a raw row */
+    size_t row;            /* index of the next row to be read */
+    int top_down;          /* nonzero if rows are stored top to bottom */
+};
+
+/*!
+ * Open a bitmap file for row by row reading.
+ */
+Bmp_reader* bmp_reader_open(const char *filename)
+{
+    Bmp_reader *r;
+    File_header file_header;
+
+    r = (Bmp_reader*) calloc(1, sizeof (Bmp_reader));
+    if (!r)
+        return NULL;
+
+    r->f = fopen(filename, "rb");
+    if (!r->f)
+    {
+        free(r);
+        return NULL;
+    }
+
+    if (read_headers(r->f, &file_header, &r->bmp_header, &r->palette))
+    {
+        fclose(r->f);
+        free(r);
+        return NULL;
+    }
+    r->top_down = take_row_order(&r->bmp_header);
+
+    if (r->bmp_header.compression_type == BI_RLE8 
+            || r->bmp_header.compression_type == BI_RLE4)
+    {
+        fprintf(stderr, 
+                "bmp_reader_open: compressed bitmaps are not supported.\n");
+        free(r->palette);
+        fclose(r->f);
+        free(r);
+        return NULL;
+    }
+
+    r->stride = row_bytes(&r->bmp_header);
+    r->window = (uint8_t*) malloc(READER_WINDOW * r->stride);
+    init_format(&r->fmt, &r->bmp_header, 0);
+    if (!r->window || init_lut16(&r->fmt))
+    {
+        bmp_reader_close(r);
+        return NULL;
+    }
+
+    return r;
+}
+
+/*!
+ * Get the header of the bitmap under reading.
+ */
+const Bmp_header* bmp_reader_header(const Bmp_reader *reader)
+{
+    return &reader->bmp_header;
+}
+
+/*!
+ * Get the palette of the bitmap under reading.
+ */
+const Color* bmp_reader_palette(const Bmp_reader *reader)
+{
+    return reader->palette;
+}
+
+/*!
+ * Get the row order of the bitmap under reading.
+ */
+int bmp_reader_top_down(const Bmp_reader *reader)
+{
+    return reader->top_down;
+}
+
+/*!
+ * Decode the next rows of the bitmap, one window at a time.
+ */
+size_t bmp_reader_next_rows(Bmp_reader *reader, size_t n, Pixel *dst)
+{
+    const Bmp_header *h = &reader->bmp_header;
+    size_t done = 0;
+    size_t i;
+
+    n = MIN(n, h->height - reader->row);
+    while (done < n)
+    {
+        size_t count = MIN(n - done, READER_WINDOW);
+
+        if (fread(reader->window, reader->stride, count, reader->f) != count)
+        {
+            fprintf(stderr, "bmp_reader_next_rows: read error.\n");
+            break;
+        }
+
+        for (i = 0; i < count; ++i)
+            decode_row(&reader->fmt, 
+                       reader->window + i * reader->stride, 
+                       dst + (done + i) * h->width);
+
+        done += count;
+    }
+
+    reader->row += done;
+    return done;
+}
+
+/*!
+ * Close a streaming reader.
+ */
+void bmp_reader_close(Bmp_reader *reader)
+{
+    if (!reader)
+        return;
+
+    if (reader->f)
+        fclose(reader->f);
+    free(reader->palette);
+    free(reader->window);
+    free_format(&reader->fmt);
+    free(reader);
+}
+
+/*!
+ * Map a bitmap file in memory, and return a view over its rows.
+ */
+Bitmap_view open_bitmap_mmap(const char *filename)
+{
+    Bitmap_view view;
+    File_header file_header;
+    Bmp_header *h = &view.bmp_header;
+    struct stat st;
+    size_t stride;
+    int top_down;
+    void *map;
+    int fd;
+
+    memset(&view, 0, sizeof (Bitmap_view));
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return view;
+
+    if (fstat(fd, &st) || st.st_size <= 0)
+    {
+        close(fd);
+        return view;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); /* the mapping holds its own reference to the file */
+    if (map == MAP_FAILED)
+        return view;
+
+    if (parse_headers((const uint8_t*) map, st.st_size, &file_header, h))
+    {
+        munmap(map, st.st_size);
+        return view;
+    }
+
+    if (h->compression_type != BI_RGB
+            || (h->bit_per_pixel != 24 && h->bit_per_pixel != 32))
+    {
+        fprintf(stderr, 
+                "open_bitmap_mmap: only uncompressed 24 and 32 bit images "
+                "are supported.\n");
+        munmap(map, st.st_size);
+        return view;
+    }
+
+    /* a negative height marks a top-down bitmap */
+    top_down = take_row_order(h);
+
+    /* ensure all the rows lie inside the file */
+    stride = row_bytes(h);
+    if (h->width == 0
+            || file_header.bmp_offset > (size_t) st.st_size
+            || (st.st_size - file_header.bmp_offset) / stride < h->height)
+    {
+        fprintf(stderr, "open_bitmap_mmap: truncated pixel data.\n");
+        munmap(map, st.st_size);
+        return view;
+    }
+
+    view.map = map;
+    view.map_size = st.st_size;
+    view.data = (const uint8_t*) map + file_header.bmp_offset;
+    view.stride = stride;
+
+    /* rows of top-down bitmaps are walked backwards, so that row zero is
+     * always the bottom one */
+    if (top_down)
+    {
+        view.data += (h->height - 1) * stride;
+        view.stride = -view.stride;
+    }
+
+    return view;
+}
+
+/*!
+ * Release the mapping of a bitmap view.
+ */
+void close_bitmap_mmap(Bitmap_view *view)
+{
+    if (view->map)
+        munmap(view->map, view->map_size);
+
+    memset(view, 0, sizeof (Bitmap_view));
+}
+
+/*!
+ * Get a row of a bitmap view.
+ */
+const uint8_t* view_row(Bitmap_view view, size_t row)
+{
+    return view.data + (long) row * view.stride;
+}
+
+/*!
+ * Read a pixel from a bitmap view.
+ */
+Pixel view_pixel(Bitmap_view view, size_t row, size_t col)
+{
+    const uint8_t *px = view_row(view, row) 
+        + col * (view.bmp_header.bit_per_pixel / 8);
+    Pixel p;
+
+    p.b = px[0];
+    p.g = px[1];
+    p.r = px[2];
+    p.i = 0;
+
+    return p;
+}
+
+/*
+ * \brief Convert a row of pixels into bitmap format.
+ * @param fmt Pixel format.
+ * @param row Input row (width pixels).
+ * @param buf Output buffer, with room for a full row (padding included).
+ */
+static void encode_row(const Pixel_format *fmt, const Pixel *row, uint8_t *buf)
+{
+    const Bmp_header *h = fmt->h;
+    uint8_t *end = buf + row_bytes(h);
+    size_t j;
+
+    switch (h->bit_per_pixel)
+    {
+        /* each byte of data represents 8 pixels, with the most significant 
+         * bit mapped into the leftmost pixel */
+        case 1:
+            pixel_to_bits(row, buf, h->width);
+            buf += (h->width + 7) / 8;
+            break;
+
+        /* each byte represents 2 pixel, with the most significant nibble
+         * mapped into the leftmost pixel */
+        case 4:
+            for (j = 0; j < h->width; j += 2)
+            {
+                /* write two pixels in the one byte variable tmp */
+                uint8_t tmp = 0;
+                /* most significant nibble */
+                tmp |= row[j].i << 4;
+                if (j + 1 < h->width)
+                    /* least significant nibble */
+                    tmp |= row[j + 1].i & mask4[LO_NIBBLE];
+
+                /* write the byte in the image buffer */
+                *buf++ = tmp;
+            }
+            break;
+
+        /* each byte represents 1 pixel */
+        case 8:
+            for (j = 0; j < h->width; ++j)
+                *buf++ = row[j].i;
+            break;
+
+        /* each pixel is represented with 2 bytes */
+        case 16:
+            for (j = 0; j < h->width; ++j)
+            {
+                uint16_t px = 
+                    fmt->enc[B][row[j].b] |
+                    fmt->enc[G][row[j].g] | 
+                    fmt->enc[R][row[j].r];
+                memcpy(buf, &px, 2);
+
+                /* advance to the next pixel (half-word) */
+                buf += 2;
+            }
             break;
 
         /* each pixel is represented with 3 bytes, with 1 byte for each 
-         * component */
+         * color component */
         case 24:
-            for (i = 0; i < h->height; ++i)
+            pixel_to_bgr(row, buf, h->width);
+            buf += 3 * h->width;
+            break;
+
+        /* each pixel is represented with 4 bytes */
+        case 32:
+            for (j = 0; j < h->width; ++j)
+            {
+                uint32_t px = 
+                    fmt->enc[B][row[j].b] |
+                    fmt->enc[G][row[j].g] | 
+                    fmt->enc[R][row[j].r] | 
+                    fmt->enc[A][row[j].i];
+                memcpy(buf, &px, 4);
+
+                /* advance to the next pixel (word) */
+                buf += 4;
+            }
+            break;
+    }
+
+    /* each row has a padding to a 4 byte alignment */
+    while (buf < end)
+        *buf++ = 0;
+}
+
+/*
+ * \brief Convert a row of palette indices in compact storage into bitmap 
+ *        format.
+ * @param h Bitmap header.
+ * @param row Input row of indices.
+ * @param buf Output buffer, with room for a full row (padding included).
+ */
+static void encode_index_row(const Bmp_header *h, const uint8_t *row, uint8_t *buf)
+{
+    uint8_t *end = buf + row_bytes(h);
+    size_t j;
+
+    switch (h->bit_per_pixel)
+    {
+        case 1:
+        case 8:
+            memcpy(buf, row, index_row_bytes(h));
+            buf += index_row_bytes(h);
+            break;
+
+        /* each byte represents 2 pixel, with the most significant nibble
+         * mapped into the leftmost pixel */
+        case 4:
+            for (j = 0; j + 1 < h->width; j += 2)
+                *buf++ = row[j] << 4 | (row[j + 1] & mask4[LO_NIBBLE]);
+            if (j < h->width)
+                *buf++ = row[j] << 4;
+            break;
+    }
+
+    /* each row has a padding to a 4 byte alignment */
+    while (buf < end)
+        *buf++ = 0;
+}
+
+/* Number of rows encoded at once by a streaming writer. */
+#define WRITER_WINDOW 16
+
+/* State of a streaming writer. */
+struct Bmp_writer
+{
+    FILE *f;               /* output file (NULL for memory output) */
+    uint8_t *mem;          /* output buffer (NULL for file output) */
+    size_t pos;            /* bytes written (or counted, without output) */
+    Bmp_header bmp_header; /* header of the bitmap */
+    Pixel_format fmt;      /* pixel format */
+    Bmp_exec *exec;        /* execution context for the encoding */
+    uint8_t *window;       /* encoded data for a window of rows (NULL for
+                              uncompressed memory output, encoded in place) */
+    size_t window_rows;    /* rows in the window */
+    size_t stride;         /* size (byte) of an encoded row */
+    size_t row;            /* index of the next row to be written */
+    Pixel *scratch;        /* rows converted to RGB, for each window row 
+                              (NULL if no conversion is needed) */
+    uint32_t rle;          /* BI_RLE8 or BI_RLE4, or zero for raw rows */
+    uint8_t *rle_idx;      /* indices of a row, before run length encoding */
+    uint8_t *rle_buf;      /* run length encoded row */
+};
+
+/* Context for the encoding of a window of rows. */
+typedef struct Encode_job
+{
+    Bmp_writer *writer;  /* writer object */
+    uint8_t *dst;        /* first output row */
+    const uint8_t *src;  /* first input row */
+    size_t src_stride;   /* distance (byte) between two input rows */
+    int compact;         /* nonzero for rows of indices in compact storage */
+} Encode_job;
+
+/*
+ * \brief Encode a range of rows into the window of a writer.
+ */
+static void encode_rows(void *ctx, size_t begin, size_t end)
+{
+    Encode_job *job = (Encode_job*) ctx;
+    Bmp_writer *w = job->writer;
+    size_t i;
+
+    for (i = begin; i < end; ++i)
+    {
+        const uint8_t *row = job->src + i * job->src_stride;
+        uint8_t *buf = job->dst + i * w->stride;
+
+        if (job->compact)
+        {
+            encode_index_row(&w->bmp_header, row, buf);
+            continue;
+        }
+
+        /* convert a copy of the row, right before encoding it */
+        if (w->scratch)
+        {
+            Pixel *tmp = w->scratch + i * w->bmp_header.width;
+            memcpy(tmp, row, w->bmp_header.width * sizeof (Pixel));
+            ycbcr2rgb_span(tmp, w->bmp_header.width, NULL);
+            row = (const uint8_t*) tmp;
+        }
+        encode_row(&w->fmt, (const Pixel*) row, buf);
+    }
+}
+
+/*
+ * \brief Length of the run starting at a pixel, of one index (BI_RLE8) or
+ *        of two alternating indices (BI_RLE4).
+ * @param idx Indices, one byte for each pixel.
+ * @param j First pixel of the run.
+ * @param end End of the pixels available for the run.
+ * @param rle4 Nonzero for BI_RLE4.
+ * @return Length of the run (at most 255 pixels).
+ */
+static size_t rle_run(const uint8_t *idx, size_t j, size_t end, int rle4)
+{
+    size_t t = 1;
+
+    end = MIN(end, j + 255);
+    while (j + t < end && idx[j + t] == idx[j + (rle4 ? t % 2 : 0)])
+        ++t;
+
+    return t;
+}
+
+/*
+ * \brief Run length encode a row of indices (BI_RLE8 or BI_RLE4), followed
+ *        by an end of line escape.
+ *
+ * Runs long enough are stored as encoded runs, and the pixels between them
+ * as absolute blocks, padded to 16 bit. Blocks shorter than 3 pixels, which
+ * cannot be stored in absolute mode, are stored as short runs. Each stored
+ * pixel takes at most 2 bytes.
+ * @param idx Indices, one byte for each pixel.
+ * @param w Number of pixels.
+ * @param rle4 Nonzero for BI_RLE4, zero for BI_RLE8.
+ * @param out Output buffer, of at least `2 * w + 2` bytes.
+ * @return Number of bytes written.
+ */
+static size_t rle_encode_row(const uint8_t *idx, size_t w, int rle4, uint8_t *out)
+{
+    /* shortest run worth breaking an absolute block for */
+    const size_t min_run = rle4 ? 5 : 3;
+    uint8_t *o = out;
+    size_t j = 0, k, n, r;
+
+    while (j < w)
+    {
+        r = rle_run(idx, j, w, rle4);
+        if (r < min_run)
+        {
+            /* absolute block, up to the next run worth encoding */
+            for (k = j + 1; k < w && k - j < 255; ++k)
+                if (rle_run(idx, k, MIN(k + min_run, w), rle4) >= min_run)
+                    break;
+            n = k - j;
+
+            if (n >= 3)
+            {
+                *o++ = 0;
+                *o++ = n;
+                if (rle4)
+                {
+                    for (k = 0; k < n; k += 2)
+                        *o++ = idx[j + k] << 4 | (k + 1 < n ? idx[j + k + 1] : 0);
+                    if ((n + 1) / 2 % 2)
+                        *o++ = 0;
+                }
+                else
+                {
+                    memcpy(o, idx + j, n);
+                    o += n;
+                    if (n % 2)
+                        *o++ = 0;
+                }
+                j += n;
+                continue;
+            }
+
+            /* too short for absolute mode */
+            r = rle_run(idx, j, j + n, rle4);
+        }
+
+        *o++ = r;
+        *o++ = rle4 ? idx[j] << 4 | (r > 1 ? idx[j + 1] : 0) : idx[j];
+        j += r;
+    }
+
+    /* end of line */
+    *o++ = 0;
+    *o++ = 0;
+
+    return o - out;
+}
+
+/*
+ * \brief Write bytes to the output of a writer. Writers without a file and
+ *        without a buffer only count the bytes.
+ * @return Zero on success, nonzero otherwise.
+ */
+static int writer_emit(Bmp_writer *w, const void *buf, size_t n)
+{
+    if (!n)
+        return 0;
+
+    if (w->mem)
+        memcpy(w->mem + w->pos, buf, n);
+    else if (w->f && fwrite(buf, n, 1, w->f) != 1)
+        return 1;
+
+    w->pos += n;
+    return 0;
+}
+
+/*
+ * \brief Release a writer object, without closing its file.
+ */
+static void writer_free(Bmp_writer *w)
+{
+    free(w->window);
+    free(w->scratch);
+    free(w->rle_idx);
+    free(w->rle_buf);
+    free(w);
+}
+
+/*
+ * \brief Create a writer object.
+ * @param filename Name for the output file, or NULL to write into `mem`.
+ * @param mem Output buffer, large enough for the whole file (only used 
+ *        without a file name). Without a file name nor a buffer, the writer
+ *        only counts the output bytes.
+ * @param header Header of the bitmap.
+ * @param palette Color palette.
+ * @param flags Saving flags.
+ * @param exec Execution context for the encoding, or NULL. With a context,
+ *        the window grows with the number of threads.
+ * @return A writer object, or NULL on failure.
+ */
+static Bmp_writer* writer_create(const char *filename, 
+                                 uint8_t *mem,
+                                 const Bmp_header *header, 
+                                 const Color *palette,
+                                 int flags,
+                                 Bmp_exec *exec)
+{
+    Bmp_writer *w;
+    Bmp_header *h;
+    Bmp_header stored;
+    File_header file_header;
+    Color *rgb_palette = NULL;
+    int top_down;
+
+    w = (Bmp_writer*) calloc(1, sizeof (Bmp_writer));
+    if (!w)
+        return NULL;
+
+    h = &w->bmp_header;
+    memcpy(h, header, sizeof (Bmp_header));
+    top_down = take_row_order(h);
+
+    /* color masks only apply to 16 and 32 bit images, which are stored with
+     * the default layout when they have none */
+    if (h->compression_type == BI_BITFIELDS
+            && ((h->bit_per_pixel != 16 && h->bit_per_pixel != 32)
+                || !(h->red_mask | h->green_mask | h->blue_mask)))
+        h->compression_type = BI_RGB;
+    init_format(&w->fmt, h, flags);
+    w->stride = row_bytes(h);
+
+    /* run length encoding is available for bottom-up 4 and 8 bit images,
+     * and the size of the encoded data is set on closing */
+    if ((flags & BMP_SAVE_RLE) && !top_down && h->bit_per_pixel == 8)
+        w->rle = BI_RLE8;
+    if ((flags & BMP_SAVE_RLE) && !top_down && h->bit_per_pixel == 4)
+        w->rle = BI_RLE4;
+    if (w->rle)
+        h->compression_type = w->rle;
+    else if (h->compression_type == BI_RLE8 || h->compression_type == BI_RLE4)
+        h->compression_type = BI_RGB;
+    h->image_size = w->rle ? 0 : w->stride * h->height;
+
+    /* bmp magic number */
+    file_header.file_type = 0x4D42;
+    /* file size */
+    file_header.file_size = headers_size(h)
+        + h->color_no * 4
+        + h->image_size;
+    /* reserved */
+    file_header.reserved1 = 0;
+    file_header.reserved2 = 0;
+    /* bmp offset */
+    file_header.bmp_offset = headers_size(h) + h->color_no * 4;
+
+    w->exec = exec;
+    w->window_rows = WRITER_WINDOW * bmp_exec_threads(exec);
+    if (!mem || w->rle)
+    {
+        w->window = (uint8_t*) malloc(w->window_rows * w->stride);
+        if (!w->window)
+        {
+            writer_free(w);
+            return NULL;
+        }
+    }
+
+    if (w->rle)
+    {
+        w->rle_idx = (uint8_t*) malloc(h->width);
+        w->rle_buf = (uint8_t*) malloc(2 * (size_t) h->width + 2);
+        if (!w->rle_idx || !w->rle_buf)
+        {
+            writer_free(w);
+            return NULL;
+        }
+    }
+
+    /* Y'CbCr input: palette images have their palette converted, other 
+     * images have each row converted before being encoded */
+    if ((flags & BMP_SAVE_FROM_YCBCR) && h->bit_per_pixel <= 8 && h->color_no)
+    {
+        rgb_palette = (Color*) malloc(h->color_no * sizeof (Color));
+        if (!rgb_palette)
+        {
+            writer_free(w);
+            return NULL;
+        }
+        memcpy(rgb_palette, palette, h->color_no * sizeof (Color));
+        ycbcr2rgb_span((Pixel*) rgb_palette, h->color_no, NULL);
+        palette = rgb_palette;
+    }
+    else if ((flags & BMP_SAVE_FROM_YCBCR) && h->bit_per_pixel > 8)
+    {
+        w->scratch = (Pixel*) malloc(w->window_rows * h->width * sizeof (Pixel));
+        if (!w->scratch)
+        {
+            writer_free(w);
+            return NULL;
+        }
+    }
+
+    /* open output file */
+    w->mem = filename ? NULL : mem;
+    w->f = filename ? fopen(filename, "wb") : NULL;
+    if (filename && !w->f)
+    {
+        free(rgb_palette);
+        writer_free(w);
+        return NULL;
+    }
+
+    /* write file header, bmp header (with a negative height for top-down
+     * bitmaps) and color palette if present */
+    stored = *h;
+    if (top_down)
+        stored.height = -(int64_t) h->height;
+    if (writer_emit(w, &file_header, sizeof (File_header))
+            || writer_emit(w, &stored, h->header_size)
+            || writer_emit(w, &stored.red_mask, extra_masks_size(h))
+            || writer_emit(w, palette, h->color_no * 4))
+    {
+        free(rgb_palette);
+        if (w->f)
+            fclose(w->f);
+        writer_free(w);
+        return NULL;
+    }
+
+    free(rgb_palette);
+    return w;
+}
+
+/*!
+ * Create a bitmap file for row by row writing.
+ */
+Bmp_writer* bmp_writer_open(const char *filename, 
+                            const Bmp_header *header, 
+                            const Color *palette,
+                            int flags)
+{
+    return writer_create(filename, NULL, header, palette, flags, NULL);
+}
+
+/*
+ * \brief Encode and write rows, one window at a time.
+ * @param writer Writer object.
+ * @param n Number of rows.
+ * @param src First input row.
+ * @param src_stride Distance (byte) between two input rows.
+ * @param compact Nonzero if rows hold indices in compact storage, zero if
+ *        they hold pixels.
+ * @return Zero on success, nonzero on failure.
+ */
+static int writer_put_rows(Bmp_writer *writer, 
+                           size_t n, 
+                           const uint8_t *src, 
+                           size_t src_stride,
+                           int compact)
+{
+    const Bmp_header *h = &writer->bmp_header;
+    size_t done = 0;
+    size_t i, size;
+    Encode_job job;
+
+    if (n > h->height - writer->row)
+    {
+        fprintf(stderr, "bmp_writer_write_rows: too many rows.\n");
+        return 1;
+    }
+
+    job.writer = writer;
+    job.src_stride = src_stride;
+    job.compact = compact;
+
+    while (done < n)
+    {
+        size_t count = MIN(n - done, writer->window_rows);
+
+        /* uncompressed memory output is encoded in place */
+        job.dst = writer->window ? writer->window : writer->mem + writer->pos;
+        job.src = src + done * src_stride;
+        bmp_parallel_for_rows(writer->exec, count, 0, encode_rows, &job);
+
+        if (writer->rle)
+        {
+            /* encoded rows are run length encoded one after the other */
+            for (i = 0; i < count; ++i)
+            {
+                decode_index_row(h, writer->window + i * writer->stride,
+                                 writer->rle_idx);
+                size = rle_encode_row(writer->rle_idx,
+                                      h->width,
+                                      writer->rle == BI_RLE4,
+                                      writer->rle_buf);
+                if (writer_emit(writer, writer->rle_buf, size))
+                {
+                    fprintf(stderr, "bmp_writer_write_rows: write error.\n");
+                    return 1;
+                }
+            }
+        }
+        else if (!writer->window)
+            writer->pos += count * writer->stride;
+        else if (writer_emit(writer, writer->window, count * writer->stride))
+        {
+            fprintf(stderr, "bmp_writer_write_rows: write error.\n");
+            return 1;
+        }
+
+        done += count;
+        writer->row += count;
+    }
+
+    return 0;
+}
+
+/*!
+ * Encode and write the next rows of the bitmap.
+ */
+int bmp_writer_write_rows(Bmp_writer *writer, size_t n, const Pixel *src)
+{
+    return writer_put_rows(writer, 
+                           n, 
+                           (const uint8_t*) src, 
+                           writer->bmp_header.width * sizeof (Pixel), 
+                           0);
+}
+
+/*
+ * \brief Terminate run length encoded data, and store its size into the
+ *        headers already written.
+ * @return Zero on success, nonzero otherwise.
+ */
+static int writer_finish_rle(Bmp_writer *w)
+{
+    const uint8_t eob[2] = {0, 1}; /* end of bitmap */
+    const Bmp_header *h = &w->bmp_header;
+    size_t file_size_at = offsetof(File_header, file_size);
+    size_t image_size_at = sizeof (File_header)
+                         + offsetof(Bmp_header, image_size);
+    uint32_t file_size, image_size;
+
+    if (writer_emit(w, eob, sizeof eob))
+        return 1;
+
+    file_size = w->pos;
+    image_size = w->pos
+        - (headers_size(h) + h->color_no * 4);
+
+    if (w->mem)
+    {
+        memcpy(w->mem + file_size_at, &file_size, 4);
+        memcpy(w->mem + image_size_at, &image_size, 4);
+    }
+    else if (w->f)
+    {
+        if (fseek(w->f, file_size_at, SEEK_SET)
+                || fwrite(&file_size, 4, 1, w->f) != 1
+                || fseek(w->f, image_size_at, SEEK_SET)
+                || fwrite(&image_size, 4, 1, w->f) != 1)
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * \brief Close a writer and release its resources.
+ * @param writer Writer object.
+ * @param size Pointer to store the size (byte) of the output, or NULL.
+ * @return Zero if the whole image was written successfully, nonzero
+ *         otherwise.
+ */
+static int writer_close(Bmp_writer *writer, size_t *size)
+{
+    int res = 0;
+
+    if (!writer)
+        return 1;
+
+    if (writer->row != writer->bmp_header.height)
+    {
+        fprintf(stderr, "bmp_writer_close: incomplete image.\n");
+        res = 1;
+    }
+    else if (writer->rle && writer_finish_rle(writer))
+    {
+        fprintf(stderr, "bmp_writer_close: write error.\n");
+        res = 1;
+    }
+
+    if (writer->f && fclose(writer->f))
+        res = 1;
+
+    if (size)
+        *size = writer->pos;
+
+    writer_free(writer);
+    return res;
+}
+
+/*!
+ * Close a streaming writer.
+ */
+int bmp_writer_close(Bmp_writer *writer)
+{
+    return writer_close(writer, NULL);
+}
+
+/*!
+ * Save a bitmap image.
+ */
+int save_bitmap(Image image, const char *filename)
+{
+    return save_bitmap_ex(image, filename, 0, NULL);
+}
+
+/*
+ * \brief Get the header of an image as stored in a file, with a negative
+ *        height for images stored top to bottom.
+ */
+static Bmp_header stored_header(Image image)
+{
+    Bmp_header h = image.bmp_header;
+
+    if (image.top_down)
+        h.height = -(int64_t) h.height;
+
+    return h;
+}
+
+/*
+ * \brief Encode all the rows of an image through a writer, in the order 
+ *        they are stored.
+ * @return Zero on success, nonzero otherwise.
+ */
+static int writer_put_image(Bmp_writer *w, Image image)
+{
+    const Bmp_header *h = &image.bmp_header;
+    size_t i;
+    int res = 0;
+
+    /* rows are handed to the writer in one go when they are contiguous */
+    if (image.indices)
+        res = writer_put_rows(w, 
+                              h->height, 
+                              image.indices, 
+                              image.index_stride, 
+                              1);
+    else if (image.pixels && image.stride == h->width)
+        res = bmp_writer_write_rows(w, h->height, image.pixels);
+    else
+        for (i = 0; i < h->height && !res; ++i)
+            res = bmp_writer_write_rows(w, 1, 
+                    image.pixel_data[image_storage_row(image, i)]);
+
+    return res;
+}
+
+/*!
+ * Save a bitmap image, with options.
+ */
+int save_bitmap_ex(Image image, 
+                   const char *filename, 
+                   int flags, 
+                   Bmp_exec *exec)
+{
+    Bmp_header h = stored_header(image);
+    Bmp_writer *w;
+    int res;
+
+    w = writer_create(filename, NULL, &h, image.palette, flags, exec);
+    if (!w)
+        return 1;
+
+    res = writer_put_image(w, image);
+    if (bmp_writer_close(w))
+        res = 1;
+
+    return res;
+}
+
+/*!
+ * Get the exact size of the file encoding an image.
+ */
+size_t encode_bitmap_size(Image image)
+{
+    const Bmp_header *h = &image.bmp_header;
+
+    return headers_size(h)
+        + (size_t) h->color_no * 4
+        + row_bytes(h) * h->height;
+}
+
+/*!
+ * Get the exact size of the file encoding an image, with options. The size
+ * of run length encoded images is found by encoding them without output.
+ */
+size_t encode_bitmap_size_ex(Image image, int flags)
+{
+    const Bmp_header *h = &image.bmp_header;
+    Bmp_writer *w;
+    size_t size = 0;
+    int res;
+
+    if (!(flags & BMP_SAVE_RLE)
+            || (h->bit_per_pixel != 4 && h->bit_per_pixel != 8)
+            || image.top_down)
+        return encode_bitmap_size(image);
+
+    w = writer_create(NULL, NULL, h, image.palette, flags, NULL);
+    if (!w)
+    {
+        fprintf(stderr, "encode_bitmap_size: memory error.\n");
+        return 0;
+    }
+
+    res = writer_put_image(w, image);
+    if (writer_close(w, &size) || res)
+        return 0;
+
+    return size;
+}
+
+/*!
+ * Encode an image into a memory buffer.
+ */
+int encode_bitmap_buffer(Image image, uint8_t *out, size_t size)
+{
+    return encode_bitmap_buffer_ex(image, out, size, 0, NULL);
+}
+
+/*!
+ * Encode an image into a memory buffer, with options. Uncompressed rows
+ * are encoded in place, with no intermediate copy.
+ */
+int encode_bitmap_buffer_ex(Image image, 
+                            uint8_t *out, 
+                            size_t size, 
+                            int flags, 
+                            Bmp_exec *exec)
+{
+    size_t need = encode_bitmap_size_ex(image, flags);
+    Bmp_header h = stored_header(image);
+    Bmp_writer *w;
+    int res;
+
+    if (!need)
+        return 1;
+
+    if (size < need)
+    {
+        fprintf(stderr, "encode_bitmap_buffer: output buffer too small.\n");
+        return 1;
+    }
+
+    w = writer_create(NULL, out, &h, image.palette, flags, exec);
+    if (!w)
+    {
+        fprintf(stderr, "encode_bitmap_buffer: memory error.\n");
+        return 1;
+    }
+
+    res = writer_put_image(w, image);
+    if (bmp_writer_close(w))
+        res = 1;
+
+    return res;
+}
+
+/*!
+ * Write a human readable dump of the image properties to a stream.
+ */
+int bmp_dump_to(FILE *stream, Image image)
+{
+    /* the height is reported as stored in a file */
+    Bmp_header stored = stored_header(image);
+    const Bmp_header *h = &stored;
+    size_t i;
+
+    fprintf(stream,
+            "Header size:  %10d\n"
+            "Image width:  %10d\n"
+            "Image height: %10d\n"
+            "Color planes: %10d\n"
+            "Bit per px:   %10d\n"
+            "Compression:  %10d\n"
+            "Bitmap size:  %10d\n"
+            "X resolution: %10d\n"
+            "Y resolution: %10d\n"
+            "Colors:       %10d\n"
+            "Important:    %10d\n"
+            "red_mask      %#010x\n"
+            "green_mask    %#010x\n"
+            "blue_mask     %#010x\n"
+            "alpha_mask    %#010x\n"
+            "cs_type       %10d\n"
+            "gamma_red     %10d\n"
+            "gamma_green   %10d\n"
+            "gamma_blue    %10d\n"
+            "intent        %10d\n"
+            "profile_data  %10d\n"
+            "profile_size  %10d\n",
+            h->header_size,
+            h->width,
+            h->height,
+            h->color_planes,
+            h->bit_per_pixel,
+            h->compression_type,
+            h->image_size,
+            h->h_resolution,
+            h->v_resolution,
+            h->color_no,
+            h->important_color_no,
+            h->red_mask,
+            h->green_mask,
+            h->blue_mask,
+            h->alpha_mask,
+            h->cs_type,
+            h->gamma_red,
+            h->gamma_green,
+            h->gamma_blue,
+            h->intent,
+            h->profile_data,
+            h->profile_size
+            );
+
+    if (h->color_no && image.palette)
+    {
+        fputs("\nPalette:\n", stream);
+        for (i = 0; i < h->color_no; ++i)
+            fprintf(stream,
+                    "%3lu: %3u %3u %3u %3u\n",
+                    (unsigned long) i,
+                    image.palette[i].r,
+                    image.palette[i].g,
+                    image.palette[i].b,
+                    image.palette[i].a
+                   );
+    }
+
+    if (ferror(stream))
+    {
+        fprintf(stderr, "bmp_dump_to: write error.\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+/*!
+ * Write the image properties to a stream as a JSON object, on one line.
+ */
+int bmp_dump_json(FILE *stream, Image image)
+{
+    Bmp_header stored = stored_header(image);
+    const Bmp_header *h = &stored;
+    size_t i;
+
+    fprintf(stream,
+            "{\"header_size\": %u, "
+            "\"width\": %u, "
+            "\"height\": %d, "
+            "\"color_planes\": %u, "
+            "\"bit_per_pixel\": %u, "
+            "\"compression_type\": %u, "
+            "\"image_size\": %u, "
+            "\"h_resolution\": %u, "
+            "\"v_resolution\": %u, "
+            "\"color_no\": %u, "
+            "\"important_color_no\": %u, "
+            "\"red_mask\": %u, "
+            "\"green_mask\": %u, "
+            "\"blue_mask\": %u, "
+            "\"alpha_mask\": %u, "
+            "\"cs_type\": %u, "
+            "\"gamma_red\": %u, "
+            "\"gamma_green\": %u, "
+            "\"gamma_blue\": %u, "
+            "\"intent\": %u, "
+            "\"profile_data\": %u, "
+            "\"profile_size\": %u, "
+            "\"palette\": [",
+            h->header_size,
+            h->width,
+            (int32_t) h->height,
+            h->color_planes,
+            h->bit_per_pixel,
+            h->compression_type,
+            h->image_size,
+            h->h_resolution,
+            h->v_resolution,
+            h->color_no,
+            h->important_color_no,
+            h->red_mask,
+            h->green_mask,
+            h->blue_mask,
+            h->alpha_mask,
+            h->cs_type,
+            h->gamma_red,
+            h->gamma_green,
+            h->gamma_blue,
+            h->intent,
+            h->profile_data,
+            h->profile_size
+            );
+
+    /* palette entries as [r, g, b, a] */
+    for (i = 0; image.palette && i < h->color_no; ++i)
+        fprintf(stream,
+                "%s[%u, %u, %u, %u]",
+                i ? ", " : "",
+                image.palette[i].r,
+                image.palette[i].g,
+                image.palette[i].b,
+                image.palette[i].a
+               );
+    fputs("]}\n", stream);
+
+    if (ferror(stream))
+    {
+        fprintf(stderr, "bmp_dump_json: write error.\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+/*!
+ * Return a string containing a human readable dump of the image properties.
+ */
+char* bmp_dump(Image image)
+{
+    char *out = NULL;
+    size_t size;
+    FILE *stream = open_memstream(&out, &size);
+    int res;
+
+    if (!stream)
+    {
+        fprintf(stderr, "bmp_dump: memory error.\n");
+        return NULL;
+    }
+
+    res = bmp_dump_to(stream, image);
+    if (fclose(stream) || res)
+    {
+        free(out);
+        return NULL;
+    }
+
+    return out;
+}
+
+/*!
+ * Return a string containing an ASCII art representation for the 
+ * two colors input image.
+ */
+char* ascii_print(Image image)
+{
+    char *out;
+    long i, j, k;
+    Bmp_header *h = &image.bmp_header;
+
+    if (h->color_no != 2)
+    {
+        fprintf(stderr, "ascii_print can print two colors images only.\n");
+        return NULL;
+    }
+
+    /* memory for the output string (+1 for row and string terminators) */
+    out = (char*) malloc((h->width + 1) * h->height + 1);
+    if (!out)
+    {
+        return NULL;
+    }
+
+    /* row zero is the bottom one, whatever the storage order */
+    k = 0;
+    for (i = h->height - 1; i >= 0; --i)
+    {
+        for (j = 0; j < (long) h->width; ++j)
+            out[k++] = (image_get_index(image, i, j) ? '*' : ' ');
+        out[k++] = '\n';
+    }
+    out[k] = '\0';
+
+    return out;
+}
+
+/* Context for the histogram span operation. */
+typedef struct Histogram_ctx
+{
+    unsigned long *hist; /* histogram (256 levels) */
+    int channel;         /* channel index */
+} Histogram_ctx;
+
+/*
+ * Accumulate the histogram of a channel over a run of pixels.
+ */
+static void histogram_span(Pixel *p, size_t n, void *ctx)
+{
+    Histogram_ctx *c = (Histogram_ctx*) ctx;
+    /* convert packed struct pointer into an array pointer 
+     * to access the channel */
+    const uint8_t *px = (const uint8_t*) p + c->channel;
+    size_t k;
+
+    for (k = 0; k < n; ++k)
+        c->hist[px[k * sizeof (Pixel)]] += 1;
+}
+
+/*
+ * \brief Accumulate the histogram of the indices of a compact image.
+ * @param image Image in compact storage.
+ * @param channel Channel (only the index channel A is not constant).
+ * @param hist Histogram (256 levels).
+ */
+static void histogram_indices(Image image, const int channel, unsigned long *hist)
+{
+    const Bmp_header *h = &image.bmp_header;
+    size_t i, j;
+
+    /* color channels are not used by palette images */
+    if (channel != A)
+    {
+        hist[0] = (unsigned long) h->width * h->height;
+        return;
+    }
+
+    for (i = 0; i < h->height; ++i)
+    {
+        const uint8_t *row = image.indices + i * image.index_stride;
+
+        if (h->bit_per_pixel == 1)
+        {
+            /* count set bits a byte at a time, masking the unused bits
+             * at the end of the row */
+            unsigned long ones = 0;
+            for (j = 0; j < h->width / 8; ++j)
+                ones += __builtin_popcount(row[j]);
+            if (h->width % 8)
+                ones += __builtin_popcount(row[j] & (0xFF00 >> (h->width % 8)));
+            hist[1] += ones;
+            hist[0] += h->width - ones;
+        }
+        else
+        {
+            for (j = 0; j < h->width; ++j)
+                hist[row[j]] += 1;
+        }
+    }
+}
+
+/*!
+ * Get the histogram for a channel.
+ */
+unsigned long* histogram(Image image, const int channel)
+{
+    Histogram_ctx ctx;
+
+    if (channel < 0 || channel > 3)
+    {
+        fprintf(stderr, "histogram: invalid channel parameter.\n");
+        return NULL;
+    }
+
+    ctx.hist = (unsigned long*) calloc(256, sizeof (unsigned long));
+    if (!ctx.hist)
+    {
+        fprintf(stderr, "histogram: memory error.\n");
+        return NULL;
+    }
+    ctx.channel = channel;
+
+    if (image.indices)
+        histogram_indices(image, channel, ctx.hist);
+    else
+        for_each_span(image, histogram_span, &ctx, NULL);
+    
+    return ctx.hist; 
+}
+
+/* Number of interleaved sub-tables for each channel histogram. */
+#define HIST_BANKS 4
+
+/* Context for the computation of the histograms of all the channels. */
+typedef struct Histogram_all_ctx
+{
+    Image image;                 /* image (in pixel storage) */
+    size_t grain;                /* rows in each range */
+    unsigned long (*part)[4][256]; /* partial histograms, one per range */
+} Histogram_all_ctx;
+
+/*
+ * \brief Add the sub-table counters into a set of histograms, and clear 
+ *        them.
+ */
+static void flush_banks(uint32_t bank[HIST_BANKS][4][256], 
+                        unsigned long out[4][256])
+{
+    int b, c, v;
+
+    for (b = 0; b < HIST_BANKS; ++b)
+        for (c = 0; c < 4; ++c)
+            for (v = 0; v < 256; ++v)
+                out[c][v] += bank[b][c][v];
+    memset(bank, 0, HIST_BANKS * sizeof (*bank));
+}
+
+/*
+ * \brief Compute the histograms of all the channels over a range of rows.
+ *
+ * Consecutive pixels are counted in different sub-tables, so that runs of
+ * equal values do not wait on the increment of the same counter. The 
+ * sub-tables are merged into the partial histogram of the range.
+ */
+static void histogram_all_rows(void *ctx, size_t begin, size_t end)
+{
+    Histogram_all_ctx *c = (Histogram_all_ctx*) ctx;
+    unsigned long (*out)[256] = c->part[begin / c->grain];
+    size_t w = c->image.bmp_header.width;
+    uint32_t bank[HIST_BANKS][4][256];
+    size_t pending = 0; /* pixels counted since the last flush */
+    size_t i, k;
+
+    memset(bank, 0, sizeof bank);
+
+    for (i = begin; i < end; ++i)
+    {
+        const uint8_t *px = (const uint8_t*) c->image.pixel_data[i];
+
+        /* each counter sees a quarter of the pixels, so flushing before 
+         * 2^32 pixels rules out any overflow */
+        if (pending + w > 0xFFFFFFFFul)
+        {
+            flush_banks(bank, out);
+            pending = 0;
+        }
+        pending += w;
+
+        for (k = 0; k + HIST_BANKS <= w; k += HIST_BANKS, px += 16)
+        {
+            bank[0][B][px[0]]++;  bank[0][G][px[1]]++;
+            bank[0][R][px[2]]++;  bank[0][A][px[3]]++;
+            bank[1][B][px[4]]++;  bank[1][G][px[5]]++;
+            bank[1][R][px[6]]++;  bank[1][A][px[7]]++;
+            bank[2][B][px[8]]++;  bank[2][G][px[9]]++;
+            bank[2][R][px[10]]++; bank[2][A][px[11]]++;
+            bank[3][B][px[12]]++; bank[3][G][px[13]]++;
+            bank[3][R][px[14]]++; bank[3][A][px[15]]++;
+        }
+        for (; k < w; ++k, px += 4)
+        {
+            bank[0][B][px[0]]++; bank[0][G][px[1]]++;
+            bank[0][R][px[2]]++; bank[0][A][px[3]]++;
+        }
+    }
+
+    flush_banks(bank, out);
+}
+
+/*!
+ * Get the histograms of all the channels.
+ */
+int histogram_all(Image image, unsigned long out[4][256])
+{
+    return histogram_all_ex(image, out, NULL);
+}
+
+/*!
+ * Get the histograms of all the channels, in parallel.
+ */
+int histogram_all_ex(Image image, unsigned long out[4][256], Bmp_exec *exec)
+{
+    const Bmp_header *h = &image.bmp_header;
+    Histogram_all_ctx ctx;
+    size_t ranges, threads = bmp_exec_threads(exec);
+    size_t r;
+    int c, v;
+
+    memset(out, 0, 4 * sizeof (*out));
+
+    if (!h->height)
+        return 0;
+
+    if (image.indices)
+    {
+        for (c = 0; c < 4; ++c)
+            histogram_indices(image, c, out[c]);
+        return 0;
+    }
+
+    /* one range for each thread, each one with its own partial histograms */
+    ctx.image = image;
+    ctx.grain = (h->height + threads - 1) / threads;
+    ranges = (h->height + ctx.grain - 1) / ctx.grain;
+    ctx.part = calloc(ranges, sizeof (*ctx.part));
+    if (!ctx.part)
+    {
+        fprintf(stderr, "histogram_all: memory error.\n");
+        return 1;
+    }
+
+    bmp_parallel_for_rows(exec, h->height, ctx.grain, histogram_all_rows, &ctx);
+
+    for (r = 0; r < ranges; ++r)
+        for (c = 0; c < 4; ++c)
+            for (v = 0; v < 256; ++v)
+                out[c][v] += ctx.part[r][c][v];
+
+    free(ctx.part);
+    return 0;
+}
+
+/* Context for the remapping of the indices of a compact image. */
+typedef struct Remap_ctx
+{
+    Image image;        /* image in compact storage */
+    const uint8_t *lut; /* new value for each stored byte */
+} Remap_ctx;
+
+/*
+ * \brief Remap the indices of a range of rows.
+ */
+static void remap_rows(void *ctx, size_t begin, size_t end)
+{
+    Remap_ctx *r = (Remap_ctx*) ctx;
+    size_t i, j;
+
+    for (i = begin; i < end; ++i)
+    {
+        uint8_t *row = r->image.indices + i * r->image.index_stride;
+        for (j = 0; j < r->image.index_stride; ++j)
+            row[j] = r->lut[row[j]];
+    }
+}
+
+/*
+ * \brief Remap the indices of a compact image through a table.
+ * @param image Image in compact storage.
+ * @param lut New value for each index (for 1 bit images, nonzero values 
+ *        are mapped into 1).
+ * @param exec Execution context, or NULL for serial execution.
+ */
+static void remap_indices(Image image, const uint8_t *lut, Bmp_exec *exec)
+{
+    const Bmp_header *h = &image.bmp_header;
+    uint8_t byte_lut[256];
+    Remap_ctx ctx;
+    size_t i;
+    int bit;
+
+    /* 1 bit images are remapped 8 pixels at a time, through a table giving
+     * the new value of each byte */
+    if (h->bit_per_pixel == 1)
+    {
+        for (i = 0; i < 256; ++i)
+        {
+            byte_lut[i] = 0;
+            for (bit = 0; bit < 8; ++bit)
+                if (lut[(i >> bit) & 0x1])
+                    byte_lut[i] |= 1 << bit;
+        }
+        lut = byte_lut;
+    }
+
+    ctx.image = image;
+    ctx.lut = lut;
+    bmp_parallel_for_rows(exec, h->height, 0, remap_rows, &ctx);
+}
+
+/*
+ * \brief Number of colors addressed by the indices of a palette image.
+ * @param h Bitmap header (at most 8 bit per pixel).
+ * @return Size of the palette, or the number of values of an index when 
+ *         the palette is absent or larger than that.
+ */
+static int palette_levels(const Bmp_header *h)
+{
+    uint32_t levels = 1u << h->bit_per_pixel;
+
+    return h->color_no && h->color_no < levels ? h->color_no : levels;
+}
+
+/* Context for the lookup table span operation. */
+typedef struct Lut_ctx
+{
+    uint32_t lut[256]; /* new value for each level (widened for gathers) */
+    int channel;       /* channel index */
+} Lut_ctx;
+
+/*
+ * \brief Remap a channel through a table over a run of pixels.
+ */
+static void lut_span_scalar(Pixel *p, size_t n, const Lut_ctx *l)
+{
+    /* convert packed struct pointer into an array pointer 
+     * to access the channel */
+    uint8_t *px = (uint8_t*) p + l->channel;
+    size_t k;
+
+    for (k = 0; k < n; ++k)
+        px[k * sizeof (Pixel)] = l->lut[px[k * sizeof (Pixel)]];
+}
+
+#ifdef X86_SIMD
+/*
+ * Remap a channel through a table, 8 pixels at a time. The channel is 
+ * shifted into the low byte of each 32 bit lane, the new values are 
+ * gathered from the widened table, and they are merged back into the 
+ * pixels.
+ */
+__attribute__((target("avx2")))
+static void lut_span_avx2(Pixel *p, size_t n, const Lut_ctx *l)
+{
+    const __m128i shift = _mm_cvtsi32_si128(8 * l->channel);
+    const __m256i low = _mm256_set1_epi32(0xFF);
+    const __m256i keep = _mm256_set1_epi32((int) ~(0xFFu << 8 * l->channel));
+    size_t j;
+
+    for (j = 0; j + 8 <= n; j += 8)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (p + j));
+        __m256i idx = _mm256_and_si256(_mm256_srl_epi32(v, shift), low);
+        __m256i g = _mm256_i32gather_epi32((const int*) l->lut, idx, 4);
+        v = _mm256_or_si256(_mm256_and_si256(v, keep), _mm256_sll_epi32(g, shift));
+        _mm256_storeu_si256((__m256i*) (p + j), v);
+    }
+
+    lut_span_scalar(p + j, n - j, l);
+}
+#endif
+
+/*
+ * Remap a channel through a table over a run of pixels.
+ */
+static void lut_span(Pixel *p, size_t n, void *ctx)
+{
+#ifdef X86_SIMD
+    if (bmp_simd_level() == BMP_SIMD_AVX2)
+    {
+        lut_span_avx2(p, n, (const Lut_ctx*) ctx);
+        return;
+    }
+#endif
+    lut_span_scalar(p, n, (const Lut_ctx*) ctx);
+}
+
+/*!
+ * Remap a channel through a lookup table.
+ */
+int apply_lut(Image image, const int channel, const uint8_t lut[256])
+{
+    return apply_lut_ex(image, channel, lut, NULL);
+}
+
+/*!
+ * Remap a channel through a lookup table, in parallel.
+ */
+int apply_lut_ex(Image image, 
+                 const int channel, 
+                 const uint8_t lut[256], 
+                 Bmp_exec *exec)
+{
+    const Bmp_header *h = &image.bmp_header;
+    uint8_t index_lut[256];
+    Lut_ctx ctx;
+    int i;
+
+    if (channel < 0 || channel > 3)
+    {
+        fprintf(stderr, "apply_lut: invalid channel.\n");
+        return 1;
+    }
+
+    /* indices past the palette are clamped to its last color, so that both
+     * storage modes give the same image */
+    if (channel == A && h->bit_per_pixel <= 8)
+    {
+        int last = palette_levels(h) - 1;
+        for (i = 0; i < 256; ++i)
+            index_lut[i] = lut[i] > last ? last : lut[i];
+        lut = index_lut;
+    }
+
+    if (image.indices)
+    {
+        /* compact images only hold the index channel, the color channels
+         * are zero and they must stay so */
+        if (channel == A)
+            remap_indices(image, lut, exec);
+        else if (lut[0])
+        {
+            fprintf(stderr, "apply_lut: unsupported channel for a compact "
+                            "image.\n");
+            return 1;
+        }
+        return 0;
+    }
+
+    for (i = 0; i < 256; ++i)
+        ctx.lut[i] = lut[i];
+    ctx.channel = channel;
+    for_each_span(image, lut_span, &ctx, exec);
+
+    return 0;
+}
+
+/*
+ * \brief Build the equalization mapping of an histogram.
+ *
+ * The lowest level in the histogram is mapped into zero and the highest 
+ * one into `lo - 1`, levels absent from the histogram are mapped into zero.
+ * @param h Histogram (256 levels).
+ * @param lo Levels in the output image (at most 256).
+ * @param lut Array to store the new value for each level.
+ * @return Zero on success, nonzero if the histogram has less than two 
+ *         levels (and the mapping is the identity).
+ */
+static int cdf_lut(const unsigned long *h, const int lo, uint8_t *lut)
+{
+    const int li = 256; /* levels in the input image */
+    uint64_t cdf[li];   /* cumulative distribution function */
+    uint64_t cdf_min;   /* cdf of the lowest level in the histogram */
+    uint64_t area;
+    int i;
+
+    /* compute cdf */
+    cdf[0] = h[0];
+    for (i = 1; i < li; ++i)
+        cdf[i] = cdf[i - 1] + h[i];
+    area = cdf[li - 1];
+
+    for (i = 0; i < li && !cdf[i]; ++i)
+        ;
+    if (i == li || cdf[i] == area)
+    {
+        for (i = 0; i < li; ++i)
+            lut[i] = i;
+        return 1;
+    }
+    cdf_min = cdf[i];
+
+    for (i = 0; i < li; ++i)
+        lut[i] = cdf[i] < cdf_min ? 0 : 
+                 ((cdf[i] - cdf_min) * (lo - 1) + (area - cdf_min) / 2) 
+                 / (area - cdf_min);
+
+    return 0;
+}
+
+/*!
+ * Apply an histogram equalization algorithm.
+ */
+int equalize(Image image, const int channel)
+{
+    return equalize_ex(image, channel, NULL);
+}
+
+/*!
+ * Apply an histogram equalization algorithm, in parallel.
+ */
+int equalize_ex(Image image, const int channel, Bmp_exec *exec)
+{
+    unsigned long *h; /* histogram for the channel */
+    uint8_t lut[256]; /* output level for each input level */
+    int flat;
+
+    if (channel < 0 || channel > 3)
+    {
+        fprintf(stderr, "equalize: invalid channel.\n");
+        return 1;
+    }
+    
+    /* get histogram */
+    h = histogram(image, channel);
+    if (!h)
+    {
+        fprintf(stderr, "equalize: unable to create histogram.\n");
+        return 1;
+    }
+
+    /* the indices of palette images are spread over the palette */
+    flat = cdf_lut(h, 
+                   channel == A && image.bmp_header.bit_per_pixel <= 8 
+                       ? palette_levels(&image.bmp_header) : 256, 
+                   lut);
+    free(h);
+
+    /* an image with a single level (or no pixels) is left untouched */
+    if (flat)
+        return 0;
+
+    /* equalize */
+    return apply_lut_ex(image, channel, lut, exec);
+}
+
+/* Context for the contrast limited adaptive histogram equalization. */
+typedef struct Clahe_ctx
+{
+    Image image;         /* target image */
+    int channel;         /* channel index */
+    int tiles_x;         /* number of tile columns */
+    int tiles_y;         /* number of tile rows */
+    float clip_limit;    /* clip limit, relative to the average bin count */
+    uint8_t *luts;       /* mapping of each tile (256 entries each) */
+    uint32_t *col_tiles; /* left and right tile for each column (16 bit each) */
+    uint16_t *col_w;     /* weight of the right tile for each column */
+    uint32_t *row_tiles; /* lower and upper tile for each row (16 bit each) */
+    uint16_t *row_w;     /* weight of the upper tile for each row */
+} Clahe_ctx;
+
+/*
+ * \brief Compute the clipped mapping of a range of tiles.
+ *
+ * Bin counts above the clip limit are cut, and the excess is spread evenly
+ * over all the bins before the CDF is taken.
+ */
+static void clahe_tiles(void *ctx, size_t begin, size_t end)
+{
+    Clahe_ctx *c = (Clahe_ctx*) ctx;
+    const Bmp_header *h = &c->image.bmp_header;
+    unsigned long hist[256];
+    size_t t, i, j;
+
+    for (t = begin; t < end; ++t)
+    {
+        size_t tx = t % c->tiles_x;
+        size_t ty = t / c->tiles_x;
+        size_t x0 = tx * h->width / c->tiles_x;
+        size_t x1 = (tx + 1) * h->width / c->tiles_x;
+        size_t y0 = ty * h->height / c->tiles_y;
+        size_t y1 = (ty + 1) * h->height / c->tiles_y;
+        unsigned long area = (x1 - x0) * (y1 - y0);
+        unsigned long excess = 0, clip, step;
+        int v;
+
+        memset(hist, 0, sizeof hist);
+        for (i = y0; i < y1; ++i)
+        {
+            const uint8_t *px = (const uint8_t*) c->image.pixel_data[i] + c->channel;
+            for (j = x0; j < x1; ++j)
+                hist[px[j * sizeof (Pixel)]] += 1;
+        }
+
+        if (c->clip_limit > 0.0f)
+        {
+            clip = (unsigned long) (c->clip_limit * area / 256);
+            if (!clip)
+                clip = 1;
+
+            for (v = 0; v < 256; ++v)
             {
-                for (j = 0; j < h->width; ++j)
+                if (hist[v] > clip)
                 {
-                    image.pixel_data[i][j].b = *(buf++);
-                    image.pixel_data[i][j].g = *(buf++);
-                    image.pixel_data[i][j].r = *(buf++);
+                    excess += hist[v] - clip;
+                    hist[v] = clip;
                 }
-                /* each row has a padding to a 4 byte alignment */
-                buf += pad;
             }
-            break;
 
-        case 32:
-            for (i = 0; i < h->height; ++i)
-            {
-                for (j = 0; j < h->width; ++j)
-                {
-                    uint32_t *px = (uint32_t*) buf;
-                    image.pixel_data[i][j].b = READ_MASK(*px, h->blue_mask);
-                    image.pixel_data[i][j].g = READ_MASK(*px, h->green_mask);
-                    image.pixel_data[i][j].r = READ_MASK(*px, h->red_mask);
-                    image.pixel_data[i][j].i = READ_MASK(*px, h->alpha_mask);
-
-                    /* advance to the next pixel (word) */
-                    buf += 4;;
-                }
-                /* each row has a padding to a 4 byte alignment */
-                buf += pad;
-            }
-            break;
+            /* the remainder of the division goes to equally spaced bins */
+            for (v = 0; v < 256; ++v)
+                hist[v] += excess / 256;
+            excess %= 256;
+            step = excess ? 256 / excess : 0;
+            for (v = 0; excess; v += step, --excess)
+                hist[v] += 1;
+        }
+
+        cdf_lut(hist, 256, c->luts + 256 * t);
+    }
+}
+
+/*
+ * \brief Remap a range of rows, interpolating the mappings of the four 
+ *        nearest tiles.
+ */
+static void clahe_rows(void *ctx, size_t begin, size_t end)
+{
+    Clahe_ctx *c = (Clahe_ctx*) ctx;
+    size_t w = c->image.bmp_header.width;
+    size_t i, j;
+
+    for (i = begin; i < end; ++i)
+    {
+        uint8_t *px = (uint8_t*) c->image.pixel_data[i] + c->channel;
+        const uint8_t *lo = c->luts + 256 * c->tiles_x * (c->row_tiles[i] & 0xFFFF);
+        const uint8_t *hi = c->luts + 256 * c->tiles_x * (c->row_tiles[i] >> 16);
+        uint32_t wy = c->row_w[i];
+
+        for (j = 0; j < w; ++j)
+        {
+            size_t l = 256 * (c->col_tiles[j] & 0xFFFF);
+            size_t r = 256 * (c->col_tiles[j] >> 16);
+            uint32_t wx = c->col_w[j];
+            uint8_t v = px[j * sizeof (Pixel)];
+            uint32_t bottom = lo[l + v] * (256 - wx) + lo[r + v] * wx;
+            uint32_t top = hi[l + v] * (256 - wx) + hi[r + v] * wx;
+
+            px[j * sizeof (Pixel)] = (bottom * (256 - wy) + top * wy + 32768) >> 16;
+        }
+    }
+}
+
+/*
+ * \brief Find, for each position along an axis, the two nearest tile 
+ *        centers and the weight (8 bit fixed point) of the second one.
+ * @param size Number of pixels along the axis.
+ * @param tiles Number of tiles along the axis.
+ * @param pair Array to store the two tile indices (low and high 16 bits).
+ * @param weight Array to store the weights.
+ */
+static void clahe_axis(size_t size, int tiles, uint32_t *pair, uint16_t *weight)
+{
+    size_t k;
+
+    for (k = 0; k < size; ++k)
+    {
+        /* position in tile units, with tile centers at integer values */
+        float f = (k + 0.5f) * tiles / size - 0.5f;
+        int t0 = f < 0.0f ? 0 : (int) f;
+        int t1 = t0 + 1 < tiles ? t0 + 1 : t0;
+        float wt = f - t0;
+
+        if (wt < 0.0f || t1 == t0)
+            wt = 0.0f;
+        pair[k] = t0 | (uint32_t) t1 << 16;
+        weight[k] = (uint16_t) (wt * 256.0f + 0.5f);
+    }
+}
+
+/*!
+ * Apply a contrast limited adaptive histogram equalization.
+ */
+int clahe(Image image, 
+          const int channel, 
+          int tiles_x, 
+          int tiles_y, 
+          float clip_limit)
+{
+    return clahe_ex(image, channel, tiles_x, tiles_y, clip_limit, NULL);
+}
+
+/*!
+ * Apply a contrast limited adaptive histogram equalization, in parallel.
+ */
+int clahe_ex(Image image, 
+             const int channel, 
+             int tiles_x, 
+             int tiles_y, 
+             float clip_limit,
+             Bmp_exec *exec)
+{
+    const Bmp_header *h = &image.bmp_header;
+    Clahe_ctx ctx;
+    uint32_t *block;
+
+    if (channel < 0 || channel > 3)
+    {
+        fprintf(stderr, "clahe: invalid channel.\n");
+        return 1;
+    }
+
+    if (tiles_x < 1 || tiles_y < 1 || tiles_x > 0xFFFF || tiles_y > 0xFFFF
+            || (uint32_t) tiles_x > h->width || (uint32_t) tiles_y > h->height)
+    {
+        fprintf(stderr, "clahe: invalid number of tiles.\n");
+        return 1;
+    }
+
+    if (image.indices)
+    {
+        fprintf(stderr, "clahe: compact images are not supported.\n");
+        return 1;
+    }
+
+    ctx.image = image;
+    ctx.channel = channel;
+    ctx.tiles_x = tiles_x;
+    ctx.tiles_y = tiles_y;
+    ctx.clip_limit = clip_limit;
+    /* a single block for the tables: tile pairs, then weights, then the
+     * mappings of the tiles */
+    block = (uint32_t*) malloc(((size_t) h->width + h->height) 
+                               * (sizeof (uint32_t) + sizeof (uint16_t))
+                               + (size_t) tiles_x * tiles_y * 256);
+    if (!block)
+    {
+        fprintf(stderr, "clahe: memory error.\n");
+        return 1;
+    }
+    ctx.col_tiles = block;
+    ctx.row_tiles = ctx.col_tiles + h->width;
+    ctx.col_w = (uint16_t*) (ctx.row_tiles + h->height);
+    ctx.row_w = ctx.col_w + h->width;
+    ctx.luts = (uint8_t*) (ctx.row_w + h->height);
+
+    /* mapping of each tile, then interpolation over the pixels */
+    bmp_parallel_for_rows(exec, (size_t) tiles_x * tiles_y, 1, clahe_tiles, &ctx);
+    clahe_axis(h->width, tiles_x, ctx.col_tiles, ctx.col_w);
+    clahe_axis(h->height, tiles_y, ctx.row_tiles, ctx.row_w);
+    bmp_parallel_for_rows(exec, h->height, 0, clahe_rows, &ctx);
+
+    free(block);
+    return 0;
+}
+
+/* Fixed point (14 fractional bits) coefficients of the color conversions. */
+#define YCC_SHIFT 14
+#define YCC_HALF  (1 << (YCC_SHIFT - 1))
+#define YCC_ONE   16384 /* 1.0 */
+#define YCC_Y_R   4899  /* 0.299 */
+#define YCC_Y_G   9617  /* 0.587 */
+#define YCC_Y_B   1868  /* 0.114 */
+#define YCC_CB    9241  /* 0.564 */
+#define YCC_CR    11682 /* 0.713 */
+#define YCC_R_CR  22970 /* 1.402 */
+#define YCC_G_CB  5638  /* 0.34414 */
+#define YCC_G_CR  11701 /* 0.71414 */
+#define YCC_B_CB  29032 /* 1.772 */
+
+/*
+ * \brief Clamp a value into the range 0-255.
+ */
+static inline uint8_t clamp_u8(int v)
+{
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+/*
+ * \brief Convert a run of pixels from RGB to Y'CbCr, in fixed point.
+ */
+static void rgb2ycbcr_scalar(Pixel *px, size_t n)
+{
+    size_t k;
+
+    for (k = 0; k < n; ++k)
+    {
+        Pixel p = px[k];
+        int y = (YCC_Y_R * p.r + YCC_Y_G * p.g + YCC_Y_B * p.b + YCC_HALF) 
+                >> YCC_SHIFT;
+
+        px[k].b = y;
+        px[k].g = clamp_u8(128 + ((YCC_CB * (p.b - y) + YCC_HALF) >> YCC_SHIFT));
+        px[k].r = clamp_u8(128 + ((YCC_CR * (p.r - y) + YCC_HALF) >> YCC_SHIFT));
+    }
+}
+
+/*
+ * \brief Convert a run of pixels from Y'CbCr to RGB, in fixed point.
+ */
+static void ycbcr2rgb_scalar(Pixel *px, size_t n)
+{
+    size_t k;
+
+    for (k = 0; k < n; ++k)
+    {
+        Pixel p = px[k];
+        int y = p.b * YCC_ONE + YCC_HALF;
+        int cb = p.g - 128;
+        int cr = p.r - 128;
+
+        px[k].r = clamp_u8((y + YCC_R_CR * cr) >> YCC_SHIFT);
+        px[k].g = clamp_u8((y - YCC_G_CB * cb - YCC_G_CR * cr) >> YCC_SHIFT);
+        px[k].b = clamp_u8((y + YCC_B_CB * cb) >> YCC_SHIFT);
+    }
+}
+
+#ifdef X86_SIMD
+/*
+ * Y'CbCr conversion of 4 pixels, one for each 32 bit lane, with channel 
+ * values (0-255) in the low byte of each lane. Pairs of 16 bit operands 
+ * are multiplied by pairs of coefficients and summed with a single 
+ * multiply-add, with the rounding term folded into the second pair. The
+ * results are not clamped, but they fit the 16 bit range.
+ */
+__attribute__((target("sse2")))
+static inline void ycc_fwd_sse2(__m128i r, __m128i g, __m128i b, 
+                                __m128i *y, __m128i *cb, __m128i *cr)
+{
+    const __m128i mask = _mm_set1_epi32(0xFFFF);
+    const __m128i one_hi = _mm_set1_epi32(0x10000);
+    const __m128i bias = _mm_set1_epi32(128);
+    /* (r, g), (b, 1), (b - y, 1) and (r - y, 1) pairs */
+    __m128i rg = _mm_or_si128(r, _mm_slli_epi32(g, 16));
+    __m128i b1 = _mm_or_si128(b, one_hi);
+    __m128i db, dr;
+
+    *y = _mm_srai_epi32(_mm_add_epi32(
+                _mm_madd_epi16(rg, _mm_set1_epi32(YCC_Y_R | YCC_Y_G << 16)), 
+                _mm_madd_epi16(b1, _mm_set1_epi32(YCC_Y_B | YCC_HALF << 16))), 
+            YCC_SHIFT);
+    db = _mm_or_si128(_mm_and_si128(_mm_sub_epi32(b, *y), mask), one_hi);
+    dr = _mm_or_si128(_mm_and_si128(_mm_sub_epi32(r, *y), mask), one_hi);
+    *cb = _mm_add_epi32(_mm_srai_epi32(
+                _mm_madd_epi16(db, _mm_set1_epi32(YCC_CB | YCC_HALF << 16)), 
+                YCC_SHIFT), 
+            bias);
+    *cr = _mm_add_epi32(_mm_srai_epi32(
+                _mm_madd_epi16(dr, _mm_set1_epi32(YCC_CR | YCC_HALF << 16)), 
+                YCC_SHIFT), 
+            bias);
+}
+
+/*
+ * RGB conversion of 4 pixels (same layout and scheme of the forward 
+ * conversion).
+ */
+__attribute__((target("sse2")))
+static inline void ycc_inv_sse2(__m128i y, __m128i cb, __m128i cr, 
+                                __m128i *r, __m128i *g, __m128i *b)
+{
+    const __m128i bias = _mm_set1_epi32(128);
+    const __m128i half = _mm_set1_epi32(YCC_HALF);
+    /* (y, cb), (y, cr) and (cr, 1) pairs */
+    __m128i ycb, ycr, cr1;
+
+    cb = _mm_sub_epi32(cb, bias);
+    cr = _mm_sub_epi32(cr, bias);
+    ycb = _mm_or_si128(y, _mm_slli_epi32(cb, 16));
+    ycr = _mm_or_si128(y, _mm_slli_epi32(cr, 16));
+    cr1 = _mm_or_si128(_mm_and_si128(cr, _mm_set1_epi32(0xFFFF)), 
+                       _mm_set1_epi32(0x10000));
+
+    *r = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(
+                    ycr, _mm_set1_epi32(YCC_ONE | YCC_R_CR << 16)), half), 
+            YCC_SHIFT);
+    *g = _mm_srai_epi32(_mm_add_epi32(
+                _mm_madd_epi16(ycb, _mm_set1_epi32(
+                        YCC_ONE | (uint32_t) -YCC_G_CB << 16)), 
+                _mm_madd_epi16(cr1, _mm_set1_epi32(
+                        (-YCC_G_CR & 0xFFFF) | YCC_HALF << 16))), 
+            YCC_SHIFT);
+    *b = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(
+                    ycb, _mm_set1_epi32(YCC_ONE | YCC_B_CB << 16)), half), 
+            YCC_SHIFT);
+}
+
+/*
+ * Y'CbCr conversion of 8 pixels (same scheme as the SSE2 version).
+ */
+__attribute__((target("avx2")))
+static inline void ycc_fwd_avx2(__m256i r, __m256i g, __m256i b, 
+                                __m256i *y, __m256i *cb, __m256i *cr)
+{
+    const __m256i mask = _mm256_set1_epi32(0xFFFF);
+    const __m256i one_hi = _mm256_set1_epi32(0x10000);
+    const __m256i bias = _mm256_set1_epi32(128);
+    __m256i rg = _mm256_or_si256(r, _mm256_slli_epi32(g, 16));
+    __m256i b1 = _mm256_or_si256(b, one_hi);
+    __m256i db, dr;
+
+    *y = _mm256_srai_epi32(_mm256_add_epi32(
+                _mm256_madd_epi16(rg, _mm256_set1_epi32(YCC_Y_R | YCC_Y_G << 16)), 
+                _mm256_madd_epi16(b1, _mm256_set1_epi32(YCC_Y_B | YCC_HALF << 16))), 
+            YCC_SHIFT);
+    db = _mm256_or_si256(_mm256_and_si256(_mm256_sub_epi32(b, *y), mask), one_hi);
+    dr = _mm256_or_si256(_mm256_and_si256(_mm256_sub_epi32(r, *y), mask), one_hi);
+    *cb = _mm256_add_epi32(_mm256_srai_epi32(_mm256_madd_epi16(
+                    db, _mm256_set1_epi32(YCC_CB | YCC_HALF << 16)), YCC_SHIFT), 
+            bias);
+    *cr = _mm256_add_epi32(_mm256_srai_epi32(_mm256_madd_epi16(
+                    dr, _mm256_set1_epi32(YCC_CR | YCC_HALF << 16)), YCC_SHIFT), 
+            bias);
+}
+
+/*
+ * RGB conversion of 8 pixels (same scheme as the SSE2 version).
+ */
+__attribute__((target("avx2")))
+static inline void ycc_inv_avx2(__m256i y, __m256i cb, __m256i cr, 
+                                __m256i *r, __m256i *g, __m256i *b)
+{
+    const __m256i bias = _mm256_set1_epi32(128);
+    const __m256i half = _mm256_set1_epi32(YCC_HALF);
+    __m256i ycb, ycr, cr1;
+
+    cb = _mm256_sub_epi32(cb, bias);
+    cr = _mm256_sub_epi32(cr, bias);
+    ycb = _mm256_or_si256(y, _mm256_slli_epi32(cb, 16));
+    ycr = _mm256_or_si256(y, _mm256_slli_epi32(cr, 16));
+    cr1 = _mm256_or_si256(_mm256_and_si256(cr, _mm256_set1_epi32(0xFFFF)), 
+                          _mm256_set1_epi32(0x10000));
+
+    *r = _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(
+                    ycr, _mm256_set1_epi32(YCC_ONE | YCC_R_CR << 16)), half), 
+            YCC_SHIFT);
+    *g = _mm256_srai_epi32(_mm256_add_epi32(
+                _mm256_madd_epi16(ycb, _mm256_set1_epi32(
+                        YCC_ONE | (uint32_t) -YCC_G_CB << 16)), 
+                _mm256_madd_epi16(cr1, _mm256_set1_epi32(
+                        (-YCC_G_CR & 0xFFFF) | YCC_HALF << 16))), 
+            YCC_SHIFT);
+    *b = _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(
+                    ycb, _mm256_set1_epi32(YCC_ONE | YCC_B_CB << 16)), half), 
+            YCC_SHIFT);
+}
+
+/*
+ * Convert pixels from RGB to Y'CbCr, 4 pixels at a time. Channels are
+ * extracted from each pixel lane, and the results (clamped with 16 bit 
+ * min/max, since they fit the 16 bit range) are shifted back into place.
+ */
+__attribute__((target("sse2")))
+static void rgb2ycbcr_sse2(Pixel *px, size_t n)
+{
+    const __m128i low = _mm_set1_epi32(0xFF);
+    const __m128i max = _mm_set1_epi32(255);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i keep = _mm_set1_epi32(0xFF000000);
+    size_t j;
+
+    for (j = 0; j + 4 <= n; j += 4)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*) (px + j));
+        __m128i y, cb, cr;
+
+        ycc_fwd_sse2(_mm_and_si128(_mm_srli_epi32(v, 16), low),
+                     _mm_and_si128(_mm_srli_epi32(v, 8), low),
+                     _mm_and_si128(v, low),
+                     &y, &cb, &cr);
+        cb = _mm_min_epi16(_mm_max_epi16(cb, zero), max);
+        cr = _mm_min_epi16(_mm_max_epi16(cr, zero), max);
+        v = _mm_or_si128(_mm_and_si128(v, keep), y);
+        v = _mm_or_si128(v, _mm_slli_epi32(cb, 8));
+        v = _mm_or_si128(v, _mm_slli_epi32(cr, 16));
+        _mm_storeu_si128((__m128i*) (px + j), v);
+    }
+
+    rgb2ycbcr_scalar(px + j, n - j);
+}
+
+/*
+ * Convert pixels from Y'CbCr to RGB, 4 pixels at a time.
+ */
+__attribute__((target("sse2")))
+static void ycbcr2rgb_sse2(Pixel *px, size_t n)
+{
+    const __m128i low = _mm_set1_epi32(0xFF);
+    const __m128i max = _mm_set1_epi32(255);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i keep = _mm_set1_epi32(0xFF000000);
+    size_t j;
+
+    for (j = 0; j + 4 <= n; j += 4)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*) (px + j));
+        __m128i r, g, b;
+
+        ycc_inv_sse2(_mm_and_si128(v, low),
+                     _mm_and_si128(_mm_srli_epi32(v, 8), low),
+                     _mm_and_si128(_mm_srli_epi32(v, 16), low),
+                     &r, &g, &b);
+        r = _mm_min_epi16(_mm_max_epi16(r, zero), max);
+        g = _mm_min_epi16(_mm_max_epi16(g, zero), max);
+        b = _mm_min_epi16(_mm_max_epi16(b, zero), max);
+        v = _mm_or_si128(_mm_and_si128(v, keep), b);
+        v = _mm_or_si128(v, _mm_slli_epi32(g, 8));
+        v = _mm_or_si128(v, _mm_slli_epi32(r, 16));
+        _mm_storeu_si128((__m128i*) (px + j), v);
+    }
+
+    ycbcr2rgb_scalar(px + j, n - j);
+}
+
+/*
+ * Convert pixels from RGB to Y'CbCr, 8 pixels at a time.
+ */
+__attribute__((target("avx2")))
+static void rgb2ycbcr_avx2(Pixel *px, size_t n)
+{
+    const __m256i low = _mm256_set1_epi32(0xFF);
+    const __m256i max = _mm256_set1_epi32(255);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i keep = _mm256_set1_epi32(0xFF000000);
+    size_t j;
+
+    for (j = 0; j + 8 <= n; j += 8)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (px + j));
+        __m256i y, cb, cr;
+
+        ycc_fwd_avx2(_mm256_and_si256(_mm256_srli_epi32(v, 16), low),
+                     _mm256_and_si256(_mm256_srli_epi32(v, 8), low),
+                     _mm256_and_si256(v, low),
+                     &y, &cb, &cr);
+        cb = _mm256_min_epi16(_mm256_max_epi16(cb, zero), max);
+        cr = _mm256_min_epi16(_mm256_max_epi16(cr, zero), max);
+        v = _mm256_or_si256(_mm256_and_si256(v, keep), y);
+        v = _mm256_or_si256(v, _mm256_slli_epi32(cb, 8));
+        v = _mm256_or_si256(v, _mm256_slli_epi32(cr, 16));
+        _mm256_storeu_si256((__m256i*) (px + j), v);
+    }
+
+    rgb2ycbcr_sse2(px + j, n - j);
+}
+
+/*
+ * Convert pixels from Y'CbCr to RGB, 8 pixels at a time.
+ */
+__attribute__((target("avx2")))
+static void ycbcr2rgb_avx2(Pixel *px, size_t n)
+{
+    const __m256i low = _mm256_set1_epi32(0xFF);
+    const __m256i max = _mm256_set1_epi32(255);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i keep = _mm256_set1_epi32(0xFF000000);
+    size_t j;
+
+    for (j = 0; j + 8 <= n; j += 8)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (px + j));
+        __m256i r, g, b;
+
+        ycc_inv_avx2(_mm256_and_si256(v, low),
+                     _mm256_and_si256(_mm256_srli_epi32(v, 8), low),
+                     _mm256_and_si256(_mm256_srli_epi32(v, 16), low),
+                     &r, &g, &b);
+        r = _mm256_min_epi16(_mm256_max_epi16(r, zero), max);
+        g = _mm256_min_epi16(_mm256_max_epi16(g, zero), max);
+        b = _mm256_min_epi16(_mm256_max_epi16(b, zero), max);
+        v = _mm256_or_si256(_mm256_and_si256(v, keep), b);
+        v = _mm256_or_si256(v, _mm256_slli_epi32(g, 8));
+        v = _mm256_or_si256(v, _mm256_slli_epi32(r, 16));
+        _mm256_storeu_si256((__m256i*) (px + j), v);
+    }
+
+    ycbcr2rgb_sse2(px + j, n - j);
+}
+#endif
+
+/*
+ * Convert a run of pixels from RGB to Y'CbCr.
+ */
+static void rgb2ycbcr_span(Pixel *px, size_t n, void *ctx)
+{
+    (void) ctx;
+
+#ifdef X86_SIMD
+    switch (bmp_simd_level())
+    {
+        case BMP_SIMD_AVX2:
+            rgb2ycbcr_avx2(px, n);
+            return;
+        case BMP_SIMD_SSSE3:
+            rgb2ycbcr_sse2(px, n);
+            return;
+    }
+#endif
+    rgb2ycbcr_scalar(px, n);
+}
+
+/*
+ * \brief Replace the color of a run of pixels with its luma, in fixed point.
+ */
+static void rgb2luma_scalar(Pixel *px, size_t n)
+{
+    size_t k;
+
+    for (k = 0; k < n; ++k)
+    {
+        Pixel p = px[k];
+
+        px[k].b = px[k].g = px[k].r = 
+            (YCC_Y_R * p.r + YCC_Y_G * p.g + YCC_Y_B * p.b + YCC_HALF) 
+            >> YCC_SHIFT;
+    }
+}
+
+#ifdef X86_SIMD
+/*
+ * Replace the color of pixels with their luma, 4 pixels at a time (same 
+ * scheme as the Y'CbCr conversion). The luma is spread over the three 
+ * color channels with a multiplication.
+ */
+__attribute__((target("sse2")))
+static void rgb2luma_sse2(Pixel *px, size_t n)
+{
+    const __m128i low = _mm_set1_epi32(0xFF);
+    const __m128i c_rg = _mm_set1_epi32(YCC_Y_R | YCC_Y_G << 16);
+    const __m128i c_b = _mm_set1_epi32(YCC_Y_B | YCC_HALF << 16);
+    const __m128i spread = _mm_set1_epi32(0x010101);
+    const __m128i keep = _mm_set1_epi32(0xFF000000);
+    size_t j;
+
+    for (j = 0; j + 4 <= n; j += 4)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*) (px + j));
+        __m128i rg = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 16), low), 
+                                  _mm_and_si128(_mm_slli_epi32(v, 8), 
+                                                _mm_set1_epi32(0xFF0000)));
+        __m128i b1 = _mm_or_si128(_mm_and_si128(v, low), _mm_set1_epi32(0x10000));
+        __m128i y = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(rg, c_rg), 
+                                                 _mm_madd_epi16(b1, c_b)), 
+                                   YCC_SHIFT);
+
+        /* y < 256, so the 16 bit product y * 0x0101 fits, and the low 
+         * halves of y and 0x010101 give the third copy */
+        y = _mm_or_si128(_mm_mullo_epi16(y, spread), _mm_slli_epi32(y, 16));
+        _mm_storeu_si128((__m128i*) (px + j), 
+                         _mm_or_si128(_mm_and_si128(v, keep), y));
+    }
+
+    rgb2luma_scalar(px + j, n - j);
+}
+
+/*
+ * Replace the color of pixels with their luma, 8 pixels at a time.
+ */
+__attribute__((target("avx2")))
+static void rgb2luma_avx2(Pixel *px, size_t n)
+{
+    const __m256i low = _mm256_set1_epi32(0xFF);
+    const __m256i c_rg = _mm256_set1_epi32(YCC_Y_R | YCC_Y_G << 16);
+    const __m256i c_b = _mm256_set1_epi32(YCC_Y_B | YCC_HALF << 16);
+    const __m256i spread = _mm256_set1_epi32(0x010101);
+    const __m256i keep = _mm256_set1_epi32(0xFF000000);
+    size_t j;
+
+    for (j = 0; j + 8 <= n; j += 8)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (px + j));
+        __m256i rg = _mm256_or_si256(
+                _mm256_and_si256(_mm256_srli_epi32(v, 16), low), 
+                _mm256_and_si256(_mm256_slli_epi32(v, 8), 
+                                 _mm256_set1_epi32(0xFF0000)));
+        __m256i b1 = _mm256_or_si256(_mm256_and_si256(v, low), 
+                                     _mm256_set1_epi32(0x10000));
+        __m256i y = _mm256_srai_epi32(_mm256_add_epi32(
+                    _mm256_madd_epi16(rg, c_rg), _mm256_madd_epi16(b1, c_b)), 
+                YCC_SHIFT);
+
+        y = _mm256_or_si256(_mm256_mullo_epi16(y, spread), 
+                            _mm256_slli_epi32(y, 16));
+        _mm256_storeu_si256((__m256i*) (px + j), 
+                            _mm256_or_si256(_mm256_and_si256(v, keep), y));
+    }
+
+    rgb2luma_sse2(px + j, n - j);
+}
+#endif
+
+/*
+ * Replace the color of a run of pixels with its luma.
+ */
+static void rgb2luma_span(Pixel *px, size_t n, void *ctx)
+{
+    (void) ctx;
+
+#ifdef X86_SIMD
+    switch (bmp_simd_level())
+    {
+        case BMP_SIMD_AVX2:
+            rgb2luma_avx2(px, n);
+            return;
+        case BMP_SIMD_SSSE3:
+            rgb2luma_sse2(px, n);
+            return;
+    }
+#endif
+    rgb2luma_scalar(px, n);
+}
+
+/*!
+ * Convert the RGB color space into Y'CbCr (with Y, Cb and Cr in the range
+ * 0-255), applying the following transformation:
+ * \f[
+ *   Y   = 0.299 \cdot R + 0.587 \cdot G + 0.114 * B \\
+ *   C_b = 128 + 0.564 \cdot (B - Y) \\
+ *   C_r = 128 + 0.713 \cdot (R - Y)
+ * \f]
+ * The results are computed in fixed point, rounded and saturated.
+ */
+int rgb2ycbcr(Image image)
+{
+    return rgb2ycbcr_ex(image, NULL);
+}
+
+/*!
+ * Convert the color space of an image, in parallel.
+ */
+int rgb2ycbcr_ex(Image image, Bmp_exec *exec)
+{
+    if (image.indices)
+    {
+        fprintf(stderr, "rgb2ycbcr: not supported in compact storage.\n");
+        return 1;
+    }
+
+    for_each_span(image, rgb2ycbcr_span, NULL, exec);
+    return 0;
+}
+
+/*
+ * Convert a run of pixels from Y'CbCr to RGB.
+ */
+static void ycbcr2rgb_span(Pixel *px, size_t n, void *ctx)
+{
+    (void) ctx;
+
+#ifdef X86_SIMD
+    switch (bmp_simd_level())
+    {
+        case BMP_SIMD_AVX2:
+            ycbcr2rgb_avx2(px, n);
+            return;
+        case BMP_SIMD_SSSE3:
+            ycbcr2rgb_sse2(px, n);
+            return;
+    }
+#endif
+    ycbcr2rgb_scalar(px, n);
+}
+
+/*!
+ * Convert the Y'CbCr color space into RGB, applying the following
+ * transformation:
+ * \f[
+ *   R = Y + 1.402 \cdot (C_r - 128) \\
+ *   G = Y - 0.71414 \cdot (C_r - 128) - 0.34414 \cdot (C_b - 128) \\
+ *   B = Y + 1.772 \cdot (C_b - 128)
+ * \f]
+ * The results are computed in fixed point, rounded and saturated.
+ */
+int ycbcr2rgb(Image image)
+{
+    return ycbcr2rgb_ex(image, NULL);
+}
+
+/*!
+ * Convert the color space of an image, in parallel.
+ */
+int ycbcr2rgb_ex(Image image, Bmp_exec *exec)
+{
+    if (image.indices)
+    {
+        fprintf(stderr, "ycbcr2rgb: not supported in compact storage.\n");
+        return 1;
+    }
+
+    for_each_span(image, ycbcr2rgb_span, NULL, exec);
+    return 0;
+}
+
+/*
+ * \brief Allocate the zeroed planes of a planar image.
+ * @param p Planar image, with width and height set in its header.
+ * @return Zero on success, nonzero otherwise.
+ */
+static int alloc_planes(Planar_image *p)
+{
+    const Bmp_header *h = &p->bmp_header;
+    size_t stride = (h->width + PIXEL_ALIGNMENT - 1) & ~(size_t) (PIXEL_ALIGNMENT - 1);
+    size_t size = stride * h->height;
+    void *block;
+    int c;
+
+    /* one block, holding the four planes one after the other (each row of
+     * each plane is aligned, since the stride is a multiple of the 
+     * alignment) */
+    if (posix_memalign(&block, PIXEL_ALIGNMENT, size ? 4 * size : PIXEL_ALIGNMENT))
+        return 1;
+    memset(block, 0, 4 * size);
+
+    for (c = 0; c < 4; ++c)
+        p->planes[c] = (uint8_t*) block + c * size;
+    p->stride = stride;
+
+    return 0;
+}
+
+/*
+ * \brief Split a run of pixels into channel planes.
+ */
+static void pixel_to_planes_scalar(const Pixel *src, 
+                                   uint8_t *b, uint8_t *g, uint8_t *r, uint8_t *a,
+                                   size_t n)
+{
+    size_t j;
+
+    for (j = 0; j < n; ++j)
+    {
+        b[j] = src[j].b;
+        g[j] = src[j].g;
+        r[j] = src[j].r;
+        a[j] = src[j].i;
+    }
+}
+
+/*
+ * \brief Merge channel planes into a run of pixels.
+ */
+static void planes_to_pixel_scalar(const uint8_t *b, 
+                                   const uint8_t *g, 
+                                   const uint8_t *r, 
+                                   const uint8_t *a,
+                                   Pixel *dst, 
+                                   size_t n)
+{
+    size_t j;
+
+    for (j = 0; j < n; ++j)
+    {
+        dst[j].b = b[j];
+        dst[j].g = g[j];
+        dst[j].r = r[j];
+        dst[j].i = a[j];
+    }
+}
+
+#ifdef X86_SIMD
+/*
+ * Split pixels into planes, 16 pixels at a time. A shuffle groups the
+ * channels of each vector of 4 pixels into 32 bit words, then the 4x4 
+ * matrix of words is transposed with unpacks.
+ */
+__attribute__((target("ssse3")))
+static void pixel_to_planes_ssse3(const Pixel *src, 
+                                  uint8_t *b, uint8_t *g, uint8_t *r, uint8_t *a,
+                                  size_t n)
+{
+    const __m128i shuf = _mm_set_epi8(15, 11, 7, 3, 14, 10, 6, 2, 
+                                      13, 9, 5, 1, 12, 8, 4, 0);
+    size_t j;
+
+    for (j = 0; j + 16 <= n; j += 16)
+    {
+        __m128i v0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (src + j)), shuf);
+        __m128i v1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (src + j + 4)), shuf);
+        __m128i v2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (src + j + 8)), shuf);
+        __m128i v3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (src + j + 12)), shuf);
+        __m128i bg01 = _mm_unpacklo_epi32(v0, v1);
+        __m128i ra01 = _mm_unpackhi_epi32(v0, v1);
+        __m128i bg23 = _mm_unpacklo_epi32(v2, v3);
+        __m128i ra23 = _mm_unpackhi_epi32(v2, v3);
+
+        _mm_storeu_si128((__m128i*) (b + j), _mm_unpacklo_epi64(bg01, bg23));
+        _mm_storeu_si128((__m128i*) (g + j), _mm_unpackhi_epi64(bg01, bg23));
+        _mm_storeu_si128((__m128i*) (r + j), _mm_unpacklo_epi64(ra01, ra23));
+        _mm_storeu_si128((__m128i*) (a + j), _mm_unpackhi_epi64(ra01, ra23));
+    }
+
+    pixel_to_planes_scalar(src + j, b + j, g + j, r + j, a + j, n - j);
+}
+
+/*
+ * Split pixels into planes, 32 pixels at a time. Each vector of 8 pixels
+ * is shuffled and permuted into 64 bit words holding 8 values of a 
+ * channel, then the 4x4 matrix of words is transposed with unpacks and 
+ * cross lane permutations.
+ */
+__attribute__((target("avx2")))
+static void pixel_to_planes_avx2(const Pixel *src, 
+                                 uint8_t *b, uint8_t *g, uint8_t *r, uint8_t *a,
+                                 size_t n)
+{
+    const __m256i shuf = _mm256_set_epi8(15, 11, 7, 3, 14, 10, 6, 2, 
+                                         13, 9, 5, 1, 12, 8, 4, 0,
+                                         15, 11, 7, 3, 14, 10, 6, 2, 
+                                         13, 9, 5, 1, 12, 8, 4, 0);
+    const __m256i perm = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    size_t j, k;
+
+    for (j = 0; j + 32 <= n; j += 32)
+    {
+        __m256i v[4], lo01, hi01, lo23, hi23;
+
+        for (k = 0; k < 4; ++k)
+            v[k] = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(
+                        _mm256_loadu_si256((const __m256i*) (src + j + 8 * k)), 
+                        shuf), 
+                    perm);
+
+        lo01 = _mm256_unpacklo_epi64(v[0], v[1]);
+        hi01 = _mm256_unpackhi_epi64(v[0], v[1]);
+        lo23 = _mm256_unpacklo_epi64(v[2], v[3]);
+        hi23 = _mm256_unpackhi_epi64(v[2], v[3]);
+
+        _mm256_storeu_si256((__m256i*) (b + j), _mm256_permute2x128_si256(lo01, lo23, 0x20));
+        _mm256_storeu_si256((__m256i*) (g + j), _mm256_permute2x128_si256(hi01, hi23, 0x20));
+        _mm256_storeu_si256((__m256i*) (r + j), _mm256_permute2x128_si256(lo01, lo23, 0x31));
+        _mm256_storeu_si256((__m256i*) (a + j), _mm256_permute2x128_si256(hi01, hi23, 0x31));
+    }
+
+    pixel_to_planes_ssse3(src + j, b + j, g + j, r + j, a + j, n - j);
+}
+
+/*
+ * Merge planes into pixels, 16 pixels at a time, interleaving bytes and 
+ * then pairs of bytes.
+ */
+__attribute__((target("sse2")))
+static void planes_to_pixel_sse2(const uint8_t *b, 
+                                 const uint8_t *g, 
+                                 const uint8_t *r, 
+                                 const uint8_t *a,
+                                 Pixel *dst, 
+                                 size_t n)
+{
+    size_t j;
+
+    for (j = 0; j + 16 <= n; j += 16)
+    {
+        __m128i vb = _mm_loadu_si128((const __m128i*) (b + j));
+        __m128i vg = _mm_loadu_si128((const __m128i*) (g + j));
+        __m128i vr = _mm_loadu_si128((const __m128i*) (r + j));
+        __m128i va = _mm_loadu_si128((const __m128i*) (a + j));
+        __m128i bg_lo = _mm_unpacklo_epi8(vb, vg);
+        __m128i bg_hi = _mm_unpackhi_epi8(vb, vg);
+        __m128i ra_lo = _mm_unpacklo_epi8(vr, va);
+        __m128i ra_hi = _mm_unpackhi_epi8(vr, va);
+
+        _mm_storeu_si128((__m128i*) (dst + j), _mm_unpacklo_epi16(bg_lo, ra_lo));
+        _mm_storeu_si128((__m128i*) (dst + j + 4), _mm_unpackhi_epi16(bg_lo, ra_lo));
+        _mm_storeu_si128((__m128i*) (dst + j + 8), _mm_unpacklo_epi16(bg_hi, ra_hi));
+        _mm_storeu_si128((__m128i*) (dst + j + 12), _mm_unpackhi_epi16(bg_hi, ra_hi));
+    }
+
+    planes_to_pixel_scalar(b + j, g + j, r + j, a + j, dst + j, n - j);
+}
+
+/*
+ * Merge planes into pixels, 32 pixels at a time. The unpacks work inside
+ * each 128 bit lane, so the lower lanes hold pixels 0-15 and the upper 
+ * ones pixels 16-31, and they are put in order by cross lane permutations.
+ */
+__attribute__((target("avx2")))
+static void planes_to_pixel_avx2(const uint8_t *b, 
+                                 const uint8_t *g, 
+                                 const uint8_t *r, 
+                                 const uint8_t *a,
+                                 Pixel *dst, 
+                                 size_t n)
+{
+    size_t j;
+
+    for (j = 0; j + 32 <= n; j += 32)
+    {
+        __m256i vb = _mm256_loadu_si256((const __m256i*) (b + j));
+        __m256i vg = _mm256_loadu_si256((const __m256i*) (g + j));
+        __m256i vr = _mm256_loadu_si256((const __m256i*) (r + j));
+        __m256i va = _mm256_loadu_si256((const __m256i*) (a + j));
+        __m256i bg_lo = _mm256_unpacklo_epi8(vb, vg);
+        __m256i bg_hi = _mm256_unpackhi_epi8(vb, vg);
+        __m256i ra_lo = _mm256_unpacklo_epi8(vr, va);
+        __m256i ra_hi = _mm256_unpackhi_epi8(vr, va);
+        __m256i p0 = _mm256_unpacklo_epi16(bg_lo, ra_lo);
+        __m256i p1 = _mm256_unpackhi_epi16(bg_lo, ra_lo);
+        __m256i p2 = _mm256_unpacklo_epi16(bg_hi, ra_hi);
+        __m256i p3 = _mm256_unpackhi_epi16(bg_hi, ra_hi);
+
+        _mm256_storeu_si256((__m256i*) (dst + j), _mm256_permute2x128_si256(p0, p1, 0x20));
+        _mm256_storeu_si256((__m256i*) (dst + j + 8), _mm256_permute2x128_si256(p2, p3, 0x20));
+        _mm256_storeu_si256((__m256i*) (dst + j + 16), _mm256_permute2x128_si256(p0, p1, 0x31));
+        _mm256_storeu_si256((__m256i*) (dst + j + 24), _mm256_permute2x128_si256(p2, p3, 0x31));
+    }
+
+    planes_to_pixel_sse2(b + j, g + j, r + j, a + j, dst + j, n - j);
+}
+
+/*
+ * Widen 16 bytes into four vectors of 32 bit values.
+ */
+__attribute__((target("sse2")))
+static inline void widen_sse2(__m128i x, __m128i w[4])
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_unpacklo_epi8(x, zero);
+    __m128i hi = _mm_unpackhi_epi8(x, zero);
+
+    w[0] = _mm_unpacklo_epi16(lo, zero);
+    w[1] = _mm_unpackhi_epi16(lo, zero);
+    w[2] = _mm_unpacklo_epi16(hi, zero);
+    w[3] = _mm_unpackhi_epi16(hi, zero);
+}
+
+/*
+ * Narrow four vectors of 32 bit values (in the 16 bit range) into 16 
+ * bytes, with saturation into 0-255.
+ */
+__attribute__((target("sse2")))
+static inline __m128i narrow_sse2(const __m128i w[4])
+{
+    return _mm_packus_epi16(_mm_packs_epi32(w[0], w[1]), 
+                            _mm_packs_epi32(w[2], w[3]));
+}
+
+/*
+ * Widen 32 bytes into four vectors of 32 bit values. The order of the 
+ * values is scrambled across lanes, and restored by `narrow_avx2`.
+ */
+__attribute__((target("avx2")))
+static inline void widen_avx2(__m256i x, __m256i w[4])
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i lo = _mm256_unpacklo_epi8(x, zero);
+    __m256i hi = _mm256_unpackhi_epi8(x, zero);
+
+    w[0] = _mm256_unpacklo_epi16(lo, zero);
+    w[1] = _mm256_unpackhi_epi16(lo, zero);
+    w[2] = _mm256_unpacklo_epi16(hi, zero);
+    w[3] = _mm256_unpackhi_epi16(hi, zero);
+}
+
+/*
+ * Narrow four vectors of 32 bit values produced by `widen_avx2` back into
+ * 32 bytes, with saturation into 0-255.
+ */
+__attribute__((target("avx2")))
+static inline __m256i narrow_avx2(const __m256i w[4])
+{
+    return _mm256_packus_epi16(_mm256_packs_epi32(w[0], w[1]), 
+                               _mm256_packs_epi32(w[2], w[3]));
+}
+#endif
+
+/*
+ * \brief Split a run of pixels into channel planes.
+ */
+static void pixel_to_planes(const Pixel *src, 
+                            uint8_t *b, uint8_t *g, uint8_t *r, uint8_t *a,
+                            size_t n)
+{
+#ifdef X86_SIMD
+    switch (bmp_simd_level())
+    {
+        case BMP_SIMD_AVX2:
+            pixel_to_planes_avx2(src, b, g, r, a, n);
+            return;
+        case BMP_SIMD_SSSE3:
+            pixel_to_planes_ssse3(src, b, g, r, a, n);
+            return;
+    }
+#endif
+    pixel_to_planes_scalar(src, b, g, r, a, n);
+}
+
+/*
+ * \brief Merge channel planes into a run of pixels.
+ */
+static void planes_to_pixel(const uint8_t *b, 
+                            const uint8_t *g, 
+                            const uint8_t *r, 
+                            const uint8_t *a,
+                            Pixel *dst, 
+                            size_t n)
+{
+#ifdef X86_SIMD
+    switch (bmp_simd_level())
+    {
+        case BMP_SIMD_AVX2:
+            planes_to_pixel_avx2(b, g, r, a, dst, n);
+            return;
+        case BMP_SIMD_SSSE3:
+            planes_to_pixel_sse2(b, g, r, a, dst, n);
+            return;
+    }
+#endif
+    planes_to_pixel_scalar(b, g, r, a, dst, n);
+}
+
+/*!
+ * Convert an image into planar layout.
+ */
+Planar_image image_to_planar(Image image)
+{
+    const Bmp_header *h = &image.bmp_header;
+    Planar_image p;
+    size_t i, j;
+
+    memset(&p, 0, sizeof (Planar_image));
+    memcpy(&p.bmp_header, h, sizeof (Bmp_header));
+
+    if (h->color_no)
+    {
+        p.palette = (Color*) malloc(h->color_no * sizeof (Color));
+        if (!p.palette)
+        {
+            fprintf(stderr, "image_to_planar: memory error.\n");
+            memset(&p, 0, sizeof (Planar_image));
+            return p;
+        }
+        memcpy(p.palette, image.palette, h->color_no * sizeof (Color));
+    }
+
+    if (alloc_planes(&p))
+    {
+        fprintf(stderr, "image_to_planar: memory error.\n");
+        free(p.palette);
+        memset(&p, 0, sizeof (Planar_image));
+        return p;
+    }
+
+    for (i = 0; i < h->height; ++i)
+    {
+        size_t off = i * p.stride;
+
+        /* compact images only hold the index channel */
+        if (image.indices)
+            for (j = 0; j < h->width; ++j)
+                p.planes[A][off + j] = image_get_index(image, i, j);
+        else
+            pixel_to_planes(image.pixel_data[i], 
+                            p.planes[B] + off, 
+                            p.planes[G] + off, 
+                            p.planes[R] + off, 
+                            p.planes[A] + off, 
+                            h->width);
+    }
+
+    return p;
+}
+
+/*!
+ * Copy the pixels of a planar image into an image.
+ */
+int planar_to_image(Planar_image planar, Image image)
+{
+    const Bmp_header *h = &planar.bmp_header;
+    size_t i;
+
+    if (image.indices 
+            || image.bmp_header.width != h->width 
+            || image.bmp_header.height != h->height)
+    {
+        fprintf(stderr, "planar_to_image: incompatible images.\n");
+        return 1;
+    }
+
+    for (i = 0; i < h->height; ++i)
+    {
+        size_t off = i * planar.stride;
+        planes_to_pixel(planar.planes[B] + off, 
+                        planar.planes[G] + off, 
+                        planar.planes[R] + off, 
+                        planar.planes[A] + off, 
+                        image.pixel_data[i], 
+                        h->width);
+    }
+
+    return 0;
+}
+
+/*!
+ * Deallocate the resources of a planar image.
+ */
+void destroy_planar_image(Planar_image *planar)
+{
+    /* the planes share a single block, starting with the first one */
+    free(planar->planes[0]);
+    free(planar->palette);
+    memset(planar, 0, sizeof (Planar_image));
+}
+
+/*!
+ * Get the histogram for a channel of a planar image.
+ */
+unsigned long* planar_histogram(Planar_image planar, const int channel)
+{
+    const Bmp_header *h = &planar.bmp_header;
+    unsigned long bank[HIST_BANKS][256];
+    unsigned long *hist;
+    size_t i, j;
+    int v;
+
+    if (channel < 0 || channel > 3)
+    {
+        fprintf(stderr, "planar_histogram: invalid channel parameter.\n");
+        return NULL;
+    }
+
+    hist = (unsigned long*) calloc(256, sizeof (unsigned long));
+    if (!hist)
+    {
+        fprintf(stderr, "planar_histogram: memory error.\n");
+        return NULL;
+    }
+
+    /* consecutive values are counted in different sub-tables, as in 
+     * histogram_all */
+    memset(bank, 0, sizeof bank);
+    for (i = 0; i < h->height; ++i)
+    {
+        const uint8_t *row = planar.planes[channel] + i * planar.stride;
+
+        for (j = 0; j + HIST_BANKS <= h->width; j += HIST_BANKS)
+        {
+            bank[0][row[j]]++;
+            bank[1][row[j + 1]]++;
+            bank[2][row[j + 2]]++;
+            bank[3][row[j + 3]]++;
+        }
+        for (; j < h->width; ++j)
+            bank[0][row[j]]++;
+    }
+
+    for (v = 0; v < 256; ++v)
+        hist[v] = bank[0][v] + bank[1][v] + bank[2][v] + bank[3][v];
+
+    return hist;
+}
+
+/* Context for the row operations on a planar image. */
+typedef struct Planar_ctx
+{
+    Planar_image planar; /* target image */
+    int channel;         /* channel index */
+    const uint8_t *lut;  /* new value for each level */
+    int inverse;         /* nonzero for conversions from Y'CbCr to RGB */
+} Planar_ctx;
+
+/*
+ * \brief Remap a channel of a range of rows of a planar image.
+ */
+static void planar_lut_rows(void *ctx, size_t begin, size_t end)
+{
+    Planar_ctx *c = (Planar_ctx*) ctx;
+    size_t w = c->planar.bmp_header.width;
+    size_t i, j;
+
+    for (i = begin; i < end; ++i)
+    {
+        uint8_t *row = c->planar.planes[c->channel] + i * c->planar.stride;
+        for (j = 0; j < w; ++j)
+            row[j] = c->lut[row[j]];
+    }
+}
+
+/*!
+ * Remap a channel of a planar image through a lookup table.
+ */
+int planar_apply_lut(Planar_image planar, const int channel, const uint8_t lut[256])
+{
+    return planar_apply_lut_ex(planar, channel, lut, NULL);
+}
+
+/*!
+ * Remap a channel of a planar image through a lookup table, in parallel.
+ */
+int planar_apply_lut_ex(Planar_image planar, 
+                        const int channel, 
+                        const uint8_t lut[256], 
+                        Bmp_exec *exec)
+{
+    Planar_ctx ctx;
+
+    if (channel < 0 || channel > 3)
+    {
+        fprintf(stderr, "planar_apply_lut: invalid channel.\n");
+        return 1;
     }
 
-    /* free buffer */
-    free(bitmap_buffer);
+    ctx.planar = planar;
+    ctx.channel = channel;
+    ctx.lut = lut;
+    bmp_parallel_for_rows(exec, planar.bmp_header.height, 0, planar_lut_rows, &ctx);
 
-    fclose(f);
-    return image;
+    return 0;
 }
 
 /*!
- * Save a bitmap image.
+ * Apply an histogram equalization algorithm to a planar image.
  */
-int save_bitmap(Image image, const char *filename)
+int planar_equalize(Planar_image planar, const int channel)
 {
-    FILE *f;
-    size_t i, j;
-    Bmp_header *h = &image.bmp_header;
-    uint8_t *bitmap_buffer;
-    uint8_t *buf;
-    size_t pad = (4 - ((h->width * h->bit_per_pixel + 7) / 8) % 4) % 4;
-    File_header file_header = 
-    {
-        /* bmp magic number */
-        0x4D42, 
-        
-        /* file size */
-        sizeof (File_header) 
-            + h->header_size 
-            + h->color_no * 4
-            + h->image_size,
-
-        /* reserved */
-        0,
-        0,
-
-        /* bmp offset */
-        sizeof (File_header)
-            + h->header_size
-            + h->color_no * 4
-    };
+    return planar_equalize_ex(planar, channel, NULL);
+}
 
-    /* open output file */
-    f = fopen(filename, "wb");
-    if (!f)
-        return 1;
+/*!
+ * Apply an histogram equalization algorithm to a planar image, in parallel.
+ */
+int planar_equalize_ex(Planar_image planar, const int channel, Bmp_exec *exec)
+{
+    unsigned long *h;
+    uint8_t lut[256];
+    int flat;
 
-    /* write file header */
-    fwrite(&file_header, sizeof (File_header), 1, f);
-    if (ferror(f))
+    h = planar_histogram(planar, channel);
+    if (!h)
     {
-        fclose(f);
+        fprintf(stderr, "planar_equalize: unable to create histogram.\n");
         return 1;
     }
 
-    /* write bmp header */
-    fwrite(h, h->header_size, 1, f);
-    if (ferror(f))
+    flat = cdf_lut(h, 256, lut);
+    free(h);
+
+    return flat ? 0 : planar_apply_lut_ex(planar, channel, lut, exec);
+}
+
+/*
+ * \brief Convert a run of plane values from RGB to Y'CbCr, in place (Y in
+ *        the B plane, Cb in the G plane and Cr in the R plane).
+ */
+static void planar_rgb2ycbcr_scalar(uint8_t *b, uint8_t *g, uint8_t *r, size_t n)
+{
+    size_t j;
+
+    for (j = 0; j < n; ++j)
     {
-        fclose(f);
-        return 1;
+        int y = (YCC_Y_R * r[j] + YCC_Y_G * g[j] + YCC_Y_B * b[j] + YCC_HALF) 
+                >> YCC_SHIFT;
+        int cb = clamp_u8(128 + ((YCC_CB * (b[j] - y) + YCC_HALF) >> YCC_SHIFT));
+        int cr = clamp_u8(128 + ((YCC_CR * (r[j] - y) + YCC_HALF) >> YCC_SHIFT));
+
+        b[j] = y;
+        g[j] = cb;
+        r[j] = cr;
     }
+}
 
-    /* write color palette if present */
-    if (h->color_no)
+/*
+ * \brief Convert a run of plane values from Y'CbCr to RGB, in place.
+ */
+static void planar_ycbcr2rgb_scalar(uint8_t *b, uint8_t *g, uint8_t *r, size_t n)
+{
+    size_t j;
+
+    for (j = 0; j < n; ++j)
     {
-        fwrite(image.palette, h->color_no * 4, 1, f);
-        if (ferror(f))
-        {
-            fclose(f);
-            return 1;
-        }
+        int y = b[j] * YCC_ONE + YCC_HALF;
+        int cb = g[j] - 128;
+        int cr = r[j] - 128;
+
+        r[j] = clamp_u8((y + YCC_R_CR * cr) >> YCC_SHIFT);
+        g[j] = clamp_u8((y - YCC_G_CB * cb - YCC_G_CR * cr) >> YCC_SHIFT);
+        b[j] = clamp_u8((y + YCC_B_CB * cb) >> YCC_SHIFT);
     }
+}
 
-    /* allocate buffer for bitmap pixel data */
-    bitmap_buffer = (uint8_t*) calloc(1, h->image_size);
-    buf = bitmap_buffer;
-    
-    /* convert pixel data into bitmap format */
-    switch (h->bit_per_pixel)
+#ifdef X86_SIMD
+/*
+ * Convert plane values from RGB to Y'CbCr, 16 at a time. The values are 
+ * widened to 32 bit lanes, converted as the pixels are, and narrowed back
+ * with saturation, so no extraction or merging of channels is needed.
+ */
+__attribute__((target("sse2")))
+static void planar_rgb2ycbcr_sse2(uint8_t *b, uint8_t *g, uint8_t *r, size_t n)
+{
+    size_t j;
+    int k;
+
+    for (j = 0; j + 16 <= n; j += 16)
     {
-        /* each byte of data represents 8 pixels, with the most significant 
-         * bit mapped into the leftmost pixel */
-        case 1:
-            for (i = 0; i < h->height; ++i)
-            {
-                j = 0;
-                while (j < h->width)
-                {
-                    short bit;
-                    uint8_t tmp = 0;
-                    for (bit = 7; bit >= 0 && j < h->width; --bit)
-                    {
-                        tmp |= (image.pixel_data[i][j].i == 0 ? 0u : 1u) << bit;
-                        ++j;
-                    }
-                    *buf++ = tmp;
-                }
-                /* each row has a padding for 4 byte alignment */
-                buf += pad;
-            }
-            break;
+        __m128i vb[4], vg[4], vr[4];
 
-        /* each byte represents 2 pixel, with the most significant nibble
-         * mapped into the leftmost pixel */
-        case 4:
-            for (i = 0; i < h->height; ++i)
-            {
-                for (j = 0; j < h->width; j += 2)
-                {
-                    /* write two pixels in the one byte variable tmp */
-                    uint8_t tmp = 0;
-                    /* most significant nibble */
-                    tmp |= image.pixel_data[i][j].i << 4;
-                    if (j + 1 < h->height)
-                        /* least significant nibble */
-                        tmp |= image.pixel_data[i][j + 1].i & mask4[LO_NIBBLE];
-
-                    /* write the byte in the image buffer */
-                    *buf++ = tmp;
-                }
-                /* each row has a padding to a 4 byte alignment */
-                buf += pad;
-            }
-            break;
+        widen_sse2(_mm_loadu_si128((const __m128i*) (b + j)), vb);
+        widen_sse2(_mm_loadu_si128((const __m128i*) (g + j)), vg);
+        widen_sse2(_mm_loadu_si128((const __m128i*) (r + j)), vr);
+        for (k = 0; k < 4; ++k)
+            ycc_fwd_sse2(vr[k], vg[k], vb[k], &vb[k], &vg[k], &vr[k]);
+        _mm_storeu_si128((__m128i*) (b + j), narrow_sse2(vb));
+        _mm_storeu_si128((__m128i*) (g + j), narrow_sse2(vg));
+        _mm_storeu_si128((__m128i*) (r + j), narrow_sse2(vr));
+    }
 
-        /* each byte represents 1 pixel */
-        case 8:
-            for (i = 0; i < h->height; ++i)
-            {
-                for (j = 0; j < h->width; ++j)
-                    *buf++ = image.pixel_data[i][j].i;
-                /* each row has a padding to a 4 byte alignment */
-                buf += pad;
-            }
-            break;
+    planar_rgb2ycbcr_scalar(b + j, g + j, r + j, n - j);
+}
 
-        /* each pixel is represented with 2 bytes */
-        case 16:
-            for (i = 0; i < h->height; ++i)
-            {
-                for (j = 0; j < h->width; ++j)
-                {
-                    uint16_t *px = (uint16_t*) buf;
-                    *px = 
-                        (image.pixel_data[i][j].b << tr_zeros(h->blue_mask)) +
-                        (image.pixel_data[i][j].g << tr_zeros(h->green_mask)) + 
-                        (image.pixel_data[i][j].r << tr_zeros(h->red_mask));
+/*
+ * Convert plane values from Y'CbCr to RGB, 16 at a time.
+ */
+__attribute__((target("sse2")))
+static void planar_ycbcr2rgb_sse2(uint8_t *b, uint8_t *g, uint8_t *r, size_t n)
+{
+    size_t j;
+    int k;
 
-                    /* advance to the next pixel (half-word) */
-                    buf += 2;
-                }
-                /* each row has a padding to a 4 byte alignment */
-                buf += pad;
-            }
-            break;
+    for (j = 0; j + 16 <= n; j += 16)
+    {
+        __m128i vb[4], vg[4], vr[4];
 
-        /* each pixel is represented with 3 bytes, with 1 byte for each 
-         * color component */
-        case 24:
-            for (i = 0; i < h->height; ++i)
-            {
-                for (j = 0; j < h->width; ++j)
-                {
-                    *buf++ = image.pixel_data[i][j].b;
-                    *buf++ = image.pixel_data[i][j].g;
-                    *buf++ = image.pixel_data[i][j].r;
-                }
-                /* each row has a padding to a 4 byte alignment */
-                buf += pad;
-            }
-            break;
+        widen_sse2(_mm_loadu_si128((const __m128i*) (b + j)), vb);
+        widen_sse2(_mm_loadu_si128((const __m128i*) (g + j)), vg);
+        widen_sse2(_mm_loadu_si128((const __m128i*) (r + j)), vr);
+        for (k = 0; k < 4; ++k)
+            ycc_inv_sse2(vb[k], vg[k], vr[k], &vr[k], &vg[k], &vb[k]);
+        _mm_storeu_si128((__m128i*) (b + j), narrow_sse2(vb));
+        _mm_storeu_si128((__m128i*) (g + j), narrow_sse2(vg));
+        _mm_storeu_si128((__m128i*) (r + j), narrow_sse2(vr));
+    }
 
-        /* each pixel is represented with 4 bytes */
-        case 32:
-            for (i = 0; i < h->height; ++i)
-            {
-                for (j = 0; j < h->width; ++j)
-                {
-                    uint32_t *px = (uint32_t*) buf;
-                    *px = 
-                        (image.pixel_data[i][j].b << tr_zeros(h->blue_mask)) +
-                        (image.pixel_data[i][j].g << tr_zeros(h->green_mask)) + 
-                        (image.pixel_data[i][j].r << tr_zeros(h->red_mask)) + 
-                        (image.pixel_data[i][j].i << tr_zeros(h->alpha_mask));
-
-                    /* advance to the next pixel (word) */
-                    buf += 4;
-                }
-                /* each row has a padding to a 4 byte alignment */
-                buf += pad;
-            }
+    planar_ycbcr2rgb_scalar(b + j, g + j, r + j, n - j);
+}
+
+/*
+ * Convert plane values from RGB to Y'CbCr, 32 at a time.
+ */
+__attribute__((target("avx2")))
+static void planar_rgb2ycbcr_avx2(uint8_t *b, uint8_t *g, uint8_t *r, size_t n)
+{
+    size_t j;
+    int k;
+
+    for (j = 0; j + 32 <= n; j += 32)
+    {
+        __m256i vb[4], vg[4], vr[4];
+
+        widen_avx2(_mm256_loadu_si256((const __m256i*) (b + j)), vb);
+        widen_avx2(_mm256_loadu_si256((const __m256i*) (g + j)), vg);
+        widen_avx2(_mm256_loadu_si256((const __m256i*) (r + j)), vr);
+        for (k = 0; k < 4; ++k)
+            ycc_fwd_avx2(vr[k], vg[k], vb[k], &vb[k], &vg[k], &vr[k]);
+        _mm256_storeu_si256((__m256i*) (b + j), narrow_avx2(vb));
+        _mm256_storeu_si256((__m256i*) (g + j), narrow_avx2(vg));
+        _mm256_storeu_si256((__m256i*) (r + j), narrow_avx2(vr));
+    }
+
+    planar_rgb2ycbcr_sse2(b + j, g + j, r + j, n - j);
+}
+
+/*
+ * Convert plane values from Y'CbCr to RGB, 32 at a time.
+ */
+__attribute__((target("avx2")))
+static void planar_ycbcr2rgb_avx2(uint8_t *b, uint8_t *g, uint8_t *r, size_t n)
+{
+    size_t j;
+    int k;
+
+    for (j = 0; j + 32 <= n; j += 32)
+    {
+        __m256i vb[4], vg[4], vr[4];
+
+        widen_avx2(_mm256_loadu_si256((const __m256i*) (b + j)), vb);
+        widen_avx2(_mm256_loadu_si256((const __m256i*) (g + j)), vg);
+        widen_avx2(_mm256_loadu_si256((const __m256i*) (r + j)), vr);
+        for (k = 0; k < 4; ++k)
+            ycc_inv_avx2(vb[k], vg[k], vr[k], &vr[k], &vg[k], &vb[k]);
+        _mm256_storeu_si256((__m256i*) (b + j), narrow_avx2(vb));
+        _mm256_storeu_si256((__m256i*) (g + j), narrow_avx2(vg));
+        _mm256_storeu_si256((__m256i*) (r + j), narrow_avx2(vr));
+    }
+
+    planar_ycbcr2rgb_sse2(b + j, g + j, r + j, n - j);
+}
+#endif
+
+/*
+ * \brief Convert the color space of a range of rows of a planar image.
+ */
+static void planar_ycc_rows(void *ctx, size_t begin, size_t end)
+{
+    typedef void (*Planar_run)(uint8_t*, uint8_t*, uint8_t*, size_t);
+    Planar_ctx *c = (Planar_ctx*) ctx;
+    Planar_image *p = &c->planar;
+    Planar_run run = c->inverse ? planar_ycbcr2rgb_scalar : planar_rgb2ycbcr_scalar;
+    size_t i;
+
+#ifdef X86_SIMD
+    switch (bmp_simd_level())
+    {
+        case BMP_SIMD_AVX2:
+            run = c->inverse ? planar_ycbcr2rgb_avx2 : planar_rgb2ycbcr_avx2;
+            break;
+        case BMP_SIMD_SSSE3:
+            run = c->inverse ? planar_ycbcr2rgb_sse2 : planar_rgb2ycbcr_sse2;
             break;
     }
-    
-    /* write pixel data in the file */
-    assert(file_header.bmp_offset == ftell(f));
-    fwrite(bitmap_buffer, h->image_size, 1, f);
-    if (ferror(f))
+#endif
+
+    for (i = begin; i < end; ++i)
     {
-        free(bitmap_buffer);
-        fclose(f);
-        return 1;
+        size_t off = i * p->stride;
+        run(p->planes[B] + off, p->planes[G] + off, p->planes[R] + off, 
+            p->bmp_header.width);
     }
+}
 
-    free(bitmap_buffer);
-    fclose(f);
+/*!
+ * Convert a planar image from RGB to Y'CbCr.
+ */
+int planar_rgb2ycbcr(Planar_image planar)
+{
+    return planar_rgb2ycbcr_ex(planar, NULL);
+}
+
+/*!
+ * Convert a planar image from RGB to Y'CbCr, in parallel.
+ */
+int planar_rgb2ycbcr_ex(Planar_image planar, Bmp_exec *exec)
+{
+    Planar_ctx ctx;
+
+    ctx.planar = planar;
+    ctx.inverse = 0;
+    bmp_parallel_for_rows(exec, planar.bmp_header.height, 0, planar_ycc_rows, &ctx);
     return 0;
 }
 
 /*!
- * Return a string containing a human readable dump of the image properties.
+ * Convert a planar image from Y'CbCr to RGB.
  */
-char* bmp_dump(Image image)
+int planar_ycbcr2rgb(Planar_image planar)
 {
-    /* 22 * 26 is an extimation for the header dump, 
-     * 21 * color_no is for the palette */
-    char *out = (char*) malloc(22 * 26 + 21 * image.bmp_header.color_no);
-    sprintf(out,
-            "Header size:  %10d\n"
-            "Image width:  %10d\n"
-            "Image height: %10d\n"
-            "Color planes: %10d\n"
-            "Bit per px:   %10d\n"
-            "Compression:  %10d\n"
-            "Bitmap size:  %10d\n"
-            "X resolution: %10d\n"
-            "Y resolution: %10d\n"
-            "Colors:       %10d\n"
-            "Important:    %10d\n"
-            "red_mask      %#010x\n"
-            "green_mask    %#010x\n"
-            "blue_mask     %#010x\n"
-            "alpha_mask    %#010x\n"
-            "cs_type       %10d\n"
-            "gamma_red     %10d\n"
-            "gamma_green   %10d\n"
-            "gamma_blue    %10d\n"
-            "intent        %10d\n"
-            "profile_data  %10d\n"
-            "profile_size  %10d\n",
-            image.bmp_header.header_size,
-            image.bmp_header.width,
-            image.bmp_header.height,
-            image.bmp_header.color_planes,
-            image.bmp_header.bit_per_pixel,
-            image.bmp_header.compression_type,
-            image.bmp_header.image_size,
-            image.bmp_header.h_resolution,
-            image.bmp_header.v_resolution,
-            image.bmp_header.color_no,
-            image.bmp_header.important_color_no,
-            image.bmp_header.red_mask,
-            image.bmp_header.green_mask,
-            image.bmp_header.blue_mask,
-            image.bmp_header.alpha_mask,
-            image.bmp_header.cs_type,
-            image.bmp_header.gamma_red,
-            image.bmp_header.gamma_green,
-            image.bmp_header.gamma_blue,
-            image.bmp_header.intent,
-            image.bmp_header.profile_size,
-            image.bmp_header.profile_size
-            );
-    if (image.bmp_header.color_no)
+    return planar_ycbcr2rgb_ex(planar, NULL);
+}
+
+/*!
+ * Convert a planar image from Y'CbCr to RGB, in parallel.
+ */
+int planar_ycbcr2rgb_ex(Planar_image planar, Bmp_exec *exec)
+{
+    Planar_ctx ctx;
+
+    ctx.planar = planar;
+    ctx.inverse = 1;
+    bmp_parallel_for_rows(exec, planar.bmp_header.height, 0, planar_ycc_rows, &ctx);
+    return 0;
+}
+
+/*
+ * \brief Advance a xorshift64* generator.
+ * @param s Generator state (nonzero).
+ * @return 64 pseudo random bits.
+ */
+static inline uint64_t xorshift64(uint64_t *s)
+{
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 0x2545F4914F6CDD1Dull;
+}
+
+/*
+ * \brief Merge the low bits of the color channels of a row of pixels.
+ * @param dst Target row.
+ * @param src Pixels holding the new bits.
+ * @param mask Mask of the bits to be replaced in each pixel (as a 32 bit
+ *        word, with the `i` channel cleared).
+ * @param n Number of pixels.
+ */
+static void merge_bits_scalar(Pixel *dst, const Pixel *src, uint32_t mask, size_t n)
+{
+    size_t j;
+
+    for (j = 0; j < n; ++j)
+    {
+        uint32_t d, s;
+        memcpy(&d, dst + j, sizeof d);
+        memcpy(&s, src + j, sizeof s);
+        d = (d & ~mask) | (s & mask);
+        memcpy(dst + j, &d, sizeof d);
+    }
+}
+
+#ifdef X86_SIMD
+/*
+ * Merge the low bits of pixels, 4 at a time.
+ */
+__attribute__((target("sse2")))
+static void merge_bits_sse2(Pixel *dst, const Pixel *src, uint32_t mask, size_t n)
+{
+    const __m128i m = _mm_set1_epi32(mask);
+    size_t j;
+
+    for (j = 0; j + 4 <= n; j += 4)
+    {
+        __m128i d = _mm_loadu_si128((const __m128i*) (dst + j));
+        __m128i s = _mm_loadu_si128((const __m128i*) (src + j));
+        d = _mm_or_si128(_mm_andnot_si128(m, d), _mm_and_si128(m, s));
+        _mm_storeu_si128((__m128i*) (dst + j), d);
+    }
+
+    merge_bits_scalar(dst + j, src + j, mask, n - j);
+}
+
+/*
+ * Merge the low bits of pixels, 8 at a time.
+ */
+__attribute__((target("avx2")))
+static void merge_bits_avx2(Pixel *dst, const Pixel *src, uint32_t mask, size_t n)
+{
+    const __m256i m = _mm256_set1_epi32(mask);
+    size_t j;
+
+    for (j = 0; j + 8 <= n; j += 8)
+    {
+        __m256i d = _mm256_loadu_si256((const __m256i*) (dst + j));
+        __m256i s = _mm256_loadu_si256((const __m256i*) (src + j));
+        d = _mm256_or_si256(_mm256_andnot_si256(m, d), _mm256_and_si256(m, s));
+        _mm256_storeu_si256((__m256i*) (dst + j), d);
+    }
+
+    merge_bits_sse2(dst + j, src + j, mask, n - j);
+}
+#endif
+
+#ifdef X86_SIMD
+/*
+ * Pack the least significant bits of channel values into bytes, 16 values
+ * at a time, moving each one into the sign bit of its byte and gathering
+ * the sign bits with a movemask. The first value goes into the least
+ * significant bit.
+ * @return Number of values packed (a multiple of 16).
+ */
+__attribute__((target("sse2")))
+static size_t pack_lsb_sse2(const uint8_t *vals, size_t n, uint8_t *dst)
+{
+    size_t t;
+
+    for (t = 0; t + 16 <= n; t += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*) (vals + t));
+        int m = _mm_movemask_epi8(_mm_slli_epi16(v, 7));
+        *dst++ = m;
+        *dst++ = m >> 8;
+    }
+
+    return t;
+}
+#endif
+
+/*
+ * \brief Merge the low bits of the color channels of a row of pixels.
+ */
+static void merge_bits(Pixel *dst, const Pixel *src, uint32_t mask, size_t n)
+{
+#ifdef X86_SIMD
+    switch (bmp_simd_level())
+    {
+        case BMP_SIMD_AVX2:
+            merge_bits_avx2(dst, src, mask, n);
+            return;
+        case BMP_SIMD_SSSE3:
+            merge_bits_sse2(dst, src, mask, n);
+            return;
+    }
+#endif
+    merge_bits_scalar(dst, src, mask, n);
+}
+
+/*
+ * \brief Mix a 64 bit value into a well distributed one (splitmix64).
+ *
+ * Used to derive an independent generator state for each row, so that rows
+ * can be filled in any order.
+ */
+static inline uint64_t splitmix64(uint64_t x)
+{
+    x += 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+/* Row buffers of a steganographic operation, one set for each range of
+ * rows. */
+typedef struct Steg_buf
+{
+    uint8_t *stream;     /* stream bytes covering a row */
+    uint8_t *vals;       /* new low bits for each channel of a row */
+    Pixel *staged;       /* new low bits for each pixel of a row */
+    uint64_t rng;        /* state of the random generator */
+} Steg_buf;
+
+/* State of a steganographic embedding or extraction. */
+typedef struct Steg_ctx
+{
+    Image image;         /* target image */
+    int bits;            /* low bits used in each channel */
+    uint8_t header[4];   /* payload length, little endian */
+    const uint8_t *data; /* payload bytes from `offset` (embedding), or
+                            NULL for random bits */
+    size_t offset;       /* position of `data` in the payload (byte) */
+    size_t len;          /* size of `data` (byte) */
+    uint8_t *out;        /* stream bits from `start`, followed by 2 bytes
+                            of slack (extraction) */
+    uint64_t start;      /* first stream bit handled */
+    uint64_t total;      /* end of the stream bits handled */
+    uint64_t seed;       /* seed of the random generators of the rows */
+    size_t row0;         /* first row handled */
+    size_t grain;        /* rows in each range */
+    size_t ranges;       /* number of ranges */
+    Steg_buf *buf;       /* row buffers, one set for each range */
+} Steg_ctx;
+
+/*
+ * \brief Get a byte of the embedded stream: payload length, payload, and
+ *        random filling.
+ */
+static uint8_t steg_stream_byte(const Steg_ctx *c, Steg_buf *b, uint64_t k)
+{
+    if (k < sizeof c->header)
+        return c->header[k];
+    k -= sizeof c->header;
+    if (c->data && k >= c->offset && k - c->offset < c->len)
+        return c->data[k - c->offset];
+    return (uint8_t) xorshift64(&b->rng);
+}
+
+/*
+ * \brief Embed the bits of the stream falling into a row.
+ *
+ * Rows past the payload only receive random bits, taken straight from the
+ * generator. Other rows have their slice of the stream unpacked into one
+ * byte for each channel, expanded into pixels, and merged into the row.
+ */
+static void steg_embed_row(const Steg_ctx *c, Steg_buf *b, size_t i)
+{
+    size_t w = c->image.bmp_header.width;
+    size_t n = 3 * w;
+    uint64_t first = (uint64_t) i * n * c->bits;
+    uint32_t mask = ((1u << c->bits) - 1) * 0x010101u;
+    size_t t, k;
+
+    b->rng = splitmix64(c->seed + i) | 1;
+
+    if (first >= c->total)
     {
-        strcat(out, "\nPalette:\n");
-        for (size_t i = 0; i < image.bmp_header.color_no; ++i)
+        for (t = 0; t < w; t += 2)
         {
-            char buf[100];
-            sprintf(buf, 
-                    "%3lu: %3u %3u %3u %3u\n",
-                    i,
-                    image.palette[i].r,
-                    image.palette[i].g,
-                    image.palette[i].b,
-                    image.palette[i].a
-                   );
-            strcat(out, buf);
+            uint64_t r = xorshift64(&b->rng);
+            memcpy(b->staged + t, &r, MIN(2, w - t) * sizeof (Pixel));
         }
     }
-    return out;
+    else
+    {
+        /* stream bytes covering the row, plus one for the reads below */
+        size_t skip = first % 8;
+        size_t bytes = (skip + n * c->bits + 7) / 8 + 1;
+        uint8_t vmask = (1u << c->bits) - 1;
+
+        for (k = 0; k < bytes; ++k)
+            b->stream[k] = steg_stream_byte(c, b, first / 8 + k);
+
+        /* each value spans at most two stream bytes */
+        for (t = 0; t < n; ++t)
+        {
+            size_t pos = skip + t * c->bits;
+            unsigned v = b->stream[pos / 8] | b->stream[pos / 8 + 1] << 8;
+            b->vals[t] = (v >> (pos % 8)) & vmask;
+        }
+        bgr_to_pixel(b->vals, b->staged, w);
+    }
+
+    merge_bits(c->image.pixel_data[i], b->staged, mask, w);
 }
 
-/*!
- * Return a string containing an ASCII art representation for the 
- * two colors input image.
+/*
+ * \brief Overwrite the bits of a row falling into the handled part of the
+ *        stream, leaving all the other bits untouched.
+ *
+ * Each channel is written on its own, so that calls working on disjoint
+ * channels never write the same byte.
  */
-char* ascii_print(Image image)
+static void steg_patch_row(const Steg_ctx *c, Steg_buf *b, size_t i)
 {
-    char *out;
-    long i, j, k;
-    Bmp_header *h = &image.bmp_header;
+    size_t n = 3 * c->image.bmp_header.width;
+    uint64_t first = (uint64_t) i * n * c->bits;
+    uint8_t *px = (uint8_t*) c->image.pixel_data[i];
+    uint8_t vmask = (1u << c->bits) - 1;
+    uint64_t base;
+    size_t t, end, k;
 
-    if (h->color_no != 2)
-    {
-        fprintf(stderr, "ascii_print can print two colors images only.\n");
-        return NULL;
-    }
+    if (first >= c->total || first + n * c->bits <= c->start)
+        return;
 
-    /* memory for the output string (+1 for row and string terminators) */
-    out = (char*) malloc((h->width + 1) * h->height + 1);
-    if (!out)
+    /* channels holding bits of the handled part */
+    t = first < c->start ? (c->start - first) / c->bits : 0;
+    end = MIN(n, (c->total - first + c->bits - 1) / c->bits);
+
+    base = (first + t * c->bits) / 8;
+    for (k = 0; base + k <= (first + end * c->bits) / 8 + 1; ++k)
+        b->stream[k] = steg_stream_byte(c, b, base + k);
+
+    for (; t < end; ++t)
     {
-        return NULL;
+        uint64_t pos = first + t * c->bits;
+        size_t q = pos / 8 - base;
+        unsigned v = (b->stream[q] | b->stream[q + 1] << 8) >> (pos % 8);
+        uint8_t m = vmask;
+        uint8_t *ch = px + t / 3 * sizeof (Pixel) + t % 3;
+
+        if (pos < c->start)
+            m &= vmask << (c->start - pos);
+        if (pos + c->bits > c->total)
+            m &= vmask >> (pos + c->bits - c->total);
+
+        *ch = (*ch & ~m) | (v & m);
     }
+}
 
-    /* pixels are stored from bottom to top, left to right */
-    k = 0;
-    for (i = h->height - 1; i >= 0; --i)
+/*
+ * \brief Extract the bits of the stream held by a row, within the handled
+ *        part of the stream.
+ */
+static void steg_extract_row(const Steg_ctx *c, Steg_buf *b, size_t i)
+{
+    size_t w = c->image.bmp_header.width;
+    size_t n = 3 * w;
+    uint64_t first = (uint64_t) i * n * c->bits;
+    uint8_t vmask = (1u << c->bits) - 1;
+    size_t t, p;
+
+    if (first >= c->total || first + n * c->bits <= c->start)
+        return;
+    t = first < c->start ? (c->start - first) / c->bits : 0;
+    n = MIN(n, (c->total - first + c->bits - 1) / c->bits);
+
+    /* only the pixels holding the channels needed */
+    p = t / 3;
+    pixel_to_bgr(c->image.pixel_data[i] + p, b->vals + 3 * p, (n + 2) / 3 - p);
+
+#ifdef X86_SIMD
+    /* whole bytes of the stream, when they start at a byte boundary */
+    if (c->bits == 1
+            && (first + t - c->start) % 8 == 0
+            && bmp_simd_level() != BMP_SIMD_NONE)
+        t += pack_lsb_sse2(b->vals + t, n - t,
+                           c->out + (first + t - c->start) / 8);
+#endif
+
+    for (; t < n; ++t)
     {
-        for (j = 0; j < (long) h->width; ++j)
-            out[k++] = (image.pixel_data[i][j].i ? '*' : ' ');
-        out[k++] = '\n';
+        uint64_t pos = first + t * c->bits;
+        unsigned v = b->vals[t] & vmask;
+        uint64_t r = 0; /* position in the output */
+
+        if (pos < c->start)
+            v >>= c->start - pos;
+        else
+            r = pos - c->start;
+
+        v <<= r % 8;
+        c->out[r / 8] |= v;
+        if (v >> 8)
+            c->out[r / 8 + 1] |= v >> 8;
     }
-    out[k] = '\0';
+}
 
-    return out;
+/*
+ * \brief Embed the stream into a range of rows.
+ */
+static void steg_embed_rows(void *ctx, size_t begin, size_t end)
+{
+    Steg_ctx *c = (Steg_ctx*) ctx;
+    Steg_buf *b = c->buf + begin / c->grain;
+    size_t i;
+
+    for (i = begin; i < end; ++i)
+        steg_embed_row(c, b, c->row0 + i);
 }
 
-/*!
- * Get the histogram for a channel.
+/*
+ * \brief Extract the stream from a range of rows.
  */
-unsigned long* histogram(Image image, const int channel)
+static void steg_extract_rows(void *ctx, size_t begin, size_t end)
 {
-    size_t i, j;
-    unsigned long *hist;
+    Steg_ctx *c = (Steg_ctx*) ctx;
+    Steg_buf *b = c->buf + begin / c->grain;
+    size_t i;
 
-    if (channel < 0 || channel > 3)
+    for (i = begin; i < end; ++i)
+        steg_extract_row(c, b, c->row0 + i);
+}
+
+/*
+ * \brief Release the row buffers of a steganographic operation.
+ */
+static void steg_free(Steg_ctx *c)
+{
+    size_t r;
+
+    for (r = 0; c->buf && r < c->ranges; ++r)
     {
-        fprintf(stderr, "histogram: invalid channel parameter.\n");
-        return NULL;
+        free(c->buf[r].stream);
+        free(c->buf[r].vals);
+        free(c->buf[r].staged);
     }
+    free(c->buf);
+    c->buf = NULL;
+}
 
-    hist = (unsigned long*) calloc(256, sizeof (unsigned long));
-    if (!hist)
+/*
+ * \brief Split the rows of a steganographic operation into one range for
+ *        each thread, and allocate the row buffers of each range.
+ *
+ * The ranges are made of a number of rows holding a whole number of stream
+ * bytes, so that ranges extracted in parallel never share an output byte.
+ * @param c Context, with `image` and `bits` set.
+ * @param rows Number of rows handled.
+ * @param exec Execution context, or NULL.
+ * @return Zero on success, nonzero otherwise.
+ */
+static int steg_alloc(Steg_ctx *c, size_t rows, Bmp_exec *exec)
+{
+    size_t w = c->image.bmp_header.width;
+    size_t threads = bmp_exec_threads(exec);
+    size_t align = 1;
+    size_t r;
+
+    while (align * 3 * w * c->bits % CHAR_BIT)
+        align *= 2;
+
+    c->grain = (rows + threads - 1) / threads;
+    c->grain = (c->grain + align - 1) / align * align;
+    c->ranges = (rows + c->grain - 1) / c->grain;
+    c->buf = (Steg_buf*) calloc(c->ranges, sizeof (Steg_buf));
+    if (!c->buf)
+        return 1;
+
+    for (r = 0; r < c->ranges; ++r)
     {
-        fprintf(stderr, "histogram: memory error.\n");
-        return NULL;
+        Steg_buf *b = c->buf + r;
+
+        b->stream = (uint8_t*) malloc((3 * w * c->bits + 7) / 8 + 2);
+        b->vals = (uint8_t*) malloc(3 * w);
+        b->staged = (Pixel*) malloc((w + 1) * sizeof (Pixel));
+        if (!b->stream || !b->vals || !b->staged)
+        {
+            steg_free(c);
+            return 1;
+        }
     }
 
-    for (i = 0; i < image.bmp_header.height; ++i)
-        for (j = 0; j < image.bmp_header.width; ++j)
-            /* convert packed struct pointer into an array pointer
-             * to access the channel */
-            hist[((uint8_t*) &image.pixel_data[i][j])[channel]] += 1;
-    
-    return hist; 
+    return 0;
 }
 
-/*!
- * Apply an histogram equalization algorithm.
+/*
+ * \brief Check that an image and a bit count are suitable for steganography.
+ * @return Zero if they are, nonzero otherwise.
  */
-int equalize(Image image, const int channel)
+static int steg_check(Image image, int bits, const char *caller)
 {
-    size_t i, j;
-    const int li = 256; /* levels in the input image */
-    const int lo = 256; /* levels in output image */
-    unsigned long area = image.bmp_header.width * image.bmp_header.height;
-    const float c = (float) lo / (float) area; /* coefficient */
-    unsigned long cdf[li];        /* cumulative distribution function */
-    unsigned long *h;             /* histogram for the channel */
+    if (bits < 1 || bits > 4)
+    {
+        fprintf(stderr, "%s: the bits per channel must be between 1 and 4\n",
+                caller);
+        return 1;
+    }
 
-    if (channel < 0 || channel > 3)
+    if (image.bmp_header.bit_per_pixel < 16 || image.indices)
     {
-        fprintf(stderr, "equalize: invalid channel.\n");
+        fprintf(stderr,
+                "%s: only 16 bit or higher bpp images allowed\n",
+                caller);
         return 1;
     }
-    
-    /* get histogram */
-    h = histogram(image, channel);
-    if (!h)
+
+    if ((uint64_t) image.bmp_header.width * image.bmp_header.height * 3 * bits
+            < STEG_LEN)
     {
-        fprintf(stderr, "equalize: unable to create histogram.\n");
+        fprintf(stderr, "%s: the image is too small\n", caller);
         return 1;
     }
 
-    /* compute cdf */
-    cdf[0] = h[0];
-    for (i = 1; i < li; ++i)
-        cdf[i] = cdf[i - 1] + h[i];
+    return 0;
+}
 
-    /* equalize */
-    for (i = 0; i < image.bmp_header.height; ++i)
+/*
+ * \brief Check that a range of the payload fits into an image.
+ * @return Zero if it does, nonzero otherwise.
+ */
+static int steg_check_range(Image image,
+                            size_t offset,
+                            size_t len,
+                            int bits,
+                            const char *caller)
+{
+    size_t cap;
+
+    if (steg_check(image, bits, caller))
+        return 1;
+
+    cap = steganography_capacity(image, bits);
+    if (offset > cap || len > cap - offset)
     {
-        for (j = 0; j < image.bmp_header.width; ++j)
-        {
-            /* convert packed struct pointer into an array pointer
-             * to access the channel */
-            uint8_t *px = (uint8_t*) &image.pixel_data[i][j];
-            px[channel] = c * cdf[px[channel]];
-        }
+        fprintf(stderr,
+                "%s: the range exceeds the capacity of the image (%lu)\n",
+                caller, (unsigned long) cap);
+        return 1;
     }
 
-    free(h);
     return 0;
 }
 
-/*!
- * Convert the RGB color space into Y'CbCr (with Y, Cb and Cr in the range
- * 0-255), applying the following transformation:
- * \f[
- *   Y   = 0.299 \cdot R + 0.587 \cdot G + 0.114 * B \\
- *   C_b = 128 + 0.564 \cdot (B - Y) \\
- *   C_r = 128 + 0.713 \cdot (R - Y)
- * \f]
+/*
+ * \brief Extract a part of the stream into a zeroed buffer.
+ * @param c Context, with `image` and `bits` set.
+ * @param out Output buffer, with two bytes of slack after the bits read.
+ * @param start First stream bit to be read.
+ * @param total End of the stream bits to be read.
+ * @param exec Execution context, or NULL. Only used when `start` is zero,
+ *        so that each range of rows begins at a byte of the output.
+ * @return Zero on success, nonzero on memory error.
  */
-int rgb2ycbcr(Image image)
+static int steg_extract_bits(Steg_ctx *c,
+                             uint8_t *out,
+                             uint64_t start,
+                             uint64_t total,
+                             Bmp_exec *exec)
 {
-    size_t i, j;
+    uint64_t row_bits = (uint64_t) c->image.bmp_header.width * 3 * c->bits;
+    size_t rows;
 
-    for (i = 0; i < image.bmp_header.height; ++i)
-    {
-        for (j = 0; j < image.bmp_header.width; ++j)
-        {
-            Pixel p = image.pixel_data[i][j];
-            uint8_t y;
+    c->out = out;
+    c->start = start;
+    c->total = total;
+    c->row0 = start / row_bits;
+    rows = MIN(c->image.bmp_header.height, (total + row_bits - 1) / row_bits)
+         - c->row0;
 
-            /* Y */
-            image.pixel_data[i][j].b = y =
-                  0.299 * p.r
-                + 0.587 * p.g 
-                + 0.114 * p.b;
+    if (start)
+        exec = NULL;
+    if (steg_alloc(c, rows, exec))
+        return 1;
 
-            /* Cb */
-            image.pixel_data[i][j].g = 128 + 0.713 * (p.b - y);
+    bmp_parallel_for_rows(exec, rows, c->grain, steg_extract_rows, c);
 
-            /* Cr */
-            image.pixel_data[i][j].r = 128 + 0.564 * (p.r - y);
-        }
-    }
+    steg_free(c);
     return 0;
 }
 
 /*!
- * Convert the Y'CbCr color space into RGB, applying the following
- * transformation:
- * \f[
- *   R = Y + 1.403 \cdot (C_r - 128) \\
- *   G = Y - 0.714 \cdot (C_r - 128) - 0.344 \cdot (C_b - 128) \\
- *   B = Y + 1.773 \cdot (C_b - 128)
- * \f]
+ * Get the maximum payload size for an image.
  */
-int ycbcr2rgb(Image image)
+size_t steganography_capacity(Image image, int bits)
 {
-    size_t i, j;
+    const Bmp_header *h = &image.bmp_header;
+    uint64_t channels = (uint64_t) h->width * h->height * 3;
+    uint64_t cap;
 
-    for (i = 0; i < image.bmp_header.height; ++i)
-    {
-        for (j = 0; j < image.bmp_header.width; ++j)
-        {
-            Pixel p = image.pixel_data[i][j];
-
-            /* R */
-            image.pixel_data[i][j].r =
-                  p.b                  /* Y  */
-                + 0                    /* Cb */
-                + 1.402 * (p.r - 128); /* Cr */
-
-            /* G */
-            image.pixel_data[i][j].g =
-                  p.b                    /* Y  */
-                - 0.34414 * (p.g - 128)  /* Cb */
-                - 0.71414 * (p.r - 128); /* Cr */
-
-            /* B */
-            image.pixel_data[i][j].b =
-                  p.b                  /* Y  */
-                + 1.772 * (p.g - 128)  /* Cb */
-                + 0;                   /* Cr */
-        }
-    }
-    return 0;
+    if (bits < 1 || bits > 4 || channels * bits < STEG_LEN)
+        return 0;
+
+    /* the length is stored in STEG_LEN bits */
+    cap = (channels * bits - STEG_LEN) / CHAR_BIT;
+    return MIN(cap, 0xFFFFFFFFull);
 }
 
 /*!
- * Write an hidden text message inside a bitmap. Each color channel of each 
- * pixel holds a bit of the message; pixels are read from bottom left to top 
- * right, while channels for each pixel are read from B to R. The bits of
- * the characters or numbers are written in little endian order.
- *
- * The value of each channel is zero if its value is even, one if it is odd.
- * The evenness of the values is manipulated to encode the message while doing
- * only a quasi invisible change to the image aspect.
+ * Hide binary data inside a bitmap.
+ */
+int steganography_embed(Image image, const void *data, size_t len, int bits)
+{
+    return steganography_embed_ex(image, data, len, bits, NULL);
+}
+
+/*!
+ * Hide binary data inside a bitmap, in parallel. The data is preceded by
+ * its length (32 bit, little endian), and the stream is spread over the
+ * color channels of the pixels, from bottom left to top right and from B to
+ * R in each pixel. Each channel holds `bits` bits of the stream in its low
+ * bits, the least significant bit holding the first one, and the bits of
+ * each byte are taken from the least significant one. Channels past the
+ * payload are filled with random bits, from a generator seeded for each
+ * row.
  *
- * A bitmap of size \f$ width \cdot height \f$ can hold 
- * \f$ 3 \cdot width \cdot height \f$ bits of data. The first 32 bits are used
- * to encode the length of the payload message. Then the message follows, and
- * the eventual exceeding channels are filled with random data.
+ * Bit `8 * (4 + k)` of the stream, where payload byte `k` begins, is then
+ * held by channel `8 * (4 + k) / bits` in this order, so that any part of
+ * the payload can be located directly.
  */
-int steganography_write(Image image, const char *string)
+int steganography_embed_ex(Image image,
+                           const void *data,
+                           size_t len,
+                           int bits,
+                           Bmp_exec *exec)
 {
-    Bmp_header *h = &image.bmp_header;
-    size_t len = strlen(string) + 1; /* include termination character */
-    size_t allowed_len = (h->width * h->height * 3 - STEG_LEN) / CHAR_BIT;
-    unsigned long i, j, k, l, ch;
-    uint8_t *px;
+    Steg_ctx c;
+    int k;
 
-    if (len > allowed_len)
-    {
-        fprintf(stderr,
-                "steganography_write: the input string is too long, "
-                "the maximum allowed string length for this image is %ld\n",
-                allowed_len);
+    if (steg_check(image, bits, "steganography_embed"))
         return 1;
-    }
 
-    if (h->bit_per_pixel < 16)
+    if (len > steganography_capacity(image, bits))
     {
-        fprintf(stderr, 
-                "steganography_write: only 16 bit or higher bpp images"
-                "allowed\n");
+        fprintf(stderr,
+                "steganography_embed: the payload is too long, "
+                "the maximum allowed length for this image is %lu\n",
+                (unsigned long) steganography_capacity(image, bits));
         return 1;
     }
 
-    /* write len in the first STEG_LEN pixels */
-    /* even = zero, odd = 1 */
-    i = j = ch = 0;
-    for (k = 0; k < STEG_LEN; ++k)
-    {
-        px = (uint8_t*) &image.pixel_data[i][j];
-        if (px[ch] == 255)
-            --px[ch]; /* prevent overflow */
-        px[ch] += (px[ch] % 2 + ((len >> k) & 0x1)) % 2;
-        NEXT(i, j, ch, h->width);
-    }
+    memset(&c, 0, sizeof c);
+    c.image = image;
+    c.bits = bits;
+    c.data = (const uint8_t*) data;
+    c.len = len;
+    c.total = (uint64_t) (sizeof c.header + len) * CHAR_BIT;
+    for (k = 0; k < 4; ++k)
+        c.header[k] = (uint8_t) (len >> 8 * k);
+    c.seed = ((uint64_t) time(NULL) << 1 | 1) ^ (uintptr_t) image.pixel_data;
 
-    /* write the actual string (l-th pixel of k-th character) following */
-    for (k = 0; k < len; ++k)
+    if (steg_alloc(&c, image.bmp_header.height, exec))
     {
-        for (l = 0; l < CHAR_BIT; ++l)
-        {
-            px = (uint8_t*) &image.pixel_data[i][j];
-            if (px[ch] == 255)
-                --px[ch]; /* prevent overflow */
-            px[ch] += (px[ch] % 2 + ((string[k] >> l) & 0x1)) % 2;
-            NEXT(i, j, ch, h->width);
-        }
+        fprintf(stderr, "steganography_embed: memory error.\n");
+        return 1;
     }
 
-    /* fill the rest of the image with random data */
-    srand(time(NULL));
-    while (i < h->height)
-    {
-        px = (uint8_t*) &image.pixel_data[i][j];
-        if (px[ch] == 255)
-            --px[ch]; /* prevent overflow */
-        px[ch] += rand() % 2;
-        NEXT(i, j, ch, h->width);
-    }
+    bmp_parallel_for_rows(exec, image.bmp_header.height, c.grain,
+                          steg_embed_rows, &c);
 
+    steg_free(&c);
     return 0;
 }
 
 /*!
- * Read the hidden message inside an image. Read the length of the encoded
- * message first, and read the message if it is valid. If the bitmap does not
- * actually contain an hidden message, the read can fail on the length check,
- * or maybe the operation may prosecute and return a string filled with
- * garbage. The user must be sure that the image under reading actually  
- * contains a valid message encoded.
+ * Read binary data hidden inside an image by `steganography_embed`.
  */
-char* steganography_read(Image image)
+void* steganography_extract(Image image, size_t *len, int bits)
 {
-    Bmp_header *h = &image.bmp_header;
-    size_t allowed_len = (h->width * h->height * 3 - STEG_LEN) / CHAR_BIT;
-    unsigned long i, j, k, l, ch;
-    size_t len = 0;
-    uint8_t *px;
-    char *res;
+    return steganography_extract_ex(image, len, bits, NULL);
+}
 
-    if (h->bit_per_pixel < 16)
+/*!
+ * Read binary data hidden inside an image by `steganography_embed`, in
+ * parallel. The length is read first, and only the rows holding the
+ * payload are read.
+ */
+void* steganography_extract_ex(Image image, size_t *len, int bits, Bmp_exec *exec)
+{
+    Steg_ctx c;
+    uint8_t head[sizeof c.header + 2] = {0}; /* length, with slack */
+    uint8_t *out;
+
+    if (steg_check(image, bits, "steganography_extract"))
+        return NULL;
+
+    memset(&c, 0, sizeof c);
+    c.image = image;
+    c.bits = bits;
+
+    /* read the length first, from the first rows */
+    if (steg_extract_bits(&c, head, 0, STEG_LEN, NULL))
     {
-        fprintf(stderr, 
-                "steganography_read: only 16 bit or higher bpp images"
-                "allowed\n");
+        fprintf(stderr, "steganography_extract: memory error.\n");
         return NULL;
     }
-    
-    /* read the string length (inclusive of termination character) */
-    i = j = ch = 0;
-    for (k = 0; k < STEG_LEN; ++k)
+
+    c.len = head[0] | head[1] << 8 | head[2] << 16 | (size_t) head[3] << 24;
+    if (c.len > steganography_capacity(image, bits))
     {
-        px = (uint8_t*) &image.pixel_data[i][j];
-        len += (uint32_t) (px[ch] % 2) << k;
-        NEXT(i, j, ch, h->width);
+        fprintf(stderr,
+                "steganography_extract: invalid payload length read, "
+                "probably the image does not contain a message.\n");
+        return NULL;
     }
 
-    /* ensure the string length is valid */
-    if (len > allowed_len)
+    /* room for the header, the payload, the slack and a NUL */
+    out = (uint8_t*) calloc(sizeof c.header + c.len + 3, 1);
+    if (!out || steg_extract_bits(&c, out, 0,
+                (uint64_t) (sizeof c.header + c.len) * CHAR_BIT, exec))
     {
-        fprintf(stderr, 
-                "steganography_read: invalid string length read, probably"
-                "the image does not contain a message.\n");
+        fprintf(stderr, "steganography_extract: memory error.\n");
+        free(out);
         return NULL;
     }
 
-    /* read the message */
-    res = (char*) calloc(len, sizeof (char));
-    for (k = 0; k < len; ++k)
+    /* drop the header, and terminate the payload for use as a string */
+    memmove(out, out + sizeof c.header, c.len);
+    out[c.len] = '\0';
+    if (len)
+        *len = c.len;
+
+    return out;
+}
+
+/*!
+ * Overwrite a part of the payload hidden inside an image. Only the bits
+ * holding the part are written, locating them directly from its offset.
+ */
+int steganography_embed_range(Image image,
+                              const void *data,
+                              size_t offset,
+                              size_t len,
+                              int bits)
+{
+    Steg_ctx c;
+    uint64_t row_bits = (uint64_t) image.bmp_header.width * 3 * bits;
+    size_t i, end;
+
+    if (steg_check_range(image, offset, len, bits, "steganography_embed_range"))
+        return 1;
+
+    if (!len)
+        return 0;
+
+    memset(&c, 0, sizeof c);
+    c.image = image;
+    c.bits = bits;
+    c.data = (const uint8_t*) data;
+    c.offset = offset;
+    c.len = len;
+    c.start = (uint64_t) (sizeof c.header + offset) * CHAR_BIT;
+    c.total = c.start + (uint64_t) len * CHAR_BIT;
+
+    if (steg_alloc(&c, 1, NULL))
     {
-        for (l = 0; l < CHAR_BIT; ++l)
-        {
-            px = (uint8_t*) &image.pixel_data[i][j];
-            res[k] += (uint8_t) (px[ch] % 2) << l;
-            NEXT(i, j, ch, h->width);
-        }
+        fprintf(stderr, "steganography_embed_range: memory error.\n");
+        return 1;
     }
 
-    return res;
+    end = MIN(image.bmp_header.height, (c.total + row_bits - 1) / row_bits);
+    for (i = c.start / row_bits; i < end; ++i)
+        steg_patch_row(&c, c.buf, i);
+
+    steg_free(&c);
+    return 0;
+}
+
+/*!
+ * Read a part of the payload hidden inside an image, locating it directly
+ * from its offset, without reading the length or the preceding bytes.
+ */
+int steganography_extract_range(Image image,
+                                void *data,
+                                size_t offset,
+                                size_t len,
+                                int bits)
+{
+    Steg_ctx c;
+    uint8_t *out;
+
+    if (steg_check_range(image, offset, len, bits,
+                         "steganography_extract_range"))
+        return 1;
+
+    if (!len)
+        return 0;
+
+    memset(&c, 0, sizeof c);
+    c.image = image;
+    c.bits = bits;
+
+    out = (uint8_t*) calloc(len + 2, 1);
+    if (!out || steg_extract_bits(&c, out,
+                (uint64_t) (sizeof c.header + offset) * CHAR_BIT,
+                (uint64_t) (sizeof c.header + offset + len) * CHAR_BIT,
+                NULL))
+    {
+        fprintf(stderr, "steganography_extract_range: memory error.\n");
+        free(out);
+        return 1;
+    }
+
+    memcpy(data, out, len);
+    free(out);
+    return 0;
+}
+
+/*!
+ * Write an hidden text message inside a bitmap, with one bit for each color
+ * channel (see `steganography_embed`). The message is stored with its
+ * terminating character.
+ */
+int steganography_write(Image image, const char *string)
+{
+    return steganography_embed(image, string, strlen(string) + 1, 1);
+}
+
+/*!
+ * Read the hidden message inside an image. Read the length of the encoded
+ * message first, and read the message if it is valid. If the bitmap does not
+ * actually contain an hidden message, the read can fail on the length check,
+ * or maybe the operation may prosecute and return a string filled with
+ * garbage. The user must be sure that the image under reading actually  
+ * contains a valid message encoded.
+ */
+char* steganography_read(Image image)
+{
+    return (char*) steganography_extract(image, NULL, 1);
 }
@@ -25,7 +25,9 @@
 #ifndef __BITMAP_INCLUDED
 #define __BITMAP_INCLUDED 
 
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 /* Indices for RGB channels */
 #define B 0 /*!< Blue channel index. */
@@ -33,6 +35,24 @@
 #define R 2 /*!< Red channel index. */
 #define A 3 /*!< Alpha channel index. */
 
+/* Memory layout */
+#define PIXEL_ALIGNMENT 64 /*!< Alignment (byte) of the image pixel block. */
+
+/* SIMD instruction sets */
+#define BMP_SIMD_NONE  0 /*!< Scalar code only. */
+#define BMP_SIMD_SSSE3 1 /*!< SSSE3 kernels. */
+#define BMP_SIMD_AVX2  2 /*!< AVX2 kernels. */
+
+/* Flags for opening */
+#define BMP_OPEN_INDEXED 0x1 /*!< Compact storage for palette images. */
+#define BMP_OPEN_YCBCR   0x2 /*!< Convert colors into Y'CbCr. */
+#define BMP_OPEN_LUMA    0x4 /*!< Convert colors into greyscale (luma). */
+
+/* Flags for saving */
+#define BMP_SAVE_TRUNCATE   0x1 /*!< Quantize channels by truncation. */
+#define BMP_SAVE_FROM_YCBCR 0x2 /*!< Convert colors from Y'CbCr into RGB. */
+#define BMP_SAVE_RLE        0x4 /*!< Run length encode 8 and 4 bit images. */
+
 /* Indices for YCbCr channels */
 #define Y  0 /*!< Blue channel index. */
 #define Cb 1 /*!< Green channel index. */
@@ -127,18 +147,147 @@ typedef struct Pixel
 
 /*!
  * \brief Structured type for an image.
+ *
+ * Pixels are normally stored as `Pixel` structs. Palette images (1, 4 and 8
+ * bit) can instead use a compact storage, where `indices` holds one byte 
+ * per pixel (4 and 8 bit images) or one bit per pixel (1 bit images, with 
+ * the most significant bit mapped into the leftmost pixel). In compact 
+ * storage `pixel_data` and `pixels` are NULL, and pixels are accessed 
+ * through `image_get_index` and `image_get_pixel`.
+ *
+ * Row zero is always the bottom row of the picture. The storage (`pixels`
+ * or `indices`) holds the rows in file order, which is bottom to top, or
+ * top to bottom when `top_down` is set (negative height in the file); 
+ * `pixel_data` and `image_storage_row` map row indices to storage rows.
  */
 typedef struct Image
 {
     Bmp_header bmp_header; /*!< Header of the bitmap. */
-    Pixel **pixel_data;    /*!< Pixel matrix (jagged array). */
+    Pixel **pixel_data;    /*!< Pixel matrix (row pointers into `pixels`). */
     Color *palette;        /*!< Color palette (array). */
+    Pixel *pixels;         /*!< Contiguous pixel block (64 byte aligned). */
+    size_t stride;         /*!< Distance (in pixels) between two rows. */
+    uint8_t *indices;      /*!< Palette indices (compact storage only). */
+    size_t index_stride;   /*!< Distance (byte) between two index rows. */
+    int top_down;          /*!< Nonzero if rows are stored top to bottom. */
 } Image;
 
+/*!
+ * \brief Structured type for an image in planar layout.
+ *
+ * Each channel is held by its own plane of bytes, so that operations on a 
+ * single channel access contiguous memory. Rows are indexed as in `Image`,
+ * and each row starts on a 64 byte boundary.
+ */
+typedef struct Planar_image
+{
+    Bmp_header bmp_header; /*!< Header of the bitmap. */
+    Color *palette;        /*!< Color palette (array). */
+    uint8_t *planes[4];    /*!< Channel planes, indexed by B, G, R and A. */
+    size_t stride;         /*!< Distance (byte) between two rows of a plane. */
+} Planar_image;
+
+/*!
+ * \brief Read-only view over the pixel data of a memory mapped bitmap file.
+ *
+ * Rows are indexed as in `Image`, with row zero being the bottom row of the
+ * picture, and they hold the raw file data (3 or 4 byte per pixel, in B, G, R
+ * order), padding included.
+ */
+typedef struct Bitmap_view
+{
+    Bmp_header bmp_header; /*!< Header of the bitmap. */
+    const uint8_t *data;   /*!< Start of the row with index zero. */
+    long stride;           /*!< Distance (byte) between two rows. */
+    void *map;             /*!< Base address of the file mapping. */
+    size_t map_size;       /*!< Size (byte) of the file mapping. */
+} Bitmap_view;
+
+/*!
+ * \brief Opaque type for an execution context (a pool of threads).
+ */
+typedef struct Bmp_exec Bmp_exec;
+
+/*!
+ * \brief Type for a function processing a range of rows.
+ * @param ctx User context.
+ * @param begin First row of the range.
+ * @param end Row past the last one of the range.
+ */
+typedef void (*Bmp_rows_fn)(void *ctx, size_t begin, size_t end);
+
+/*!
+ * \brief Opaque type for a streaming, row by row, bitmap reader.
+ */
+typedef struct Bmp_reader Bmp_reader;
+
+/*!
+ * \brief Opaque type for a streaming, row by row, bitmap writer.
+ */
+typedef struct Bmp_writer Bmp_writer;
+
+/*!
+ * \brief Get the SIMD instruction set used by the pixel kernels.
+ * @return The best instruction set supported by the CPU, within the limit
+ *         set by `bmp_set_simd_level(int)`.
+ */
+int bmp_simd_level(void);
+
+/*!
+ * \brief Limit the SIMD instruction set used by the pixel kernels.
+ * @param level Highest instruction set allowed (`BMP_SIMD_NONE` forces the
+ *        scalar code).
+ * @return The instruction set actually in use.
+ */
+int bmp_set_simd_level(int level);
+
+/*!
+ * \brief Create an execution context, used to run pixel operations in
+ *        parallel.
+ * @param threads Number of threads (the calling thread included), or zero
+ *        to use one thread for each online CPU.
+ * @return The execution context, or NULL on failure.
+ * @note The context must be released with `bmp_exec_destroy(Bmp_exec*)`.
+ */
+Bmp_exec* bmp_exec_create(int threads);
+
+/*!
+ * \brief Destroy an execution context, stopping its threads.
+ * @param exec Execution context.
+ */
+void bmp_exec_destroy(Bmp_exec *exec);
+
+/*!
+ * \brief Get the number of threads of an execution context.
+ * @param exec Execution context (NULL for serial execution).
+ * @return Number of threads, the calling one included.
+ */
+int bmp_exec_threads(const Bmp_exec *exec);
+
+/*!
+ * \brief Run a function over all the rows of an image, split in ranges
+ *        processed in parallel.
+ *
+ * The call returns when all the ranges have been processed. Ranges are
+ * disjoint, and each one is processed by a single thread. A parallel loop
+ * started from inside another one is run serially.
+ * @param exec Execution context, or NULL for serial execution.
+ * @param rows Number of rows.
+ * @param grain Number of rows in each range, or zero for a default value.
+ * @param fn Function processing a range of rows.
+ * @param ctx Context passed to the function.
+ */
+void bmp_parallel_for_rows(Bmp_exec *exec, 
+                           size_t rows, 
+                           size_t grain, 
+                           Bmp_rows_fn fn, 
+                           void *ctx);
+
 /*!
  * \brief Allocate resources for a new image object.
  * @param width Image width.
- * @param height Image height.
+ * @param height Image height. A negative value creates an image stored top
+ *        to bottom.
  * @param bpp Bit per pixel.
  * @param colors Number of colors.
  * @return A blank image object.
@@ -162,6 +311,66 @@ void destroy_image(Image *im);
  */
 int copy_image(Image to, Image from);
 
+/*!
+ * \brief Get the palette index of a pixel.
+ * @param image Palette image, in either storage.
+ * @param row Row index.
+ * @param col Column index.
+ * @return The palette index.
+ */
+uint8_t image_get_index(Image image, size_t row, size_t col);
+
+/*!
+ * \brief Set the palette index of a pixel.
+ * @param image Palette image, in either storage.
+ * @param row Row index.
+ * @param col Column index.
+ * @param index Palette index.
+ */
+void image_set_index(Image image, size_t row, size_t col, uint8_t index);
+
+/*!
+ * \brief Map a row index to the position of the row in the storage of an
+ *        image (`pixels` or `indices`).
+ * @param image Image, in either storage.
+ * @param row Row index (zero is the bottom row).
+ * @return Storage row (zero is the first row in memory).
+ */
+size_t image_storage_row(Image image, size_t row);
+
+/*!
+ * \brief Flip an image upside down, without moving its pixel data.
+ *
+ * The storage order is toggled and the row table reversed, so the flipped
+ * image is saved with the same rows in the opposite orientation.
+ * @param image Pointer to the image, in either storage.
+ */
+void image_flip(Image *image);
+
+/*!
+ * \brief Get a pixel.
+ * @param image Image, in either storage.
+ * @param row Row index.
+ * @param col Column index.
+ * @return The pixel (for palette images, only the `i` channel is used).
+ */
+Pixel image_get_pixel(Image image, size_t row, size_t col);
+
+/*!
+ * \brief Convert a compact palette image into `Pixel` storage.
+ * @param image Pointer to the image (unchanged if already in `Pixel` 
+ *        storage).
+ * @return Zero on success, nonzero otherwise.
+ */
+int image_expand(Image *image);
+
+/*!
+ * \brief Convert a palette image into compact storage.
+ * @param image Pointer to the image (unchanged if already compact).
+ * @return Zero on success, nonzero otherwise (e.g. for non palette images).
+ */
+int image_compact(Image *image);
+
 /*!
  * \brief Open a bitmap file.
  * @param filename Filename for the image.
@@ -170,6 +379,143 @@ int copy_image(Image to, Image from);
  */
 Image open_bitmap(const char *filename);
 
+/*!
+ * \brief Open a bitmap file, with options.
+ * @param filename Filename for the image.
+ * @param flags Bitwise OR of `BMP_OPEN_*` flags. With `BMP_OPEN_INDEXED`,
+ *        palette images are loaded in compact storage. With 
+ *        `BMP_OPEN_YCBCR` the colors are converted as by `rgb2ycbcr`, and
+ *        with `BMP_OPEN_LUMA` each color channel is replaced by the luma Y
+ *        (taking precedence over `BMP_OPEN_YCBCR`). Each row is converted
+ *        right after being decoded, and the palette of palette images is 
+ *        converted instead of their pixels.
+ * @param exec Execution context for the decoding, or NULL.
+ * @return The image palette and pixel data.
+ */
+Image open_bitmap_ex(const char *filename, int flags, Bmp_exec *exec);
+
+/*!
+ * \brief Decode a bitmap held in memory.
+ * @param data Content of a bitmap file.
+ * @param size Size (byte) of the content.
+ * @return The image palette and pixel data.
+ */
+Image decode_bitmap_buffer(const uint8_t *data, size_t size);
+
+/*!
+ * \brief Decode a bitmap held in memory, with options.
+ * @param data Content of a bitmap file.
+ * @param size Size (byte) of the content.
+ * @param flags Bitwise OR of `BMP_OPEN_*` flags (see `open_bitmap_ex`).
+ * @param exec Execution context for the decoding, or NULL.
+ * @return The image palette and pixel data.
+ */
+Image decode_bitmap_buffer_ex(const uint8_t *data, 
+                              size_t size, 
+                              int flags, 
+                              Bmp_exec *exec);
+
+/*!
+ * \brief Read the headers of a bitmap file, without decoding its pixels.
+ *
+ * The file header and the bitmap header are fetched with a single read of
+ * 138 bytes, and checked for consistency: image size and planes, number of
+ * colors against the bpp, offset of the pixel data, size of the 
+ * uncompressed pixel data (`image_size` against width, bpp and row 
+ * padding) and file size.
+ * @param filename Name of the file.
+ * @param header Pointer to store the bitmap header (zeroed on failure).
+ * @return Zero on success, nonzero if the file cannot be read or it is not
+ *         a consistent bitmap.
+ */
+int probe_bitmap(const char *filename, Bmp_header *header);
+
+/*!
+ * \brief Map a bitmap file in memory, without decoding its pixels.
+ * @param filename Filename for the image.
+ * @return A read-only view over the pixel rows of the file. On failure,
+ *         the `data` field of the view is NULL.
+ * @note Only uncompressed (BI_RGB) 24 and 32 bit images are supported.
+ * @note The view must be released with `close_bitmap_mmap(Bitmap_view*)`.
+ */
+Bitmap_view open_bitmap_mmap(const char *filename);
+
+/*!
+ * \brief Release the mapping of a bitmap view.
+ * @param view Pointer to the view to release.
+ */
+void close_bitmap_mmap(Bitmap_view *view);
+
+/*!
+ * \brief Get a row of a bitmap view.
+ * @param view Bitmap view.
+ * @param row Row index (zero is the bottom row).
+ * @return Pointer to the raw data of the row.
+ */
+const uint8_t* view_row(Bitmap_view view, size_t row);
+
+/*!
+ * \brief Read a pixel from a bitmap view.
+ * @param view Bitmap view.
+ * @param row Row index (zero is the bottom row).
+ * @param col Column index.
+ * @return The pixel value.
+ */
+Pixel view_pixel(Bitmap_view view, size_t row, size_t col);
+
+/*!
+ * \brief Open a bitmap file for reading it row by row.
+ *
+ * Only the headers and the palette are read on opening. Rows are then
+ * decoded a small window at a time, so the memory used by the reader does
+ * not depend on the image height.
+ * @param filename Filename for the image.
+ * @return A reader object, or NULL on failure.
+ * @note The reader must be released with `bmp_reader_close(Bmp_reader*)`.
+ */
+Bmp_reader* bmp_reader_open(const char *filename);
+
+/*!
+ * \brief Get the header of the bitmap under reading.
+ * @param reader Reader object.
+ * @return Pointer to the bitmap header.
+ */
+const Bmp_header* bmp_reader_header(const Bmp_reader *reader);
+
+/*!
+ * \brief Get the palette of the bitmap under reading.
+ * @param reader Reader object.
+ * @return Pointer to the palette, or NULL when the image has no palette.
+ */
+const Color* bmp_reader_palette(const Bmp_reader *reader);
+
+/*!
+ * \brief Get the row order of the bitmap under reading.
+ * @param reader Reader object.
+ * @return Nonzero if rows are stored top to bottom (negative height in the
+ *         file), zero otherwise. The height in the header is positive in
+ *         both cases.
+ */
+int bmp_reader_top_down(const Bmp_reader *reader);
+
+/*!
+ * \brief Decode the next rows of a bitmap.
+ * @param reader Reader object.
+ * @param n Number of rows to be read.
+ * @param dst Output buffer, with room for `n * width` pixels. Rows are
+ *        stored one after the other, in file order (bottom to top, or top
+ *        to bottom for top-down bitmaps).
+ * @return Number of rows actually read, less than `n` at the end of the 
+ *         image or on failure.
+ */
+size_t bmp_reader_next_rows(Bmp_reader *reader, size_t n, Pixel *dst);
+
+/*!
+ * \brief Close a reader and release its resources.
+ * @param reader Reader object.
+ */
+void bmp_reader_close(Bmp_reader *reader);
+
 /*!
  * \brief Save a bitmap image.
  * @param image Data for the bitmap.
@@ -178,13 +524,140 @@ Image open_bitmap(const char *filename);
  */
 int save_bitmap(Image image, const char *filename);
 
+/*!
+ * \brief Save a bitmap image, with options.
+ *
+ * Channels of 16 and 32 bit images are quantized to the width of their 
+ * color masks, rounding to the nearest level unless `BMP_SAVE_TRUNCATE` is
+ * set. With `BMP_SAVE_FROM_YCBCR` the image colors (or the palette colors
+ * of palette images) are converted from Y'CbCr as by `ycbcr2rgb`, one row
+ * at a time right before encoding, leaving the image untouched. With 
+ * `BMP_SAVE_RLE` 8 and 4 bit images are run length encoded (`BI_RLE8` and
+ * `BI_RLE4`), while other images are stored uncompressed. Without it, all
+ * the images are stored uncompressed. Images stored top to bottom are saved
+ * as top-down bitmaps (negative height), which are never compressed.
+ * @param image Data for the bitmap.
+ * @param filename Name for the output file.
+ * @param flags Bitwise OR of `BMP_SAVE_*` flags.
+ * @param exec Execution context for the encoding, or NULL.
+ * @return Zero on success, nonzero on failure.
+ */
+int save_bitmap_ex(Image image, 
+                   const char *filename, 
+                   int flags, 
+                   Bmp_exec *exec);
+
+/*!
+ * \brief Get the exact size of the file encoding an image, as written by
+ *        `save_bitmap` and `encode_bitmap_buffer`.
+ * @param image Image.
+ * @return Size (byte).
+ */
+size_t encode_bitmap_size(Image image);
+
+/*!
+ * \brief Get the exact size of the file encoding an image, with options.
+ * @param image Image.
+ * @param flags Bitwise OR of `BMP_SAVE_*` flags (see `save_bitmap_ex`).
+ * @return Size (byte), or zero on failure.
+ * @note With `BMP_SAVE_RLE` the size depends on the content, and the image
+ *       is encoded (without output) to compute it.
+ */
+size_t encode_bitmap_size_ex(Image image, int flags);
+
+/*!
+ * \brief Encode an image into a memory buffer, in the format of 
+ *        `save_bitmap`.
+ * @param image Data for the bitmap.
+ * @param out Output buffer.
+ * @param size Size (byte) of the buffer, at least `encode_bitmap_size`.
+ * @return Zero on success, nonzero on failure.
+ */
+int encode_bitmap_buffer(Image image, uint8_t *out, size_t size);
+
+/*!
+ * \brief Encode an image into a memory buffer, with options.
+ * @param image Data for the bitmap.
+ * @param out Output buffer.
+ * @param size Size (byte) of the buffer, at least `encode_bitmap_size_ex`.
+ * @param flags Bitwise OR of `BMP_SAVE_*` flags (see `save_bitmap_ex`).
+ * @param exec Execution context for the encoding, or NULL.
+ * @return Zero on success, nonzero on failure.
+ */
+int encode_bitmap_buffer_ex(Image image, 
+                            uint8_t *out, 
+                            size_t size, 
+                            int flags, 
+                            Bmp_exec *exec);
+
+/*!
+ * \brief Create a bitmap file for writing it row by row.
+ *
+ * Headers and palette are written on opening. Rows are then encoded a small
+ * window at a time, so the producer never needs to hold the full image.
+ * @param filename Name for the output file.
+ * @param header Header of the bitmap. The image size is computed from
+ *        width, height and bit per pixel. A negative height makes a 
+ *        top-down bitmap, whose rows are written from top to bottom (and
+ *        which is never run length encoded).
+ * @param palette Color palette (`header->color_no` entries), or NULL when
+ *        the image has no palette.
+ * @param flags Saving flags (see `save_bitmap_ex`).
+ * @return A writer object, or NULL on failure.
+ * @note The writer must be released with `bmp_writer_close(Bmp_writer*)`.
+ */
+Bmp_writer* bmp_writer_open(const char *filename, 
+                            const Bmp_header *header, 
+                            const Color *palette,
+                            int flags);
+
+/*!
+ * \brief Encode and write the next rows of a bitmap.
+ * @param writer Writer object.
+ * @param n Number of rows to be written.
+ * @param src Input rows (`n * width` pixels), stored one after the other in
+ *        file order (bottom to top, or top to bottom for top-down bitmaps).
+ * @return Zero on success, nonzero on failure.
+ */
+int bmp_writer_write_rows(Bmp_writer *writer, size_t n, const Pixel *src);
+
+/*!
+ * \brief Close a writer and release its resources.
+ * @param writer Writer object.
+ * @return Zero if the whole image was written successfully, nonzero 
+ *         otherwise.
+ */
+int bmp_writer_close(Bmp_writer *writer);
+
 /*!
  * \brief Return a human readable dump of the image properties.
  * @param image Bitmap image.
- * @return A string containing the dump.
+ * @return A string containing the dump, or NULL on failure.
+ * @note The returned string must be deallocated with `free(void*)`.
  */                                                             
 char* bmp_dump(Image image);
 
+/*!
+ * \brief Write a human readable dump of the image properties to a stream, 
+ *        in the format of `bmp_dump`.
+ * @param stream Output stream.
+ * @param image Bitmap image.
+ * @return Zero on success, nonzero on write error.
+ */
+int bmp_dump_to(FILE *stream, Image image);
+
+/*!
+ * \brief Write the image properties to a stream as a JSON object.
+ *
+ * The object is written on a single line, followed by a newline, with one
+ * member for each field of the header (named after the field) and a 
+ * `palette` array of `[r, g, b, a]` entries.
+ * @param stream Output stream.
+ * @param image Bitmap image.
+ * @return Zero on success, nonzero on write error.
+ */
+int bmp_dump_json(FILE *stream, Image image);
+
 /*!
  * \brief Return a string containing an ASCII art print of a
  *        two colors image.
@@ -200,14 +673,108 @@ char* ascii_print(Image image);
  */
 unsigned long* histogram(Image image, const int channel);
 
+/*!
+ * \brief Get the histograms of all the channels, in a single pass.
+ * @param image Image.
+ * @param out Array to store the histograms, indexed by channel (B, G, R, A)
+ *        and level.
+ * @return Zero on success.
+ */
+int histogram_all(Image image, unsigned long out[4][256]);
+
+/*!
+ * \brief Get the histograms of all the channels, in a single parallel pass.
+ * @param image Image.
+ * @param out Array to store the histograms, indexed by channel (B, G, R, A)
+ *        and level.
+ * @param exec Execution context, or NULL.
+ * @return Zero on success.
+ */
+int histogram_all_ex(Image image, unsigned long out[4][256], Bmp_exec *exec);
+
+/*!
+ * \brief Remap a channel through a lookup table (e.g. for gamma correction,
+ *        levels adjustment or inversion).
+ * @param image Target image.
+ * @param channel Channel to be remapped.
+ * @param lut New value for each level of the channel.
+ * @return Zero on success.
+ * @note For compact images only the index channel (A) can be remapped. 
+ *       New indices of palette images are clamped to the last color.
+ */
+int apply_lut(Image image, const int channel, const uint8_t lut[256]);
+
+/*!
+ * \brief Remap a channel through a lookup table, in parallel.
+ * @param image Target image.
+ * @param channel Channel to be remapped.
+ * @param lut New value for each level of the channel.
+ * @param exec Execution context, or NULL.
+ * @return Zero on success.
+ */
+int apply_lut_ex(Image image, 
+                 const int channel, 
+                 const uint8_t lut[256], 
+                 Bmp_exec *exec);
+
 /*!
  * \brief Apply an histogram equalization algorithm.
  * @param image Target image.
  * @param channel Channel to be equalized.
  * @return Zero on success.
+ * @note The indices (A) of palette images are spread over the palette.
  */
 int equalize(Image image, const int channel);
 
+/*!
+ * \brief Apply an histogram equalization algorithm, in parallel.
+ * @param image Target image.
+ * @param channel Channel to be equalized.
+ * @param exec Execution context, or NULL.
+ * @return Zero on success.
+ */
+int equalize_ex(Image image, const int channel, Bmp_exec *exec);
+
+/*!
+ * \brief Apply a contrast limited adaptive histogram equalization (CLAHE).
+ *
+ * The image is split in a grid of tiles, each one equalized with its own
+ * clipped histogram, and the mappings of the four nearest tiles are 
+ * bilinearly interpolated at each pixel.
+ * @param image Target image (compact images are not supported).
+ * @param channel Channel to be equalized.
+ * @param tiles_x Number of tile columns.
+ * @param tiles_y Number of tile rows.
+ * @param clip_limit Maximum bin count, relative to the average count of a
+ *        bin in a tile (e.g. 2.0 to 4.0), or a non positive value to 
+ *        disable clipping.
+ * @return Zero on success.
+ */
+int clahe(Image image, 
+          const int channel, 
+          int tiles_x, 
+          int tiles_y, 
+          float clip_limit);
+
+/*!
+ * \brief Apply a contrast limited adaptive histogram equalization (CLAHE),
+ *        in parallel.
+ * @param image Target image (compact images are not supported).
+ * @param channel Channel to be equalized.
+ * @param tiles_x Number of tile columns.
+ * @param tiles_y Number of tile rows.
+ * @param clip_limit Maximum bin count, relative to the average count of a
+ *        bin in a tile, or a non positive value to disable clipping.
+ * @param exec Execution context, or NULL.
+ * @return Zero on success.
+ */
+int clahe_ex(Image image, 
+             const int channel, 
+             int tiles_x, 
+             int tiles_y, 
+             float clip_limit,
+             Bmp_exec *exec);
+
 /*!
  * \brief Convert image from RGB to a Y'CbCr color space.
  * @param image Image to be converted.
@@ -215,6 +782,14 @@ int equalize(Image image, const int channel);
  */
 int rgb2ycbcr(Image image);
 
+/*!
+ * \brief Convert image from RGB to a Y'CbCr color space, in parallel.
+ * @param image Image to be converted.
+ * @param exec Execution context, or NULL.
+ * @return Zero on success.
+ */
+int rgb2ycbcr_ex(Image image, Bmp_exec *exec);
+
 /*!
  * \brief Convert image from Y'CbCr to RGB color space.
  * @param image Image to be converted.
@@ -222,6 +797,218 @@ int rgb2ycbcr(Image image);
  */
 int ycbcr2rgb(Image image);
 
+/*!
+ * \brief Convert image from Y'CbCr to RGB color space, in parallel.
+ * @param image Image to be converted.
+ * @param exec Execution context, or NULL.
+ * @return Zero on success.
+ */
+int ycbcr2rgb_ex(Image image, Bmp_exec *exec);
+
+/*!
+ * \brief Convert an image into planar layout.
+ * @param image Image (in either storage).
+ * @return A planar copy of the image, with NULL planes on failure.
+ * @note The object must be deallocated with 
+ *       `destroy_planar_image(Planar_image*)`.
+ */
+Planar_image image_to_planar(Image image);
+
+/*!
+ * \brief Copy the pixels of a planar image into an image.
+ * @param planar Planar image.
+ * @param image Target image, with the same size and in pixel storage.
+ * @return Zero on success.
+ */
+int planar_to_image(Planar_image planar, Image image);
+
+/*!
+ * \brief Deallocate the resources of a planar image.
+ * @param planar Planar image to be destroyed.
+ */
+void destroy_planar_image(Planar_image *planar);
+
+/*!
+ * \brief Get the histogram for a channel of a planar image.
+ * @param planar Planar image.
+ * @param channel Channel.
+ * @return Histogram (256 levels), to be deallocated with `free(void*)`, or
+ *         NULL on failure.
+ */
+unsigned long* planar_histogram(Planar_image planar, const int channel);
+
+/*!
+ * \brief Remap a channel of a planar image through a lookup table.
+ * @param planar Target planar image.
+ * @param channel Channel to be remapped.
+ * @param lut New value for each level of the channel.
+ * @return Zero on success.
+ */
+int planar_apply_lut(Planar_image planar, const int channel, const uint8_t lut[256]);
+
+/*!
+ * \brief Remap a channel of a planar image through a lookup table, in 
+ *        parallel.
+ * @param planar Target planar image.
+ * @param channel Channel to be remapped.
+ * @param lut New value for each level of the channel.
+ * @param exec Execution context, or NULL.
+ * @return Zero on success.
+ */
+int planar_apply_lut_ex(Planar_image planar, 
+                        const int channel, 
+                        const uint8_t lut[256], 
+                        Bmp_exec *exec);
+
+/*!
+ * \brief Apply an histogram equalization algorithm to a planar image.
+ * @param planar Target planar image.
+ * @param channel Channel to be equalized.
+ * @return Zero on success.
+ */
+int planar_equalize(Planar_image planar, const int channel);
+
+/*!
+ * \brief Apply an histogram equalization algorithm to a planar image, in
+ *        parallel.
+ * @param planar Target planar image.
+ * @param channel Channel to be equalized.
+ * @param exec Execution context, or NULL.
+ * @return Zero on success.
+ */
+int planar_equalize_ex(Planar_image planar, const int channel, Bmp_exec *exec);
+
+/*!
+ * \brief Convert a planar image from RGB to Y'CbCr, as `rgb2ycbcr`.
+ * @param planar Planar image to be converted.
+ * @return Zero on success.
+ */
+int planar_rgb2ycbcr(Planar_image planar);
+
+/*!
+ * \brief Convert a planar image from RGB to Y'CbCr, in parallel.
+ * @param planar Planar image to be converted.
+ * @param exec Execution context, or NULL.
+ * @return Zero on success.
+ */
+int planar_rgb2ycbcr_ex(Planar_image planar, Bmp_exec *exec);
+
+/*!
+ * \brief Convert a planar image from Y'CbCr to RGB, as `ycbcr2rgb`.
+ * @param planar Planar image to be converted.
+ * @return Zero on success.
+ */
+int planar_ycbcr2rgb(Planar_image planar);
+
+/*!
+ * \brief Convert a planar image from Y'CbCr to RGB, in parallel.
+ * @param planar Planar image to be converted.
+ * @param exec Execution context, or NULL.
+ * @return Zero on success.
+ */
+int planar_ycbcr2rgb_ex(Planar_image planar, Bmp_exec *exec);
+
+/*!
+ * \brief Get the maximum size of a payload hidden with 
+ *        `steganography_embed`.
+ * @param image Image.
+ * @param bits Number of low bits used in each color channel (1 to 4).
+ * @return Maximum payload size (byte).
+ */
+size_t steganography_capacity(Image image, int bits);
+
+/*!
+ * \brief Hide binary data inside a bitmap, in the low bits of the color 
+ *        channels.
+ * @param image Must be a 16 bit or higher color image, in pixel storage.
+ * @param data Payload.
+ * @param len Payload size (byte), up to `steganography_capacity`.
+ * @param bits Number of low bits used in each color channel (1 to 4). 
+ *        With one bit, the layout is the one of `steganography_write`.
+ * @return Zero on success.
+ */
+int steganography_embed(Image image, const void *data, size_t len, int bits);
+
+/*!
+ * \brief Hide binary data inside a bitmap, in parallel.
+ * @param image Must be a 16 bit or higher color image, in pixel storage.
+ * @param data Payload, or NULL to write only its length, leaving random bits
+ *        in its place to be overwritten by `steganography_embed_range`.
+ * @param len Payload size (byte), up to `steganography_capacity`.
+ * @param bits Number of low bits used in each color channel (1 to 4).
+ * @param exec Execution context, or NULL.
+ * @return Zero on success.
+ */
+int steganography_embed_ex(Image image,
+                           const void *data,
+                           size_t len,
+                           int bits,
+                           Bmp_exec *exec);
+
+/*!
+ * \brief Overwrite a part of the payload hidden inside a bitmap, leaving
+ *        the rest of the image untouched.
+ * @param image Image containing a payload (16 bit or higher, in pixel
+ *        storage).
+ * @param data New bytes of the payload.
+ * @param offset Position of the first byte in the payload (byte).
+ * @param len Number of bytes.
+ * @param bits Number of low bits used in each color channel (1 to 4).
+ * @return Zero on success.
+ * @note The stored length is not read nor changed. Calls on disjoint parts
+ *       of the payload can run concurrently when the boundaries of the 
+ *       parts fall between channels, which is always the case with 1, 2 or
+ *       4 bits, and with 3 bits when `offset + 4` and `offset + len + 4` 
+ *       are multiples of 3.
+ */
+int steganography_embed_range(Image image,
+                              const void *data,
+                              size_t offset,
+                              size_t len,
+                              int bits);
+
+/*!
+ * \brief Read binary data hidden inside a bitmap.
+ * @param image Image containing the payload (must be 16 bit or higher).
+ * @param len Pointer to store the payload size (byte), or NULL.
+ * @param bits Number of low bits used in each color channel (1 to 4), as 
+ *        given when embedding.
+ * @return Pointer to the payload (followed by a zero byte), or NULL on 
+ *         failure.
+ * @note If the image does not contain a payload, the call may fail or it 
+ *       may return garbage.
+ * @note The returned buffer must be deallocated with `free(void*)`.
+ */
+void* steganography_extract(Image image, size_t *len, int bits);
+
+/*!
+ * \brief Read binary data hidden inside a bitmap, in parallel.
+ * @param image Image containing the payload (must be 16 bit or higher).
+ * @param len Pointer to store the payload size (byte), or NULL.
+ * @param bits Number of low bits used in each color channel (1 to 4).
+ * @param exec Execution context, or NULL.
+ * @return Pointer to the payload (followed by a zero byte), or NULL on 
+ *         failure.
+ */
+void* steganography_extract_ex(Image image, size_t *len, int bits, Bmp_exec *exec);
+
+/*!
+ * \brief Read a part of the payload hidden inside a bitmap.
+ * @param image Image containing the payload (must be 16 bit or higher).
+ * @param data Output buffer, of at least `len` bytes.
+ * @param offset Position of the first byte in the payload (byte).
+ * @param len Number of bytes.
+ * @param bits Number of low bits used in each color channel (1 to 4).
+ * @return Zero on success.
+ * @note Only the channels holding the part are read, so the cost does not 
+ *       depend on the offset. The stored length is not checked.
+ */
+int steganography_extract_range(Image image,
+                                void *data,
+                                size_t offset,
+                                size_t len,
+                                int bits);
+
 /*!
  * \brief Hide a text message inside a bitmap.
  * @param image Must be a 16 bit or higher color image.
@@ -0,0 +1,583 @@
+/*
+ * Check of the SIMD kernels of the library against the scalar code.
+ *
+ * The decoding of test_images/24bit.bmp is first checked against a digest
+ * of its pixels, taken with the original per pixel decoder, and its
+ * encoding against the file itself. Then each case (decoding and encoding,
+ * lookup tables, Y'CbCr and luma conversions, planar split and merge,
+ * steganography) is run on test_images/24bit.bmp and on synthetic 1, 24
+ * and 32 bit images of each width from 1 to 69 pixels, so that every kernel
+ * also meets its scalar tail. The output of each case at each SIMD level
+ * supported by the CPU must match, byte for byte, its output at
+ * BMP_SIMD_NONE:
+ *
+ *   gcc -O2 -pthread simd_test.c bitmap.c -o simd_test && ./simd_test
+ *
+ * Run from the root of the repository. Temporary files are written to
+ * $TMPDIR (default: /tmp). The exit status is nonzero if any check fails.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "bitmap.h"
+
+/* FNV-1a digest of the B, G, R bytes of the pixels of test_images/24bit.bmp
+ * (bottom row first), as decoded by the original code. */
+#define REFERENCE_DIGEST 0x7f665a3c5cc8039cull
+
+/* Widest synthetic image (px). */
+#define MAX_WIDTH 69
+
+/* Bytes produced by a case. */
+typedef struct Output
+{
+    uint8_t *data;
+    size_t size;
+    int failed;    /* nonzero if a function failed or memory ran out */
+} Output;
+
+/* An input file. */
+typedef struct Input
+{
+    char name[32];
+    char path[256];
+    int bpp;
+} Input;
+
+static char out_path[256]; /* file for the encoded outputs */
+
+/* Update a FNV-1a digest. */
+static uint64_t fnv1a(uint64_t h, const uint8_t *data, size_t size)
+{
+    while (size--)
+    {
+        h ^= *data++;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+/* Fill a buffer with pseudo random bytes from a seed. */
+static void fill_random(uint8_t *data, size_t size, uint32_t s)
+{
+    while (size--)
+    {
+        s ^= s << 13;
+        s ^= s >> 17;
+        s ^= s << 5;
+        *data++ = (uint8_t) s;
+    }
+}
+
+/* Read a whole file. */
+static uint8_t* read_file(const char *path, size_t *size)
+{
+    FILE *f = fopen(path, "rb");
+    uint8_t *data = NULL;
+    long n;
+
+    if (f
+            && !fseek(f, 0, SEEK_END)
+            && (n = ftell(f)) > 0
+            && !fseek(f, 0, SEEK_SET)
+            && (data = (uint8_t*) malloc(n))
+            && fread(data, 1, n, f) == (size_t) n)
+    {
+        *size = n;
+    }
+    else
+    {
+        free(data);
+        data = NULL;
+    }
+
+    if (f)
+        fclose(f);
+    return data;
+}
+
+/* Append bytes to an output. */
+static void append(Output *o, const void *data, size_t size)
+{
+    uint8_t *grown = (uint8_t*) realloc(o->data, o->size + size);
+
+    if (!grown)
+    {
+        o->failed = 1;
+        return;
+    }
+    memcpy(grown + o->size, data, size);
+    o->data = grown;
+    o->size += size;
+}
+
+/* Append the pixels of an image, then the file encoding it. */
+static void append_image(Output *o, Image image, int flags)
+{
+    uint8_t *file;
+    size_t size, i;
+
+    if (!image.pixel_data)
+    {
+        o->failed = 1;
+        return;
+    }
+
+    for (i = 0; i < image.bmp_header.height; ++i)
+        append(o, image.pixel_data[i], image.bmp_header.width * sizeof (Pixel));
+
+    if (save_bitmap_ex(image, out_path, flags, NULL)
+            || !(file = read_file(out_path, &size)))
+    {
+        o->failed = 1;
+        return;
+    }
+    append(o, file, size);
+    free(file);
+}
+
+/* Append the color planes of a planar image. */
+static void append_planes(Output *o, Planar_image planar)
+{
+    size_t i;
+    int c;
+
+    for (c = B; c <= R; ++c)
+    {
+        if (!planar.planes[c])
+        {
+            o->failed = 1;
+            return;
+        }
+        for (i = 0; i < planar.bmp_header.height; ++i)
+            append(o, planar.planes[c] + i * planar.stride,
+                   planar.bmp_header.width);
+    }
+}
+
+/* Decoding and encoding. */
+static void run_codec(const Input *in, Output *o)
+{
+    Image image = open_bitmap(in->path);
+
+    append_image(o, image, 0);
+    destroy_image(&image);
+}
+
+/* Lookup tables on each color channel. */
+static void run_lut(const Input *in, Output *o)
+{
+    Image image = open_bitmap(in->path);
+    uint8_t lut[256];
+    int i, c;
+
+    for (c = B; c <= R && image.pixel_data; ++c)
+    {
+        for (i = 0; i < 256; ++i)
+            lut[i] = (uint8_t) (i * (2 * c + 3) + 17 * c);
+        if (apply_lut(image, c, lut))
+            o->failed = 1;
+    }
+    append_image(o, image, 0);
+    destroy_image(&image);
+}
+
+/* Conversion into Y'CbCr and back. */
+static void run_ycbcr(const Input *in, Output *o)
+{
+    Image image = open_bitmap(in->path);
+
+    if (image.pixel_data && rgb2ycbcr(image))
+        o->failed = 1;
+    append_image(o, image, 0);
+    if (image.pixel_data && ycbcr2rgb(image))
+        o->failed = 1;
+    append_image(o, image, 0);
+    destroy_image(&image);
+}
+
+/* Decoding into Y'CbCr, and encoding back into RGB. */
+static void run_decode_ycbcr(const Input *in, Output *o)
+{
+    Image image = open_bitmap_ex(in->path, BMP_OPEN_YCBCR, NULL);
+
+    append_image(o, image, BMP_SAVE_FROM_YCBCR);
+    destroy_image(&image);
+}
+
+/* Decoding into luma. */
+static void run_decode_luma(const Input *in, Output *o)
+{
+    Image image = open_bitmap_ex(in->path, BMP_OPEN_LUMA, NULL);
+
+    append_image(o, image, 0);
+    destroy_image(&image);
+}
+
+/* Split into planes, planar operations and merge. */
+static void run_planar(const Input *in, Output *o)
+{
+    Image image = open_bitmap(in->path);
+    Planar_image planar = image_to_planar(image);
+    uint8_t lut[256];
+    int i;
+
+    for (i = 0; i < 256; ++i)
+        lut[i] = (uint8_t) (255 - i);
+
+    append_planes(o, planar);
+    if (!o->failed && (planar_apply_lut(planar, G, lut)
+                       || planar_rgb2ycbcr(planar)
+                       || planar_ycbcr2rgb(planar)))
+        o->failed = 1;
+    append_planes(o, planar);
+
+    if (!o->failed && planar_to_image(planar, image))
+        o->failed = 1;
+    append_image(o, image, 0);
+
+    destroy_planar_image(&planar);
+    destroy_image(&image);
+}
+
+/* Append the pixels of an image, with the low bits of the color channels
+ * cleared. */
+static void append_high_bits(Output *o, Image image, int bits)
+{
+    uint8_t keep = (uint8_t) (0xFF << bits);
+    uint8_t *row = (uint8_t*) malloc(3 * image.bmp_header.width + 1);
+    size_t i, j;
+
+    if (!row)
+    {
+        o->failed = 1;
+        return;
+    }
+
+    for (i = 0; i < image.bmp_header.height; ++i)
+    {
+        for (j = 0; j < image.bmp_header.width; ++j)
+        {
+            row[3 * j] = image.pixel_data[i][j].b & keep;
+            row[3 * j + 1] = image.pixel_data[i][j].g & keep;
+            row[3 * j + 2] = image.pixel_data[i][j].r & keep;
+        }
+        append(o, row, 3 * image.bmp_header.width);
+    }
+    free(row);
+}
+
+/* Payloads of 1 to 4 bits per channel filling the image: embedded and
+ * extracted whole, then overwritten and read back by ranges of 5 and 3
+ * bytes. The bits past the payload are random, so the output holds the
+ * extracted payloads and the untouched high bits of the channels. */
+static void run_steganography(const Input *in, Output *o)
+{
+    uint8_t *payload, *ranged, *read;
+    size_t cap, len, k, n;
+    int bits;
+
+    for (bits = 1; bits <= 4; ++bits)
+    {
+        Image image = open_bitmap(in->path);
+
+        /* images too small for the length of the payload */
+        cap = image.pixel_data ? steganography_capacity(image, bits) : 0;
+        if (image.pixel_data && !cap)
+        {
+            destroy_image(&image);
+            continue;
+        }
+
+        payload = (uint8_t*) malloc(cap);
+        ranged = (uint8_t*) malloc(cap);
+        read = NULL;
+        if (!image.pixel_data || !payload || !ranged)
+        {
+            o->failed = 1;
+        }
+        else
+        {
+            fill_random(payload, cap, 2463534242u + bits);
+            fill_random(ranged, cap, 88675123u + bits);
+
+            if (steganography_embed(image, payload, cap, bits)
+                    || !(read = (uint8_t*) steganography_extract(image, &len,
+                                                                 bits))
+                    || len != cap
+                    || memcmp(read, payload, cap))
+                o->failed = 1;
+
+            for (k = 0; k < cap && !o->failed; k += n)
+            {
+                n = cap - k < 5 ? cap - k : 5;
+                if (steganography_embed_range(image, ranged + k, k, n, bits))
+                    o->failed = 1;
+            }
+            for (k = 0; k < cap && !o->failed; k += n)
+            {
+                n = cap - k < 3 ? cap - k : 3;
+                if (steganography_extract_range(image, read + k, k, n, bits))
+                    o->failed = 1;
+            }
+            if (!o->failed && memcmp(read, ranged, cap))
+                o->failed = 1;
+
+            if (!o->failed)
+                append(o, read, cap);
+            append_high_bits(o, image, bits);
+        }
+
+        free(payload);
+        free(ranged);
+        free(read);
+        destroy_image(&image);
+    }
+}
+
+/* A test case. */
+typedef struct Case
+{
+    const char *name;
+    void (*fn)(const Input *in, Output *o);
+    int min_bpp;   /* lowest bpp supported */
+} Case;
+
+static const Case cases[] = {
+    {"codec",         run_codec,         1},
+    {"lut",           run_lut,           16},
+    {"ycbcr",         run_ycbcr,         16},
+    {"decode_ycbcr",  run_decode_ycbcr,  1},
+    {"decode_luma",   run_decode_luma,   1},
+    {"planar",        run_planar,        16},
+    {"steganography", run_steganography, 16},
+};
+
+/* Check the decoding and the encoding of test_images/24bit.bmp at the
+ * current level. Return nonzero on failure. */
+static int check_reference(const char *path)
+{
+    Image image = open_bitmap(path);
+    uint8_t *file = NULL, *saved = NULL;
+    uint64_t h = 14695981039346656037ull;
+    size_t size = 0, saved_size = 0, i, j;
+    int res;
+
+    if (!image.pixel_data)
+        return 1;
+
+    for (i = 0; i < image.bmp_header.height; ++i)
+        for (j = 0; j < image.bmp_header.width; ++j)
+            h = fnv1a(h, (const uint8_t*) &image.pixel_data[i][j], 3);
+
+    res = h != REFERENCE_DIGEST
+            || save_bitmap(image, out_path)
+            || !(file = read_file(path, &size))
+            || !(saved = read_file(out_path, &saved_size))
+            || saved_size != size
+            || memcmp(saved, file, size);
+
+    free(file);
+    free(saved);
+    destroy_image(&image);
+    return res;
+}
+
+/* Save a synthetic image with pseudo random pixels (palette indices for 1
+ * bit images), with the scalar code. */
+/*
+ * \brief Decode and encode a RGB565 bitmap, whose color masks follow a 
+ *        40 byte header, and check that it is rejected without masks.
+ * @return Zero on success, nonzero otherwise.
+ */
+static int check_bitfields(void)
+{
+    /* 2x1 image: a green and a red pixel */
+    uint8_t file[] = {
+        'B', 'M', 70, 0, 0, 0, 0, 0, 0, 0, 66, 0, 0, 0,
+        40, 0, 0, 0, 2, 0, 0, 0, 1, 0, 0, 0, 1, 0, 16, 0, 3, 0, 0, 0,
+        4, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0x00, 0xF8, 0, 0, 0xE0, 0x07, 0, 0, 0x1F, 0, 0, 0,
+        0xE0, 0x07, 0x00, 0xF8
+    };
+    uint8_t out[sizeof file];
+    Image image = decode_bitmap_buffer(file, sizeof file);
+    const Pixel *p;
+    int res;
+
+    if (!image.pixel_data)
+        return 1;
+
+    p = image.pixel_data[0];
+    res = p[0].r != 0 || p[0].g != 255 || p[0].b != 0
+            || p[1].r != 255 || p[1].g != 0 || p[1].b != 0
+            || encode_bitmap_size(image) != sizeof file
+            || encode_bitmap_buffer(image, out, sizeof out)
+            || memcmp(out, file, sizeof file);
+    destroy_image(&image);
+
+    memset(file + 54, 0, 12);
+    image = decode_bitmap_buffer(file, sizeof file);
+    if (image.pixel_data)
+        res = 1;
+    destroy_image(&image);
+
+    return res;
+}
+
+static int make_input(Input *in, const char *dir, int width, int bpp,
+                      uint32_t *s)
+{
+    Image image = new_image(width, 5, bpp, bpp == 1 ? 2 : 0);
+    size_t i, j;
+    int res;
+
+    if (!image.pixel_data)
+        return 1;
+
+    if (bpp == 1)
+    {
+        image.palette[0].r = image.palette[0].g = image.palette[0].b = 255;
+        image.palette[1].r = 40;
+        image.palette[1].g = 80;
+        image.palette[1].b = 120;
+    }
+
+    for (i = 0; i < image.bmp_header.height; ++i)
+    {
+        for (j = 0; j < image.bmp_header.width; ++j)
+        {
+            *s ^= *s << 13;
+            *s ^= *s >> 17;
+            *s ^= *s << 5;
+            if (bpp == 1)
+                image.pixel_data[i][j].i = *s & 1;
+            else
+                memcpy(&image.pixel_data[i][j], s, sizeof (Pixel));
+            if (bpp == 24)
+                image.pixel_data[i][j].i = 0;
+        }
+    }
+
+    snprintf(in->name, sizeof in->name, "%dx5, %d bit", width, bpp);
+    snprintf(in->path, sizeof in->path, "%s/simd_test_%ld_%d_%d.bmp",
+             dir, (long) getpid(), width, bpp);
+    in->bpp = bpp;
+    res = save_bitmap(image, in->path);
+
+    destroy_image(&image);
+    return res;
+}
+
+int main(void)
+{
+    const char *reference = "./test_images/24bit.bmp";
+    const int bpps[] = {1, 24, 32};
+    const size_t cases_no = sizeof cases / sizeof *cases;
+    const size_t bpps_no = sizeof bpps / sizeof *bpps;
+    Input inputs[1 + MAX_WIDTH * (sizeof bpps / sizeof *bpps)];
+    size_t inputs_no = 0, i, k;
+    const char *dir = getenv("TMPDIR");
+    uint32_t s = 2463534242u;
+    int max_level = bmp_simd_level();
+    int checks = 0, failures = 0, level, width;
+
+    if (!dir || !*dir)
+        dir = "/tmp";
+    snprintf(out_path, sizeof out_path, "%s/simd_test_%ld.bmp",
+             dir, (long) getpid());
+
+    /* the reference is checked at every level, the scalar one included */
+    for (level = BMP_SIMD_NONE; level <= max_level; ++level)
+    {
+        bmp_set_simd_level(level);
+        ++checks;
+        if (check_reference(reference))
+        {
+            fprintf(stderr, "simd_test: %s differs from the reference at "
+                    "level %d.\n", reference, level);
+            ++failures;
+        }
+    }
+
+    bmp_set_simd_level(BMP_SIMD_NONE);
+    ++checks;
+    if (check_bitfields())
+    {
+        fprintf(stderr, "simd_test: wrong coding of a BI_BITFIELDS image.\n");
+        ++failures;
+    }
+
+    snprintf(inputs[0].name, sizeof inputs[0].name, "24bit.bmp");
+    snprintf(inputs[0].path, sizeof inputs[0].path, "%s", reference);
+    inputs[0].bpp = 24;
+    ++inputs_no;
+    for (width = 1; width <= MAX_WIDTH; ++width)
+    {
+        for (k = 0; k < bpps_no; ++k)
+        {
+            if (make_input(&inputs[inputs_no++], dir, width, bpps[k], &s))
+            {
+                fprintf(stderr, "simd_test: cannot create the inputs.\n");
+                return 1;
+            }
+        }
+    }
+
+    if (max_level == BMP_SIMD_NONE)
+        printf("No SIMD level available, only the scalar code is run.\n");
+
+    for (i = 0; i < inputs_no; ++i)
+    {
+        for (k = 0; k < cases_no; ++k)
+        {
+            Output ref = {NULL, 0, 0};
+
+            if (inputs[i].bpp < cases[k].min_bpp)
+                continue;
+
+            bmp_set_simd_level(BMP_SIMD_NONE);
+            cases[k].fn(&inputs[i], &ref);
+            if (ref.failed)
+            {
+                fprintf(stderr, "simd_test: %s failed on %s (scalar).\n",
+                        cases[k].name, inputs[i].name);
+                ++failures;
+            }
+
+            for (level = BMP_SIMD_NONE + 1; level <= max_level; ++level)
+            {
+                Output out = {NULL, 0, 0};
+
+                bmp_set_simd_level(level);
+                cases[k].fn(&inputs[i], &out);
+                ++checks;
+                if (out.failed
+                        || out.size != ref.size
+                        || memcmp(out.data, ref.data, ref.size))
+                {
+                    fprintf(stderr, "simd_test: %s differs on %s at level "
+                            "%d.\n", cases[k].name, inputs[i].name, level);
+                    ++failures;
+                }
+                free(out.data);
+            }
+            free(ref.data);
+        }
+
+        /* the first input is the reference file */
+        if (i)
+            remove(inputs[i].path);
+    }
+    remove(out_path);
+
+    bmp_set_simd_level(max_level);
+    printf("%d checks over %d SIMD level%s, %d failed: %s\n",
+           checks, max_level, max_level == 1 ? "" : "s", failures,
+           failures ? "FAIL" : "PASS");
+    return failures ? 1 : 0;
+}